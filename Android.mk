@@ -25,37 +25,36 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := audio.codec_offload.$(TARGET_DEVICE)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 #LOCAL_CFLAGS := -std=c99
-LOCAL_SRC_FILES := codec_offload_hal.cpp
+LOCAL_SRC_FILES := codec_offload_hal.cpp \
+                   codec_offload_aac.cpp \
+                   codec_offload_buffer.cpp \
+                   codec_offload_endpoint.cpp \
+                   codec_offload_kvparser.cpp \
+                   codec_offload_log.cpp \
+                   codec_offload_next_format.cpp \
+                   codec_offload_ppp.cpp \
+                   codec_offload_shm.cpp \
+                   codec_offload_trace.cpp \
+                   codec_offload_volume.cpp
 LOCAL_SHARED_LIBRARIES := liblog libcutils \
                           libutils \
                           libasound \
                           libtinycompress \
+                          libtinyalsa \
                           libhardware_legacy \
                           libmedia
 
-ifeq ($(strip $(MRFLD_AUDIO)),true)
-LOCAL_SHARED_LIBRARIES += libtinyalsa
-endif
-
 LOCAL_STATIC_LIBRARIES := libmedia_helper
 LOCAL_MODULE_TAGS := optional
 
 LOCAL_C_INCLUDES := $(call include-path-for, alsa-lib) \
                     $(call include-path-for, frameworks-base) \
                     $(call include-path-for, tinycompress)/tinycompress \
-                    $(call include-path-for, tinycompress)/sound
-
-ifeq ($(strip $(MRFLD_AUDIO)),true)
-LOCAL_C_INCLUDES += external/tinyalsa/include
-endif
+                    $(call include-path-for, tinycompress)/sound \
+                    external/tinyalsa/include
 
-ifeq ($(strip $(MRFLD_AUDIO)),true)
-LOCAL_CFLAGS += -DMRFLD_AUDIO
-endif
-
-ifeq ($(strip $(AUDIO_OFFLOAD_SCALABILITY)),true)
-LOCAL_CFLAGS += -DAUDIO_OFFLOAD_SCALABILITY
-endif
+# The SST, mixer and scalability backends are all built in and picked at
+# runtime, see offload_select_backend(). offload.backend overrides the probe.
 
 include $(BUILD_SHARED_LIBRARY)
 
@@ -70,3 +69,5 @@ include $(BUILD_SHARED_LIBRARY)
 #LOCAL_MODULE_TAGS := optional
 
 #include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
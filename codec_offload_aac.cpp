@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_aac"
+//#define LOG_NDEBUG 0
+#include <string.h>
+#include <cutils/log.h>
+
+#include "codec_offload_aac.h"
+
+static uint32_t offload_aac_mode(int32_t object_type)
+{
+    switch (object_type) {
+    case OFFLOAD_AAC_AOT_MAIN:
+        return SND_AUDIOMODE_AAC_MAIN;
+    case OFFLOAD_AAC_AOT_LC:
+        return SND_AUDIOMODE_AAC_LC;
+    case OFFLOAD_AAC_AOT_SSR:
+        return SND_AUDIOMODE_AAC_SSR;
+    case OFFLOAD_AAC_AOT_LTP:
+        return SND_AUDIOMODE_AAC_LTP;
+    case OFFLOAD_AAC_AOT_SBR:
+        return SND_AUDIOMODE_AAC_HE;
+    case OFFLOAD_AAC_AOT_SCALABLE:
+        return SND_AUDIOMODE_AAC_SCALABLE;
+    case OFFLOAD_AAC_AOT_ER_LC:
+        return SND_AUDIOMODE_AAC_ERLC;
+    case OFFLOAD_AAC_AOT_LD:
+        return SND_AUDIOMODE_AAC_LD;
+    case OFFLOAD_AAC_AOT_PS:
+        return SND_AUDIOMODE_AAC_HE_PS;
+    default:
+        return 0;
+    }
+}
+
+uint32_t offload_aac_configure(struct snd_codec *codec, int32_t object_type,
+                               int32_t down_sampling, uint32_t min_rate)
+{
+    uint32_t rate = codec->sample_rate;
+
+    codec->profile = SND_AUDIOPROFILE_AAC;
+    codec->ch_mode = offload_aac_mode(object_type);
+    codec->format = SND_AUDIOSTREAMFORMAT_RAW;
+    memset(&codec->options, 0, sizeof(codec->options));
+    if (codec->ch_mode != SND_AUDIOMODE_AAC_HE &&
+            codec->ch_mode != SND_AUDIOMODE_AAC_HE_PS)
+        return rate;
+    if (rate > OFFLOAD_AAC_MAX_OUTPUT_RATE ||
+            (down_sampling && rate / 2 >= min_rate)) {
+        codec->options.generic.reserved[OFFLOAD_AAC_OPT_WORD] |=
+                OFFLOAD_AAC_OPT_DOWNSAMPLED_SBR;
+        rate /= 2;
+    }
+    ALOGV("offload_aac_configure: object type %d, mode 0x%x, output %u Hz",
+          object_type, codec->ch_mode, rate);
+    return rate;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_AAC_H
+#define CODEC_OFFLOAD_AAC_H
+
+#include <stdint.h>
+#include <compress_params.h>
+
+/* AudioObjectType values (ISO/IEC 14496-3) AudioFlinger passes for AAC as
+ * AUDIO_OFFLOAD_CODEC_ID
+ */
+#define OFFLOAD_AAC_AOT_MAIN            1
+#define OFFLOAD_AAC_AOT_LC              2
+#define OFFLOAD_AAC_AOT_SSR             3
+#define OFFLOAD_AAC_AOT_LTP             4
+#define OFFLOAD_AAC_AOT_SBR             5       /* HE-AAC */
+#define OFFLOAD_AAC_AOT_SCALABLE        6
+#define OFFLOAD_AAC_AOT_ER_LC           17
+#define OFFLOAD_AAC_AOT_LD              23
+#define OFFLOAD_AAC_AOT_PS              29      /* HE-AAC v2 */
+
+/* The compress headers define no AAC decoder options: the flags go in
+ * options.generic.reserved[OFFLOAD_AAC_OPT_WORD].
+ */
+#define OFFLOAD_AAC_OPT_WORD            0
+/* SBR runs in downsampled mode: the DSP outputs at half the stream rate */
+#define OFFLOAD_AAC_OPT_DOWNSAMPLED_SBR 0x1
+
+/* Highest rate the DSP outputs; SBR above it is always downsampled */
+#define OFFLOAD_AAC_MAX_OUTPUT_RATE     48000
+/* Lowest output rate downsampled SBR may give, offload.aac.dsbr.min.rate */
+#define OFFLOAD_AAC_DSBR_MIN_RATE       22050
+
+/* Fills the profile, ch_mode, format and options of an AAC snd_codec whose
+ * sample_rate, the rate with SBR applied, is set. SBR is downsampled when
+ * down_sampling (AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING) asks for it and half
+ * the rate is at least min_rate, or when the full rate is above what the
+ * DSP outputs. An unknown object type leaves the mode to the DSP.
+ * Returns the rate the DSP outputs.
+ */
+uint32_t offload_aac_configure(struct snd_codec *codec, int32_t object_type,
+                               int32_t down_sampling, uint32_t min_rate);
+
+static inline bool offload_aac_downsampled_sbr(const struct snd_codec *codec)
+{
+    return codec->options.generic.reserved[OFFLOAD_AAC_OPT_WORD] &
+           OFFLOAD_AAC_OPT_DOWNSAMPLED_SBR;
+}
+
+#endif /* CODEC_OFFLOAD_AAC_H */
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_buffer"
+//#define LOG_NDEBUG 0
+#include <cutils/log.h>
+
+#include "codec_offload_buffer.h"
+
+#define OFFLOAD_TRANSFER_INTERVAL   8         /* Default intervel in sec */
+#define OFFLOAD_PCM_TRANSFER_MS     2000      /* PCM fragment duration */
+#define OFFLOAD_PCM_MAX_BUFSIZE     (512*1024) /* bytes */
+#define OFFLOAD_MIN_KNOWN_BITRATE   12000     /* below, the rate is a guess */
+#define OFFLOAD_CAPTURE_INTERVAL    2         /* DSP encode period in sec */
+#define OFFLOAD_CAPTURE_LEGACY_SIZE 320       /* bytes */
+
+static bool buffer_is_pcm(audio_format_t format)
+{
+    return format == AUDIO_FORMAT_PCM_16_BIT ||
+           format == AUDIO_FORMAT_PCM_8_24_BIT;
+}
+
+static bool buffer_is_encoded(audio_format_t format)
+{
+    return format == AUDIO_FORMAT_AAC ||
+           format == AUDIO_FORMAT_AMR_NB ||
+           format == AUDIO_FORMAT_AMR_WB;
+}
+
+/* Make the bufferSize to be of 2^n bytes */
+static uint32_t buffer_round_down(uint32_t bufSize)
+{
+    for (uint32_t i = 1; (bufSize & ~i) != 0; i<<=1)
+         bufSize &= ~i;
+    return bufSize;
+}
+
+// Goal is to compute an optimal bufferSize that shall be used by
+// Multimedia framework in transferring the encoded stream to LPE firmware
+// in duration of OFFLOAD_TRANSFER_INTERVAL defined
+static uint32_t buffer_compressed_size(uint32_t bitRate, uint32_t samplingRate,
+                                       uint32_t channel)
+{
+    uint32_t bufSize = 0;
+    if (bitRate >= OFFLOAD_MIN_KNOWN_BITRATE) {
+        bufSize = (OFFLOAD_TRANSFER_INTERVAL*bitRate)/8; /* in bytes */
+    }
+    else {
+        // Though we could not take the decision based on exact bit-rate,
+        // select optimal bufferSize based on samplingRate & Channel of the stream
+        if (samplingRate<=8000)
+            bufSize = 2*1024; // Voice data in Mono/Stereo
+        else if (channel == AUDIO_CHANNEL_OUT_MONO)
+            bufSize = 4*1024; // Mono music
+        else if (samplingRate<=32000)
+            bufSize = 16*1024; // Stereo low quality music
+        else if (samplingRate<=48000)
+            bufSize = 32*1024; // Stereo high quality music
+        else
+            bufSize = 64*1024; // HiFi stereo music
+    }
+
+    if (bufSize < OFFLOAD_MIN_ALLOWED_BUFSIZE)
+        bufSize = OFFLOAD_MIN_ALLOWED_BUFSIZE;
+    if (bufSize > OFFLOAD_MAX_ALLOWED_BUFSIZE)
+        bufSize = OFFLOAD_MAX_ALLOWED_BUFSIZE;
+    return buffer_round_down(bufSize);
+}
+
+/* A PCM fragment holds OFFLOAD_PCM_TRANSFER_MS of audio, so that pass-through
+ * PCM wakes the AP about as rarely as compressed offload does. 2^n bytes are
+ * a whole number of mono and stereo frames.
+ */
+static uint32_t buffer_pcm_size(uint32_t byteRate)
+{
+    uint32_t bufSize = (uint32_t)((uint64_t)byteRate *
+                                  OFFLOAD_PCM_TRANSFER_MS / 1000);
+
+    if (bufSize < OFFLOAD_MIN_ALLOWED_BUFSIZE)
+        bufSize = OFFLOAD_MIN_ALLOWED_BUFSIZE;
+    if (bufSize > OFFLOAD_PCM_MAX_BUFSIZE)
+        bufSize = OFFLOAD_PCM_MAX_BUFSIZE;
+    return buffer_round_down(bufSize);
+}
+
+void offload_buffer_config_get(audio_format_t format, uint32_t bit_rate,
+                               uint32_t sample_rate, uint32_t channel_mask,
+                               struct offload_buffer_config *config)
+{
+    uint32_t byte_rate = 0;
+
+    if (buffer_is_pcm(format)) {
+        byte_rate = sample_rate * popcount(channel_mask) *
+                    audio_bytes_per_sample(format);
+        config->fragment_size = buffer_pcm_size(byte_rate);
+    } else {
+        if (bit_rate >= OFFLOAD_MIN_KNOWN_BITRATE)
+            byte_rate = bit_rate / 8;
+        config->fragment_size = buffer_compressed_size(bit_rate, sample_rate,
+                                                       channel_mask);
+    }
+    config->fragments = OFFLOAD_FRAGMENTS;
+    config->wakeup_ms = byte_rate ? (uint32_t)((uint64_t)config->fragment_size *
+                                               1000 / byte_rate) : 0;
+    ALOGV("offload_buffer_config_get: format=%x BR=%u SR=%u CC=%x "
+          "fragment=%u wakeup=%u ms", format, bit_rate, sample_rate,
+          channel_mask, config->fragment_size, config->wakeup_ms);
+}
+
+/* OFFLOAD_CAPTURE_INTERVAL worth of encoded data, clamped and rounded down
+ * to 2^n bytes as for playback; shorter than the playback interval, since
+ * a recording must reach the client while it runs.
+ */
+void offload_buffer_capture_config_get(audio_format_t format,
+                                       uint32_t bit_rate,
+                                       struct offload_buffer_config *config)
+{
+    config->fragments = OFFLOAD_FRAGMENTS;
+    if (!buffer_is_encoded(format) || !bit_rate) {
+        config->fragment_size = OFFLOAD_CAPTURE_LEGACY_SIZE;
+        config->wakeup_ms = 0;
+        return;
+    }
+    uint32_t bufSize = (OFFLOAD_CAPTURE_INTERVAL * bit_rate) / 8;
+    if (bufSize < OFFLOAD_MIN_ALLOWED_BUFSIZE)
+        bufSize = OFFLOAD_MIN_ALLOWED_BUFSIZE;
+    if (bufSize > OFFLOAD_MAX_ALLOWED_BUFSIZE)
+        bufSize = OFFLOAD_MAX_ALLOWED_BUFSIZE;
+    config->fragment_size = buffer_round_down(bufSize);
+    config->wakeup_ms = (uint32_t)((uint64_t)config->fragment_size * 8000 /
+                                   bit_rate);
+    ALOGV("offload_buffer_capture_config_get: format=%x BR=%u fragment=%u "
+          "wakeup=%u ms", format, bit_rate, config->fragment_size,
+          config->wakeup_ms);
+}
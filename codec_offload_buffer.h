@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_BUFFER_H
+#define CODEC_OFFLOAD_BUFFER_H
+
+#include <stdint.h>
+#include <system/audio.h>
+
+/* Buffer sizing of offloaded streams, shared by open_output_stream and the
+ * framework query.
+ *
+ * get_parameters on the device with
+ *   "offload_buffer_size;format=<f>;sampling_rate=<hz>;channels=<mask>;
+ *    music_offload_avg_bit_rate=<bps>"
+ * returns "offload_buffer_size=<fragment_size>,<fragments>,<wakeup_ms>"
+ * for a stream opened with that configuration, without touching any
+ * stream, so that the client can size its own buffers to whole fragments.
+ * Nothing is returned for a format that cannot be offloaded.
+ */
+#define OFFLOAD_BUFFER_SIZE_KEY     "offload_buffer_size"
+
+#define OFFLOAD_FRAGMENTS           2           /* DSP ring, in fragments */
+#define OFFLOAD_MIN_ALLOWED_BUFSIZE (2*1024)    /* bytes */
+#define OFFLOAD_MAX_ALLOWED_BUFSIZE (128*1024)  /* bytes, compressed */
+
+struct offload_buffer_config {
+    uint32_t fragment_size;         /* bytes, what out_write takes at once */
+    uint32_t fragments;
+    uint32_t wakeup_ms;             /* DSP time per fragment, 0 if the bit
+                                       rate is unknown */
+};
+
+/* Pure function of the configuration; bit_rate may be 0 when unknown */
+void offload_buffer_config_get(audio_format_t format, uint32_t bit_rate,
+                               uint32_t sample_rate, uint32_t channel_mask,
+                               struct offload_buffer_config *config);
+
+/* The same for a capture stream the DSP encodes to format at bit_rate.
+ * Formats it does not encode, or a bit rate of 0, get the legacy input
+ * buffer.
+ */
+void offload_buffer_capture_config_get(audio_format_t format,
+                                       uint32_t bit_rate,
+                                       struct offload_buffer_config *config);
+
+#endif /* CODEC_OFFLOAD_BUFFER_H */
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_endpoint"
+//#define LOG_NDEBUG 0
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include <compress_params.h>
+#include <tinycompress.h>
+
+#include "codec_offload_endpoint.h"
+
+/* The codecs the HAL can configure, probed on every endpoint */
+static const uint32_t offload_endpoint_codecs[] = {
+    SND_AUDIOCODEC_PCM,
+    SND_AUDIOCODEC_MP3,
+    SND_AUDIOCODEC_AAC,
+    SND_AUDIOCODEC_AMR,
+    SND_AUDIOCODEC_AMRWB,
+};
+
+void offload_endpoints_init(struct offload_endpoints *endpoints)
+{
+    memset(endpoints, 0, sizeof(*endpoints));
+    pthread_mutex_init(&endpoints->lock, NULL);
+}
+
+void offload_endpoints_destroy(struct offload_endpoints *endpoints)
+{
+    pthread_mutex_destroy(&endpoints->lock);
+}
+
+/* Reads the first line of a proc file, without the newline */
+static int offload_endpoint_read_line(const char *path, char *line, size_t size)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -errno;
+    if (!fgets(line, size, file)) {
+        fclose(file);
+        return -EIO;
+    }
+    fclose(file);
+    line[strcspn(line, "\n")] = '\0';
+    return 0;
+}
+
+/* Fills card, device, direction and id from a comprM/info file */
+static int offload_endpoint_read_info(const char *path,
+                                      struct offload_endpoint *ep)
+{
+    char line[64];
+    char value[32];
+    FILE *file = fopen(path, "r");
+
+    if (!file)
+        return -errno;
+    ep->card = -1;
+    ep->device = -1;
+    ep->direction = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "card: %d", &ep->card) == 1 ||
+                sscanf(line, "device: %d", &ep->device) == 1)
+            continue;
+        if (sscanf(line, "stream: %31s", value) == 1) {
+            if (!strcmp(value, "PLAYBACK"))
+                ep->direction = OFFLOAD_ENDPOINT_PLAYBACK;
+            else if (!strcmp(value, "CAPTURE"))
+                ep->direction = OFFLOAD_ENDPOINT_CAPTURE;
+        } else {
+            sscanf(line, "id: %31[^\n]", ep->id);
+        }
+    }
+    fclose(file);
+    return ep->card >= 0 && ep->device >= 0 && ep->direction ? 0 : -EINVAL;
+}
+
+static void offload_endpoint_probe(struct offload_endpoint *ep)
+{
+    unsigned int flags = ep->direction == OFFLOAD_ENDPOINT_PLAYBACK ?
+                                COMPRESS_IN : COMPRESS_OUT;
+    size_t i;
+
+    ep->codecs = 0;
+    for (i = 0; i < sizeof(offload_endpoint_codecs) /
+                    sizeof(offload_endpoint_codecs[0]); i++) {
+        struct snd_codec codec;
+        memset(&codec, 0, sizeof(codec));
+        codec.id = offload_endpoint_codecs[i];
+        if (is_codec_supported(ep->card, ep->device, flags, &codec))
+            ep->codecs |= 1u << codec.id;
+    }
+    // Busy or without GET_CAPS: let compress_open tell
+    if (!ep->codecs)
+        ep->codecs = OFFLOAD_ENDPOINT_ANY_CODEC;
+}
+
+/* Keeps the list sorted by card, then device */
+static void offload_endpoints_insert(struct offload_endpoints *endpoints,
+                                     const struct offload_endpoint *ep)
+{
+    int i = endpoints->count;
+
+    while (i > 0 && (endpoints->endpoint[i - 1].card > ep->card ||
+                     (endpoints->endpoint[i - 1].card == ep->card &&
+                      endpoints->endpoint[i - 1].device > ep->device))) {
+        endpoints->endpoint[i] = endpoints->endpoint[i - 1];
+        i--;
+    }
+    endpoints->endpoint[i] = *ep;
+    endpoints->count++;
+}
+
+static void offload_endpoints_scan_card(struct offload_endpoints *endpoints,
+                                        const char *root, int card)
+{
+    char path[PATH_MAX];
+    char card_id[32] = "";
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/card%d/id", root, card);
+    offload_endpoint_read_line(path, card_id, sizeof(card_id));
+    snprintf(path, sizeof(path), "%s/card%d", root, card);
+    dir = opendir(path);
+    if (!dir)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        struct offload_endpoint ep;
+        int device, end = 0;
+
+        if (sscanf(entry->d_name, "compr%d%n", &device, &end) != 1 ||
+                entry->d_name[end] != '\0')
+            continue;
+        if (endpoints->count == OFFLOAD_MAX_ENDPOINTS) {
+            ALOGW("offload_endpoints_scan: more than %d endpoints, card%d "
+                  "compr%d ignored", OFFLOAD_MAX_ENDPOINTS, card, device);
+            continue;
+        }
+        memset(&ep, 0, sizeof(ep));
+        snprintf(path, sizeof(path), "%s/card%d/compr%d/info", root, card,
+                 device);
+        if (offload_endpoint_read_info(path, &ep) < 0) {
+            ALOGW("offload_endpoints_scan: no usable %s", path);
+            continue;
+        }
+        snprintf(ep.card_id, sizeof(ep.card_id), "%s", card_id);
+        offload_endpoint_probe(&ep);
+        offload_endpoints_insert(endpoints, &ep);
+    }
+    closedir(dir);
+}
+
+int offload_endpoints_scan(struct offload_endpoints *endpoints,
+                           const char *root)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    pthread_mutex_lock(&endpoints->lock);
+    endpoints->count = 0;
+    dir = opendir(root);
+    if (!dir) {
+        ALOGE("offload_endpoints_scan: cannot open %s: %s", root,
+              strerror(errno));
+        pthread_mutex_unlock(&endpoints->lock);
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        int card, end = 0;
+
+        // cardN directories only; the card id entries are symlinks to them
+        if (sscanf(entry->d_name, "card%d%n", &card, &end) != 1 ||
+                entry->d_name[end] != '\0')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", root, entry->d_name);
+        if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+            continue;
+        offload_endpoints_scan_card(endpoints, root, card);
+    }
+    closedir(dir);
+    int count = endpoints->count;
+    pthread_mutex_unlock(&endpoints->lock);
+    ALOGI("offload_endpoints_scan: %d compress endpoints under %s", count,
+          root);
+    return count;
+}
+
+int offload_endpoints_find(struct offload_endpoints *endpoints, int card,
+                           int device)
+{
+    int i, found = -1;
+
+    pthread_mutex_lock(&endpoints->lock);
+    for (i = 0; i < endpoints->count; i++) {
+        if (endpoints->endpoint[i].card == card &&
+                endpoints->endpoint[i].device == device) {
+            found = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&endpoints->lock);
+    return found;
+}
+
+int offload_endpoints_acquire(struct offload_endpoints *endpoints,
+                              uint32_t direction, uint32_t codec_id,
+                              int preferred, uint32_t *tried,
+                              int *card, int *device)
+{
+    int i, best = -ENODEV;
+
+    pthread_mutex_lock(&endpoints->lock);
+    for (i = 0; i < endpoints->count; i++) {
+        struct offload_endpoint *ep = &endpoints->endpoint[i];
+        if (ep->direction != direction || (*tried & (1u << i)) ||
+                codec_id >= 32 || !(ep->codecs & (1u << codec_id)))
+            continue;
+        if (best < 0 ||
+                ep->streams < endpoints->endpoint[best].streams ||
+                (ep->streams == endpoints->endpoint[best].streams &&
+                 i == preferred))
+            best = i;
+    }
+    if (best >= 0) {
+        struct offload_endpoint *ep = &endpoints->endpoint[best];
+        ep->streams++;
+        ep->placed++;
+        *tried |= 1u << best;
+        *card = ep->card;
+        *device = ep->device;
+    }
+    pthread_mutex_unlock(&endpoints->lock);
+    return best;
+}
+
+void offload_endpoints_release(struct offload_endpoints *endpoints, int index)
+{
+    pthread_mutex_lock(&endpoints->lock);
+    if (index >= 0 && index < endpoints->count &&
+            endpoints->endpoint[index].streams)
+        endpoints->endpoint[index].streams--;
+    pthread_mutex_unlock(&endpoints->lock);
+}
+
+static void offload_endpoints_printf(int fd, const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+    write(fd, line, len);
+}
+
+void offload_endpoints_dump(struct offload_endpoints *endpoints, int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&endpoints->lock);
+    offload_endpoints_printf(fd, "compress endpoints: %d\n", endpoints->count);
+    for (i = 0; i < endpoints->count; i++) {
+        struct offload_endpoint *ep = &endpoints->endpoint[i];
+        offload_endpoints_printf(fd, "  card%d (%s) compr%d %-8s codecs "
+                                 "0x%08x streams %u, %u placed  %s\n",
+                                 ep->card, ep->card_id, ep->device,
+                                 ep->direction == OFFLOAD_ENDPOINT_PLAYBACK ?
+                                         "playback" : "capture",
+                                 ep->codecs, ep->streams, ep->placed, ep->id);
+    }
+    pthread_mutex_unlock(&endpoints->lock);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_ENDPOINT_H
+#define CODEC_OFFLOAD_ENDPOINT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* The compress endpoints of the sound cards, found once under /proc/asound
+ * (FILE_PATH): every cardN/comprM/info the kernel exports, that is
+ *
+ *   card: N
+ *   device: M
+ *   stream: PLAYBACK | CAPTURE
+ *   id: <device id>
+ *
+ * together with the card id from cardN/id and the codecs the endpoint
+ * accepts, probed with is_codec_supported(). Streams are placed on the
+ * endpoint of their direction with the fewest open streams that takes
+ * their codec.
+ */
+#define OFFLOAD_MAX_ENDPOINTS           8
+#define OFFLOAD_ENDPOINT_PLAYBACK       0x1
+#define OFFLOAD_ENDPOINT_CAPTURE        0x2
+/* Codecs of an endpoint that refused the probe, left to compress_open */
+#define OFFLOAD_ENDPOINT_ANY_CODEC      0xffffffff
+
+struct offload_endpoint {
+    int card;
+    int device;
+    uint32_t direction;         /* OFFLOAD_ENDPOINT_PLAYBACK or _CAPTURE */
+    uint32_t codecs;            /* 1 << SND_AUDIOCODEC_* */
+    char card_id[32];
+    char id[32];
+    uint32_t streams;           /* streams open on it */
+    uint32_t placed;            /* streams placed on it since the scan */
+};
+
+struct offload_endpoints {
+    pthread_mutex_t lock;
+    int count;
+    struct offload_endpoint endpoint[OFFLOAD_MAX_ENDPOINTS];
+};
+
+void offload_endpoints_init(struct offload_endpoints *endpoints);
+void offload_endpoints_destroy(struct offload_endpoints *endpoints);
+
+/* Replaces the list with the endpoints under 'root', sorted by card then
+ * device. Returns their number.
+ */
+int offload_endpoints_scan(struct offload_endpoints *endpoints,
+                           const char *root);
+
+/* Returns the endpoint at card:device, -1 if none */
+int offload_endpoints_find(struct offload_endpoints *endpoints, int card,
+                           int device);
+
+/* Takes a stream slot on the least loaded endpoint of 'direction' taking
+ * 'codec_id', skipping the endpoints set in *tried, and sets its bit there.
+ * Ties go to 'preferred', then to the lowest card and device. Returns the
+ * endpoint index with its card and device, -ENODEV when none is left.
+ */
+int offload_endpoints_acquire(struct offload_endpoints *endpoints,
+                              uint32_t direction, uint32_t codec_id,
+                              int preferred, uint32_t *tried,
+                              int *card, int *device);
+void offload_endpoints_release(struct offload_endpoints *endpoints,
+                               int index);
+
+void offload_endpoints_dump(struct offload_endpoints *endpoints, int fd);
+
+#endif /* CODEC_OFFLOAD_ENDPOINT_H */
@@ -23,7 +23,9 @@
 #include <sys/time.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -36,7 +38,9 @@
 #include <linux/poll.h>
 #include <cutils/log.h>
 #include <cutils/properties.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <time.h>
 #include <string.h>
 #include <utils/threads.h>
@@ -44,6 +48,7 @@
 #include <compress_params.h>
 #include <tinycompress.h>
 #include <cutils/list.h>
+#include <cutils/atomic.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
 #include <cutils/sched_policy.h>
@@ -51,39 +56,70 @@
 extern "C" {
 #include <cutils/str_parms.h>
 }
-#ifdef MRFLD_AUDIO
 #include <tinyalsa/asoundlib.h>
-#endif
 
 #define _POSIX_SOURCE
 #include <alsa/asoundlib.h>
 #include <cutils/properties.h>
 
+#include "codec_offload_aac.h"
+#include "codec_offload_buffer.h"
+#include "codec_offload_endpoint.h"
+#include "codec_offload_handoff.h"
+#include "codec_offload_kvparser.h"
+#include "codec_offload_log.h"
+#include "codec_offload_next_format.h"
+#include "codec_offload_ppp.h"
+#include "codec_offload_shm.h"
+#include "codec_offload_volume.h"
+#include "codec_offload_trace.h"
+
+/* Codec of the next gapless track, sent after compress_next_track. Only in
+ * tinycompress builds for kernels taking SET_PARAMS at a track boundary
+ * (Linux 5.7 onwards), hence weak: NULL when the library lacks it.
+ */
+extern "C" int compress_set_codec_params(struct compress *compress,
+                                         struct snd_codec *codec)
+        __attribute__((weak));
+
 #define CODEC_OFFLOAD_BUFSIZE       (64*1024) /* Default buffer size in bytes */
 #define CODEC_OFFLOAD_LATENCY       10      /* Default latency in mSec  */
 #define CODEC_OFFLOAD_SAMPLINGRATE  48000     /* Default sampling rate in Hz */
 #define CODEC_OFFLOAD_BITRATE       128000    /* Default bitrate in bps  */
 #define CODEC_OFFLOAD_PCM_WORD_SIZE 16        /* Default PCM wordsize in bits */
 #define CODEC_OFFLOAD_CHANNEL_COUNT 2         /* Default channel count */
-#define OFFLOAD_TRANSFER_INTERVAL   8         /* Default intervel in sec */
-#define OFFLOAD_MIN_ALLOWED_BUFSIZE (2*1024)   /*  bytes */
-#define OFFLOAD_MAX_ALLOWED_BUFSIZE (128*1024) /*  bytes */
 
 #define OFFLOAD_STREAM_DEFAULT_OUTPUT   2      /* Speaker */
 #define MIXER_VOL_CTL_NAME "Compress Volume"
+#define MIXER_ROUTE_CTL_NAME "Compress Output Route"
+#define MIXER_ROUTE_SPEAKER "Speaker"
+#define MIXER_ROUTE_HEADSET "Headset"
+/* Overridable so that the tools can run the HAL against a fake card tree */
+#ifndef FILE_PATH
 #define FILE_PATH "/proc/asound"
+#endif
 
-#ifdef MRFLD_AUDIO
 /* -1440 is the value expected by vol lib for a gain of -144dB */
-#define SST_VOLUME_MUTE 0xFA60 /* 2s complement of 1440 */
-#else
+#define MIXER_VOLUME_MUTE 0xFA60 /* 2s complement of 1440 */
 #define SST_VOLUME_MUTE 0xA0
 #define SST_VOLUME_TYPE 0x602
 #define SST_VOLUME_SIZE 1
 #define SST_PPP_VOL_STR_ID  0x03
 #define SST_CODEC_VOLUME_CONTROL 0x67
-#endif
-#define CODEC_OFFLOAD_INPUT_BUFFERSIZE 320
+#define SST_CTRL_DEVICE "/dev/intel_sst_ctrl"
+#define CAPTURE_AAC_BITRATE         64000     /* Default AAC encode bitrate */
+#define CAPTURE_AMR_NB_BITRATE      12200
+#define CAPTURE_AMR_WB_BITRATE      23850
+#define CAPTURE_POSITION_KEY        "capture_position_ms"
+#define OFFLOAD_STATS_KEY           "offload_stats"   /* see out_add_stats */
+#define OFFLOAD_SHM_FRAGMENTS       4         /* shared ring, in fragments */
+#define OFFLOAD_WATCHDOG_MS         0         /* DSP stall before recovery,
+                                                 off unless set */
+#define OFFLOAD_WATCHDOG_REOPENS    2         /* open_device attempts */
+#define OFFLOAD_RAMP_STEP_MS        20        /* volume ramp update period */
+#define OFFLOAD_RAMP_MIN_STEP_MS    5
+#define OFFLOAD_PAUSE_TIMEOUT_MS    0         /* pause before the DSP is
+                                                 released, off unless set */
 using namespace android;
 static char lockid_offload[32] = "codec_offload_hal";
 enum {
@@ -91,6 +127,9 @@ enum {
     OFFLOAD_CMD_DRAIN,              /* send a full drain request to DSP */
     OFFLOAD_CMD_PARTIAL_DRAIN,      /* send a partial drain request to DSP */
     OFFLOAD_CMD_WAIT_FOR_BUFFER,    /* wait for buffer released by DSP */
+    OFFLOAD_CMD_HANDOFF,            /* report the stream handed off */
+    OFFLOAD_CMD_HANDOFF_RETRY,      /* reopen a handed off stream */
+    OFFLOAD_CMD_TRACE_FLUSH,        /* write the entry point trace out */
 };
 /* stream states */
 typedef enum {
@@ -105,6 +144,7 @@ typedef enum {
 struct offload_cmd {
     struct listnode node;
     int cmd;
+    uint64_t posted_ns;
     int data[];
 };
 /* The data structure used for passing the codec specific information to the
@@ -129,13 +169,99 @@ typedef struct{
 
 static CodecInformation mCodec;
 
+/* Tells the primary HAL that offload starts or stops. AudioSystem::setParameters
+ * is a binder round trip, so it runs on its own thread instead of inside
+ * out_write or standby. Only the latest requested state matters: a request
+ * equal to the pending or last delivered one is dropped, and the thread never
+ * delivers an older state after a newer one.
+ */
+struct offload_notifier {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int requested;              /* AUDIO_OUTPUT_FLAG_* to deliver */
+    int delivered;              /* last one AudioSystem accepted */
+    bool exit;
+};
+
+/* Hardware backends. All of them are built in: offload_dev_open picks the one
+ * of the board and streams dispatch on it through the out_backend_* switches,
+ * with direct calls and no property lookups on the volume path.
+ */
+typedef enum {
+    OFFLOAD_BACKEND_SST,         /* intel_sst_ctrl SET_ALGO ioctls (legacy) */
+    OFFLOAD_BACKEND_MIXER,       /* "Compress Volume" mixer control (MRFLD) */
+    OFFLOAD_BACKEND_SCALABILITY, /* per stream mixer controls (MRFLD) */
+    OFFLOAD_BACKEND_NUM
+} offload_backend_t;
+
+static const char * const offload_backend_names[OFFLOAD_BACKEND_NUM] = {
+    "sst", "mixer", "scalability",
+};
+
 struct offload_audio_device {
     struct audio_hw_device device;
+    offload_backend_t backend;
+    /* Scalability mixer control names, from offload.mixer.*.ctl.name */
+    char mixVolumeCtl[PROPERTY_VALUE_MAX];
+    char mixMuteCtl[PROPERTY_VALUE_MAX];
+    char mixVolumeRampCtl[PROPERTY_VALUE_MAX];
+    /* DSP output path enum, from offload.mixer.route.ctl.name */
+    char mixRouteCtl[PROPERTY_VALUE_MAX];
+    uint32_t aac_dsbr_min_rate;   /* offload.aac.dsbr.min.rate */
     bool offload_init;
-    uint32_t buffer_size;
-    pthread_mutex_t lock;
+    pthread_mutex_t lock;         /* out, against the pause timer */
     struct offload_stream_out *out;
     int  offload_out_ref_count;
+    struct offload_stream_in *in;
+    struct offload_notifier notifier;
+    struct offload_endpoints endpoints;  /* scanned once, at open */
+};
+
+/* Callers of out->lock, for the contention statistics */
+typedef enum {
+    OUT_LOCK_WRITE,
+    OUT_LOCK_RENDER_POSITION,
+    OUT_LOCK_SET_VOLUME,
+    OUT_LOCK_SET_CALLBACK,
+    OUT_LOCK_OFFLOAD_THREAD,
+    OUT_LOCK_CONTROL,           /* pause, resume, drain, flush, standby */
+    OUT_LOCK_NUM_SITES
+} out_lock_site_t;
+
+struct out_lock_stats {
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_ns;
+    uint64_t hold_max_ns;
+};
+
+/* Scheduling of the offload callback thread, from the offload.cb.* properties */
+struct offload_thread_config {
+    int policy;                 /* SCHED_OTHER keeps the audio nice level */
+    int priority;               /* SCHED_FIFO / SCHED_RR priority */
+    uint32_t cpu_mask;          /* 0 leaves the affinity alone */
+    size_t stack_size;          /* 0 for the pthread default */
+};
+
+/* Latency histogram, bucket i counts samples below 2^i us, the last one
+ * everything above.
+ */
+#define OUT_LATENCY_BUCKETS 16
+
+struct out_latency_hist {
+    uint32_t buckets[OUT_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+};
+
+/* CPU cost of a thread, or summed over the calls of an entry point */
+struct out_cpu_usage {
+    uint64_t cpu_ns;
+    uint32_t voluntary;         /* context switches */
+    uint32_t involuntary;
 };
 
 struct offload_stream_out {
@@ -156,6 +282,8 @@ struct offload_stream_out {
     uint32_t            adjusted_render_offset;
     uint32_t            paused_duration;
     int                 device_output;
+    audio_devices_t     devices;      /* AUDIO_PARAMETER_STREAM_ROUTING */
+    const char          *route;       /* output path set on the DSP */
     timer_t             paused_timer_id;
     pthread_mutex_t               lock;
     int non_blocking;
@@ -170,11 +298,129 @@ struct offload_stream_out {
     struct compr_gapless_mdata gapless_mdata;
     int send_new_metadata;
     int soundCardNo;
-#ifdef AUDIO_OFFLOAD_SCALABILITY
-    char mixVolumeCtl[PROPERTY_VALUE_MAX];
-    char mixMuteCtl[PROPERTY_VALUE_MAX];
-    char mixVolumeRampCtl[PROPERTY_VALUE_MAX];
-#endif
+    int endpoint;                 /* in dev->endpoints, -1 if none taken */
+    offload_backend_t backend;
+    struct mixer *mixer;          /* mixer backends, opened on first use */
+    struct mixer_ctl *vol_ctl;
+    struct mixer_ctl *mute_ctl;   /* scalability mixMuteCtl, may be NULL */
+    struct mixer_ctl *ramp_ctl;   /* scalability mixVolumeRampCtl */
+    struct mixer_ctl *route_ctl;  /* output path, every backend */
+    struct offload_audio_device *dev;
+    struct offload_trace *trace;  /* entry point recorder, NULL when off */
+    bool trace_flush_posted;      /* OFFLOAD_CMD_TRACE_FLUSH queued */
+    bool lock_stats_enabled;
+    int lock_site;                /* site currently holding out->lock */
+    uint64_t lock_acquired_ns;
+    struct out_lock_stats lock_stats[OUT_LOCK_NUM_SITES];
+    bool callback_in_progress;    /* offload_callback running unlocked */
+    volatile int32_t write_ready_us; /* pending WRITE_READY dispatch time */
+    uint32_t write_ready_rtt_count;
+    uint64_t write_ready_rtt_total_us;
+    uint32_t write_ready_rtt_max_us;
+    struct offload_thread_config thread_config;
+    struct offload_ppp_preset ppp;  /* DSP post-processing, out->lock */
+    struct out_latency_hist cmd_wake_hist;  /* command post to thread run */
+    struct out_latency_hist callback_hist;  /* DSP wake to callback */
+    /* DSP stall watchdog, armed while the offload thread waits on the DSP.
+     * The watchdog_ fields and dsp_stalled are protected by watchdog_lock;
+     * paused and ring_size are copied from the stream under out->lock.
+     */
+    uint32_t watchdog_ms;         /* offload.watchdog.ms, 0 disables */
+    bool watchdog_replay;         /* offload.watchdog.replay: keep the pause
+                                     shadow to queue the tail again */
+    pthread_t watchdog_thread;
+    pthread_mutex_t watchdog_lock;
+    pthread_cond_t watchdog_cond;
+    struct compress *watchdog_compress;
+    bool watchdog_drain;          /* armed for a drain, watched by the thread */
+    bool watchdog_paused;
+    uint32_t watchdog_ring_size;
+    bool watchdog_exit;
+    bool dsp_stalled;
+    uint32_t stall_position_ms;   /* DSP position when it stopped */
+    uint32_t stall_queued;        /* bytes it had not consumed */
+    uint32_t recoveries;
+    uint32_t recovery_last_us;
+    uint32_t recovery_max_us;
+    struct offload_shm shm;       /* zero-copy ring, on request */
+    uint64_t shm_bytes;           /* handed to the driver from the ring */
+    uint32_t shm_writes;
+    /* Power accounting, OFFLOAD_STATS_KEY */
+    uint64_t open_ns;
+    struct out_cpu_usage write_cpu;     /* inside out_write, summed */
+    uint32_t writes;
+    struct out_cpu_usage thread_cpu;    /* offload thread, out->lock */
+    uint32_t wakeups;                   /* compress_wait returns */
+    uint32_t wait_timeouts;             /* of which watchdog timeouts */
+    struct out_cpu_usage watchdog_cpu;  /* watchdog thread, watchdog_lock */
+    uint32_t watchdog_polls;            /* watchdog thread, watchdog_lock */
+    /* Volume ramp stepped by the ramp thread, out->lock */
+    uint32_t ramp_ctl_ms;         /* last DSP ramp written, ~0 unknown */
+    bool ramp_active;
+    float ramp_from;
+    float ramp_to;
+    uint64_t ramp_start_ns;
+    uint32_t ramp_ms;
+    int ramp_written;             /* last volume value of the ramp, -1 none */
+    uint32_t ramp_step_ms;
+    bool ramp_thread_started;
+    bool ramp_exit;
+    pthread_t ramp_thread;
+    pthread_cond_t ramp_cond;
+    uint32_t ramps;
+    uint32_t ramp_writes;
+    /* DSP released after a long pause, out->lock. pause_shadow keeps the
+     * last ring of bytes written so that what the DSP had not consumed yet
+     * can be queued again by out_resume. It costs a copy of every write, so
+     * it only exists when the release is enabled, and is not kept once the
+     * shared ring carries the data.
+     */
+    uint32_t pause_timeout_ms;    /* offload.pause.timeout.ms, 0 disables */
+    bool pause_timer_created;
+    uint64_t pause_deadline_ns;
+    bool pause_released;          /* paused with the device closed */
+    uint8_t *pause_shadow;        /* buffer_size * OFFLOAD_FRAGMENTS, also
+                                     replayed after a DSP stall */
+    uint32_t pause_shadow_pos;    /* bytes written, free running */
+    uint8_t *pause_saved;         /* unconsumed at release */
+    uint32_t pause_saved_bytes;
+    uint32_t pause_releases;
+    uint32_t pause_restores;
+    uint32_t pause_restore_max_us;
+    /* Handoff to another output, codec_offload_handoff.h, out->lock */
+    bool handoff_enabled;
+    bool handoff_active;          /* out_write takes nothing */
+    struct offload_handoff handoff;   /* last event */
+    uint64_t bytes_written;       /* since the open or the last flush */
+    uint32_t handoffs;
+    uint32_t handoff_retries;
+    /* Codec of the next track, codec_offload_next_format.h, out->lock.
+     * Taken by the partial drain that ends the current track.
+     */
+    bool next_format_pending;
+    struct offload_next_format next_format;
+    uint32_t codec_switches;      /* changed in place at next_track */
+    uint32_t codec_reopens;       /* changed by a device reopen */
+    uint32_t codec_reopen_max_us;
+};
+
+/* Compressed capture: the DSP encodes AAC or AMR and in_read returns the
+ * encoded frames, so a long recording wakes the AP once per fragment.
+ */
+struct offload_stream_in {
+    struct audio_stream_in stream;
+    pthread_mutex_t lock;
+    struct offload_audio_device *dev;
+    struct compress *compress;
+    int endpoint;               /* in dev->endpoints, -1 if none taken */
+    bool standby;
+    audio_format_t format;
+    uint32_t sample_rate;
+    uint32_t channels;
+    uint32_t bit_rate;
+    size_t buffer_size;
+    audio_devices_t device;
+    uint32_t captured_offset_ms; /* capture time before the last standby */
 };
 
 /* The parameter structure used for getting and setting the volume
@@ -185,11 +431,186 @@ struct offload_vol_algo_param {
     __u8  params;
 }__attribute__((packed));
 
-static size_t offload_dev_get_offload_buffer_size(
-                                 const struct audio_hw_device *dev,
-                                 uint32_t bitRate, uint32_t samplingRate,
-                                 uint32_t channel);
 static int destroy_offload_callback_thread(struct offload_stream_out *out);
+static void out_backend_close_l(struct offload_stream_out *out);
+static int sst_apply_ppp_l(struct offload_stream_out *out, bool all);
+static void out_pause_timer_set_l(struct offload_stream_out *out, bool arm);
+static int out_pause_restore(struct offload_stream_out *out);
+static void out_pause_discard_l(struct offload_stream_out *out);
+static void out_pause_release_l(struct offload_stream_out *out);
+static void out_reapply_volume(struct offload_stream_out *out);
+static bool out_handoff_l(struct offload_stream_out *out,
+                          offload_handoff_reason_t reason, uint32_t queued);
+static int send_offload_cmd_l(struct offload_stream_out* out, int command);
+static int out_ramp_volume_l(struct offload_stream_out *out, float gain,
+                             uint32_t duration_ms);
+static void out_watchdog_pause_l(struct offload_stream_out *out, bool paused);
+
+static const char * const out_lock_site_names[OUT_LOCK_NUM_SITES] = {
+    "write", "render_position", "set_volume", "set_callback",
+    "offload_thread", "control",
+};
+
+/* out->lock wrappers. With offload.lock.stats=1 they account, per call site,
+ * the time spent waiting for the lock and holding it; otherwise they are a
+ * plain lock/unlock.
+ */
+static void out_lock(struct offload_stream_out *out, out_lock_site_t site)
+{
+    if (!out->lock_stats_enabled) {
+        pthread_mutex_lock(&out->lock);
+        return;
+    }
+    uint64_t start_ns = offload_trace_now_ns();
+    bool contended = pthread_mutex_trylock(&out->lock) != 0;
+    if (contended)
+        pthread_mutex_lock(&out->lock);
+    uint64_t now = offload_trace_now_ns();
+    struct out_lock_stats *stats = &out->lock_stats[site];
+    stats->acquisitions++;
+    if (contended)
+        stats->contended++;
+    stats->wait_ns += now - start_ns;
+    if (now - start_ns > stats->wait_max_ns)
+        stats->wait_max_ns = now - start_ns;
+    out->lock_site = site;
+    out->lock_acquired_ns = now;
+}
+
+static void out_account_hold_l(struct offload_stream_out *out)
+{
+    uint64_t held = offload_trace_now_ns() - out->lock_acquired_ns;
+    struct out_lock_stats *stats = &out->lock_stats[out->lock_site];
+    stats->hold_ns += held;
+    if (held > stats->hold_max_ns)
+        stats->hold_max_ns = held;
+}
+
+static void out_unlock(struct offload_stream_out *out)
+{
+    if (out->lock_stats_enabled)
+        out_account_hold_l(out);
+    pthread_mutex_unlock(&out->lock);
+}
+
+/* pthread_cond_wait on out->lock; the wait does not count as holding it */
+static void out_cond_wait(struct offload_stream_out *out, pthread_cond_t *cond)
+{
+    if (!out->lock_stats_enabled) {
+        pthread_cond_wait(cond, &out->lock);
+        return;
+    }
+    int site = out->lock_site;
+    out_account_hold_l(out);
+    pthread_cond_wait(cond, &out->lock);
+    out->lock_site = site;
+    out->lock_acquired_ns = offload_trace_now_ns();
+}
+
+/* out_cond_wait bounded by 'ms' */
+static void out_cond_timedwait(struct offload_stream_out *out,
+                               pthread_cond_t *cond, uint32_t ms)
+{
+    struct timespec ts;
+    int site = out->lock_site;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    if (out->lock_stats_enabled)
+        out_account_hold_l(out);
+    pthread_cond_timedwait(cond, &out->lock, &ts);
+    if (out->lock_stats_enabled) {
+        out->lock_site = site;
+        out->lock_acquired_ns = offload_trace_now_ns();
+    }
+}
+
+static void out_dump_printf(int fd, const char *fmt, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buffer) - 1)
+        len = sizeof(buffer) - 1;
+    if (len > 0 && write(fd, buffer, len) < 0)
+        ALOGW("out_dump: write failed %s", strerror(errno));
+}
+
+static void out_dump_lock_stats(struct offload_stream_out *out, int fd)
+{
+    struct out_lock_stats stats[OUT_LOCK_NUM_SITES];
+    int i;
+
+    if (!out->lock_stats_enabled)
+        return;
+    pthread_mutex_lock(&out->lock);
+    memcpy(stats, out->lock_stats, sizeof(stats));
+    pthread_mutex_unlock(&out->lock);
+
+    out_dump_printf(fd, "out->lock statistics:\n");
+    out_dump_printf(fd, "  %-16s %10s %10s %12s %12s %12s %12s\n", "site",
+                    "acquired", "contended", "wait_avg_us", "wait_max_us",
+                    "hold_avg_us", "hold_max_us");
+    for (i = 0; i < OUT_LOCK_NUM_SITES; i++) {
+        struct out_lock_stats *s = &stats[i];
+        if (!s->acquisitions)
+            continue;
+        out_dump_printf(fd, "  %-16s %10u %10u %12llu %12llu %12llu %12llu\n",
+                        out_lock_site_names[i], s->acquisitions, s->contended,
+                        (unsigned long long)(s->wait_ns / s->acquisitions / 1000),
+                        (unsigned long long)(s->wait_max_ns / 1000),
+                        (unsigned long long)(s->hold_ns / s->acquisitions / 1000),
+                        (unsigned long long)(s->hold_max_ns / 1000));
+    }
+}
+
+static void out_latency_hist_add(struct out_latency_hist *hist, uint64_t ns)
+{
+    uint32_t us = ns / 1000;
+    int bucket = 0;
+
+    while (bucket < OUT_LATENCY_BUCKETS - 1 && us >= (1u << bucket))
+        bucket++;
+    hist->buckets[bucket]++;
+    hist->count++;
+    if (us > hist->max_us)
+        hist->max_us = us;
+}
+
+static void out_dump_latency_hist(int fd, const char *name,
+                                  const struct out_latency_hist *hist)
+{
+    int i;
+
+    if (!hist->count)
+        return;
+    out_dump_printf(fd, "%s: %u samples, max %u us\n", name, hist->count,
+                    hist->max_us);
+    for (i = 0; i < OUT_LATENCY_BUCKETS; i++) {
+        if (!hist->buckets[i])
+            continue;
+        if (i < OUT_LATENCY_BUCKETS - 1)
+            out_dump_printf(fd, "  < %6u us %10u\n", 1u << i,
+                            hist->buckets[i]);
+        else
+            out_dump_printf(fd, "  >= %5u us %10u\n", 1u << (i - 1),
+                            hist->buckets[i]);
+    }
+}
+
+/* Deep-buffer PCM: decoded by the app, only rendered by the DSP */
+static bool offload_is_pcm(audio_format_t format)
+{
+    return format == AUDIO_FORMAT_PCM_16_BIT ||
+           format == AUDIO_FORMAT_PCM_8_24_BIT;
+}
 
 static bool is_offload_device_available(
                struct offload_audio_device *offload_dev,
@@ -207,6 +628,15 @@ static bool is_offload_device_available(
         //case AUDIO_FORMAT_WMA9:
         case AUDIO_FORMAT_AAC:
             break;
+        case AUDIO_FORMAT_PCM_16_BIT:
+        case AUDIO_FORMAT_PCM_8_24_BIT:
+            // Nothing on the DSP can downmix pass-through PCM
+            if (popcount(channels) > 2) {
+                ALOGW("is_offload_device_available: %d channel PCM",
+                      popcount(channels));
+                return false;
+            }
+            break;
         default:
             ALOGW("is_offload_device_available: Offload not possible for"
                        "format = %x", format);
@@ -218,309 +648,786 @@ static bool is_offload_device_available(
 
 static int out_pause(struct audio_stream_out *stream)
 {
-     ALOGI("out_pause");
      struct offload_stream_out *out = (struct offload_stream_out *)stream;
      struct audio_stream_out *aout = (struct audio_stream_out *)stream;
      if(out->state != STREAM_RUNNING){
-        ALOGV("out_pause ignored: the state = %d", out->state);
+        OFFLOAD_LOGV("out_pause ignored: the state = %d", out->state);
         return 0;
      }
-     ALOGV("out_pause: out->state = %d", out->state );
      out->stream.get_render_position(aout, &out->paused_duration);
+     OFFLOAD_EVENT("out_pause: state %u, position %u ms", out->state,
+                   out->paused_duration);
 
-     pthread_mutex_lock(&out->lock);
+     out_lock(out, OUT_LOCK_CONTROL);
      if(compress_pause(out->compress) < 0 ) {
          ALOGE("out_pause : failed in the compress pause Err=%s",
                 compress_get_error(out->compress));
-         pthread_mutex_unlock(&out->lock);
+         out_unlock(out);
          return -ENOSYS;
      }
      out->state = STREAM_PAUSING;
-     pthread_mutex_unlock(&out->lock);
-     ALOGV("out_pause: out = %d", out->state );
+     out_watchdog_pause_l(out, true);
+     out_pause_timer_set_l(out, true);
+     out_unlock(out);
      return 0;
 }
 
 static int out_resume( struct audio_stream_out *stream)
 {
-    ALOGI("out_resume");
     struct offload_stream_out *out = (struct offload_stream_out *)stream;
 
      if( out->state == STREAM_READY ) {
-        ALOGV("out_resume ignored: the state = %d", out->state);
+        OFFLOAD_LOGV("out_resume ignored: the state = %d", out->state);
         return 0;
      }
 
-    ALOGV("out_resume: the state = %d", out->state);
-    pthread_mutex_lock(&out->lock);
+    OFFLOAD_EVENT("out_resume: state %u, released %u", out->state,
+                  out->pause_released);
+    out_lock(out, OUT_LOCK_CONTROL);
+    out_pause_timer_set_l(out, false);
+    if (out->pause_released) {
+        out_unlock(out);
+        return out_pause_restore(out);
+    }
     if( compress_resume(out->compress) < 0) {
         ALOGE("failed in the compress resume Err=%s",
                   compress_get_error(out->compress));
-        pthread_mutex_unlock(&out->lock);
+        out_unlock(out);
         return -ENOSYS;
     }
     out->state = STREAM_RUNNING;
-    pthread_mutex_unlock(&out->lock);
-    ALOGV("out_resume: out = %d", out->state);
+    out_watchdog_pause_l(out, false);
+    out_unlock(out);
     return 0;
 }
 
+static void *offload_notifier_loop(void *context)
+{
+    struct offload_notifier *notifier = (struct offload_notifier *)context;
+
+    prctl(PR_SET_NAME, (unsigned long)"Offload Notifier", 0, 0, 0);
+    pthread_mutex_lock(&notifier->lock);
+    for (;;) {
+        if (notifier->requested == notifier->delivered) {
+            if (notifier->exit)
+                break;
+            pthread_cond_wait(&notifier->cond, &notifier->lock);
+            continue;
+        }
+        int flags = notifier->requested;
+        pthread_mutex_unlock(&notifier->lock);
+
+        AudioParameter param;
+        param.addInt(String8(AudioParameter::keyStreamFlags), flags);
+        ALOGV("offload_notifier: setParameters stream flags 0x%x", flags);
+        AudioSystem::setParameters(0, param.toString());
+
+        pthread_mutex_lock(&notifier->lock);
+        notifier->delivered = flags;
+    }
+    pthread_mutex_unlock(&notifier->lock);
+    return NULL;
+}
+
+static void offload_notifier_init(struct offload_notifier *notifier)
+{
+    pthread_mutex_init(&notifier->lock, NULL);
+    pthread_cond_init(&notifier->cond, NULL);
+    notifier->requested = AUDIO_OUTPUT_FLAG_NONE;
+    notifier->delivered = AUDIO_OUTPUT_FLAG_NONE;
+    notifier->exit = false;
+    pthread_create(&notifier->thread, NULL, offload_notifier_loop, notifier);
+}
+
+/* Delivers whatever is still pending, then stops the thread */
+static void offload_notifier_destroy(struct offload_notifier *notifier)
+{
+    pthread_mutex_lock(&notifier->lock);
+    notifier->exit = true;
+    pthread_cond_signal(&notifier->cond);
+    pthread_mutex_unlock(&notifier->lock);
+    pthread_join(notifier->thread, NULL);
+    pthread_cond_destroy(&notifier->cond);
+    pthread_mutex_destroy(&notifier->lock);
+}
+
+static void offload_notifier_post(struct offload_notifier *notifier, int flags)
+{
+    pthread_mutex_lock(&notifier->lock);
+    if (notifier->requested != flags) {
+        notifier->requested = flags;
+        pthread_cond_signal(&notifier->cond);
+    }
+    pthread_mutex_unlock(&notifier->lock);
+}
+
+static void out_release_endpoint(struct offload_stream_out *out)
+{
+    offload_endpoints_release(&out->dev->endpoints, out->endpoint);
+    out->endpoint = -1;
+}
+
 static int close_device(struct audio_stream_out *stream)
 {
     struct offload_stream_out *out = (struct offload_stream_out *)stream;
-    ALOGI("close_device");
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_CONTROL);
+    OFFLOAD_EVENT("close_device: state %u, compress %u", out->state,
+                  out->compress != NULL);
     if( out->state == STREAM_DRAINING)
     {
-        ALOGV("Close is called after partial drain, Call the darin");
+        OFFLOAD_LOGV("Close is called after partial drain, Call the darin");
         compress_drain(out->compress);
-        ALOGV("Close: coming out of drain");
     }
-    pthread_mutex_unlock(&out->lock);
     if (out->compress) {
-        AudioParameter param;
-        param.addInt(String8(AudioParameter::keyStreamFlags),
-                                               AUDIO_OUTPUT_FLAG_NONE);
-        ALOGV("close_device, setParam to indicate Offload is closing");
-        AudioSystem::setParameters(0, param.toString());
-        pthread_mutex_lock(&out->lock);
-        ALOGV("close_device: compress_close");
+        offload_notifier_post(&out->dev->notifier, AUDIO_OUTPUT_FLAG_NONE);
         compress_close(out->compress);
         out->compress = NULL;
+        out_release_endpoint(out);
+    }
+    out_backend_close_l(out);
+
+    out_unlock(out);
+    out->state = STREAM_CLOSED;
+    return 0;
+}
+/* Legacy SST backend: volume and post-processing go through SET_ALGO on
+ * intel_sst_ctrl, opened with the compress device.
+ */
+static int sst_open_l(struct offload_stream_out *out)
+{
+    out->fd = open(SST_CTRL_DEVICE, O_RDWR);
+    if (out->fd < 0) {
+        ALOGE("error opening LPE device, error = %d",out->fd);
+        out->fd = 0;
+        return -EIO;
     }
-#ifndef MRFLD_AUDIO
+    ALOGV("open_device: intel_sst_ctrl opened sucessuflly with fd=%d", out->fd);
+    sst_apply_ppp_l(out, true);
+    return 0;
+}
+
+static void sst_close_l(struct offload_stream_out *out)
+{
     if (out->fd) {
         close(out->fd);
         ALOGV("close_device: intel-sst- fd closed");
     }
     out->fd = 0;
-#endif
+}
 
-    pthread_mutex_unlock(&out->lock);
-    out->state = STREAM_CLOSED;
+static int sst_write_volume_l(struct offload_stream_out *out, uint8_t value)
+{
+    struct offload_vol_algo_param sst_vol;
+    struct snd_ppp_params sst_ppp_vol;
+
+    sst_vol.type = SST_VOLUME_TYPE;
+    sst_vol.size = SST_VOLUME_SIZE;
+    sst_vol.params = value;
+    sst_ppp_vol.algo_id = SST_CODEC_VOLUME_CONTROL;
+    sst_ppp_vol.str_id = SST_PPP_VOL_STR_ID; // 0x03;
+    sst_ppp_vol.enable = 1;
+    sst_ppp_vol.operation = 0;
+    sst_ppp_vol.size = sizeof(struct offload_vol_algo_param);
+    sst_ppp_vol.params = &sst_vol;
+    if (ioctl(out->fd, SNDRV_SST_SET_ALGO, &sst_ppp_vol) < 0) {
+        ALOGE("setVolume: Error setting the ioctl with dB=%x", value);
+        return -errno;
+    }
     return 0;
 }
-#ifdef AUDIO_OFFLOAD_SCALABILITY
-static void open_dev_for_scalability(struct offload_stream_out *out)
+
+static uint8_t sst_volume_value(float volume)
 {
-    ALOGV("open_scalability_dev");
-    // Read the property to get the mixer control names
-    property_get("offload.mixer.volume.ctl.name", out->mixVolumeCtl, "0");
-    property_get("offload.mixer.mute.ctl.name", out->mixMuteCtl, "0");
-    property_get("offload.mixer.volume.ramp.ctl.name",
-                                       out->mixVolumeRampCtl, "0");
-    ALOGI("The mixer control name for volume = %s, mute = %s, Ramp = %s",
-           out->mixVolumeCtl, out->mixMuteCtl, out->mixVolumeRampCtl);
+    /* Set the mute value for the FW i.e -96dB */
+    return volume == 0 ? SST_VOLUME_MUTE :
+                         (uint8_t)(offload_gain_to_db10(volume) / 10);
 }
-static int out_set_volume_scalability(struct audio_stream_out *stream,
-                          float left, float right)
+
+/* -EAGAIN while in standby: out_write applies the volume once active */
+static int sst_set_volume_l(struct offload_stream_out *out, float left)
 {
-    struct offload_stream_out *out = (struct offload_stream_out *)stream ;
-    if(out->soundCardNo < 0) {
-        ALOGE("out_set_volume_scalability: without sound card no %d open",
-                                                        out->soundCardNo);
-        return -EINVAL;
-    }
-    struct mixer *mixer;
-    struct mixer_ctl* vol_ctl;
-    uint16_t volume;
-    mixer = mixer_open(out->soundCardNo);
-    if (!mixer) {
-        ALOGE("out_set_volume_scalability:Failed to open mixer for card %d\n",
-                                                            out->soundCardNo);
-        return -ENOSYS;
-    }
-    vol_ctl = mixer_get_ctl_by_name(mixer, MIXER_VOL_CTL_NAME);
-    if (!vol_ctl) {
-        ALOGE("out_set_volume_scalability: Error opening the mixer control %s",
-                                              MIXER_VOL_CTL_NAME);
-        mixer_close(mixer);
-        return -EINVAL;
+    if (!out->fd) {
+        ALOGV("setVolume: Requested for %2f, but yet to service when active", left);
+        return -EAGAIN;
     }
+    uint8_t value = sst_volume_value(left);
+    ALOGV("setVolume:  volume=%x in 2s compliment", value);
 
-    if (left == 0) {
-        // Set the mute value for the FW i.e -144dB
-       volume = SST_VOLUME_MUTE; //2s compliment of -144 dB
-       vol_ctl = mixer_get_ctl_by_name(mixer, out->mixMuteCtl);
-       if (!vol_ctl) {
-            ALOGE("out_set_volume_scalability:Error opening mixerMutecontrol%s",
-                                              out->mixMuteCtl);
-            mixer_close(mixer);
-            return -EINVAL;
-       }
-    } else {
-       // gain library expects user input of integer gain in 0.1dB
-       // Eg., 60 in decimal represents 6dB
-       volume = (uint16_t)((20 * log10(left)) * 10);
-       vol_ctl = mixer_get_ctl_by_name(mixer, out->mixVolumeCtl);
-       if (!vol_ctl) {
-            ALOGE("out_set_volume_scalability:Error"
-                     "opening mixerVolumecontrol %s", out->mixVolumeCtl);
-            mixer_close(mixer);
-            return -EINVAL;
-       }
+    // Incase if device is already set with same volume, we can ignore this request
+    struct offload_vol_algo_param  sst_get_vol;
+    sst_get_vol.type = SST_VOLUME_TYPE; // 0x602;
+    sst_get_vol.size = SST_VOLUME_SIZE; // 1;
+
+    struct snd_ppp_params  sst_ppp_get_vol;
+    sst_ppp_get_vol.algo_id = SST_CODEC_VOLUME_CONTROL; // 0x67
+    sst_ppp_get_vol.str_id = SST_PPP_VOL_STR_ID; // 0x03;
+    sst_ppp_get_vol.enable = 1;
+    sst_ppp_get_vol.operation = 1;
+    sst_ppp_get_vol.size =  sizeof(struct offload_vol_algo_param);
+    sst_ppp_get_vol.params = &sst_get_vol;
+    if (ioctl(out->fd, SNDRV_SST_GET_ALGO, &sst_ppp_get_vol) >= 0 &&
+            sst_get_vol.params == value) {
+        ALOGV("setVolume: No update since volume requested matches to one in the system.");
+        return 0;
     }
-    ALOGV("out_set_volume_scalability: volume computed: %d", volume);
-    if ((mixer_ctl_get_value(vol_ctl, 0)) == volume) {
-        ALOGV("out_set_volume_scalability: No update since volume requested");
+    return sst_write_volume_l(out, value);
+}
+
+static int sst_set_mute_l(struct offload_stream_out *out, bool mute)
+{
+    if (!out->fd)
+        return -EAGAIN;
+    return sst_write_volume_l(out, mute ? SST_VOLUME_MUTE :
+                                          sst_volume_value(out->volume));
+}
+
+/* Submits the post-processing algorithms of the stream, one SET_ALGO per
+ * algorithm: the ones changed since the last submit, or all of them after
+ * the device was (re)opened. A stream in standby is left for sst_open_l.
+ */
+static int sst_apply_ppp_l(struct offload_stream_out *out, bool all)
+{
+    uint8_t blob[OFFLOAD_PPP_MAX_BLOB];
+    int ret = 0;
+    int i;
+
+    if (out->fd <= 0)
         return 0;
+    for (i = 0; i < out->ppp.num_algos; i++) {
+        struct offload_ppp_algo *algo = &out->ppp.algos[i];
+        struct snd_ppp_params params;
+
+        if (!all && !algo->dirty)
+            continue;
+        params.algo_id = algo->algo_id;
+        params.str_id = algo->str_id;
+        params.enable = algo->enable;
+        params.operation = 0;
+        params.size = offload_ppp_serialize(algo, blob, sizeof(blob));
+        params.params = blob;
+        if (ioctl(out->fd, SNDRV_SST_SET_ALGO, &params) < 0) {
+            ret = -errno;
+            ALOGE("out_apply_ppp: algo 0x%x str %d: %s", algo->algo_id,
+                  algo->str_id, strerror(errno));
+            continue;
+        }
+        algo->dirty = false;
     }
+    return ret;
+}
 
-    // Call the mixer control for ramp also.
-    // TBD: how to get ramp value? default is 0
-    struct mixer_ctl* volRamp_ctl;
-    uint16_t volumeRamp = 0;
-    volRamp_ctl = mixer_get_ctl_by_name(mixer, out->mixVolumeRampCtl);
-    if (!volRamp_ctl) {
-        ALOGE("out_set_volume_scalability:Error opening mixerVolRamp ctl %s",
-                                              out->mixVolumeRampCtl);
-        mixer_close(mixer);
+/* Mixer backends: the controls are resolved once per stream. Scalability
+ * uses the per stream volume, mute and ramp controls named by the
+ * offload.mixer.*.ctl.name properties, read at offload_dev_open.
+ */
+static int out_open_mixer_l(struct offload_stream_out *out)
+{
+    if (out->mixer)
+        return 0;
+    if (out->soundCardNo < 0) {
+        ALOGE("setVolume: without sound card no %d open", out->soundCardNo);
         return -EINVAL;
     }
-    int retval = mixer_ctl_set_value(volRamp_ctl, 0, volumeRamp);
-    if (retval < 0) {
-        ALOGE("cwout_set_volume_scalability: Error setting volumeRamp val%x",
-                                                   volumeRamp);
-        return retval;
-    }
-    int retval1 = mixer_ctl_set_value(vol_ctl, 0, volume);
-    if (retval1 < 0) {
-        ALOGE("out_set_volume_scalability: Err setting volume dB value %x",
-                                                volume);
-        return retval1;
+    out->mixer = mixer_open(out->soundCardNo);
+    if (!out->mixer) {
+        ALOGE("setVolume:Failed to open mixer for card %d\n", out->soundCardNo);
+        return -ENOSYS;
     }
-    ALOGV("out_set_volume_scalability: Successful in set volume=%2f (%x dB)",
-                                              left, volume);
     return 0;
 }
-#endif
 
-static int open_device(struct offload_stream_out *out)
+static int mixer_get_ctls_l(struct offload_stream_out *out)
 {
-    int card  = -1;
-    int err = 0;
-    struct compr_config config;
-    struct snd_codec codec;
-    char value[PROPERTY_VALUE_MAX];
-    char id_filepath[PATH_MAX] = {0};
-    char number_filepath[PATH_MAX] = {0};
-    ssize_t written;
-    // set the audio.device.name property in the init.<boardname>.rc file
-    // or set the property at runtime in adb shell using setprop
-    property_get("audio.device.name", value, "0");
-    snprintf(id_filepath, sizeof(id_filepath), FILE_PATH"/%s", value);
-    written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
-    if (written < 0) {
-        ALOGE("open_device:Sound card %s does not exist", value);
-        return -EINVAL;
-    } else if (written >= (ssize_t)sizeof(id_filepath)) {
-        ALOGE("open_device:Sound card %s Name too long", value);
+    struct offload_audio_device *dev = out->dev;
+    int ret;
+
+    if (out->vol_ctl)
+        return 0;
+    ret = out_open_mixer_l(out);
+    if (ret < 0)
+        return ret;
+    if (out->backend == OFFLOAD_BACKEND_SCALABILITY) {
+        out->vol_ctl = mixer_get_ctl_by_name(out->mixer, dev->mixVolumeCtl);
+        out->ramp_ctl = mixer_get_ctl_by_name(out->mixer,
+                                              dev->mixVolumeRampCtl);
+        out->ramp_ctl_ms = ~0u;
+        if (strcmp(dev->mixMuteCtl, "0"))
+            out->mute_ctl = mixer_get_ctl_by_name(out->mixer, dev->mixMuteCtl);
+    } else {
+        out->vol_ctl = mixer_get_ctl_by_name(out->mixer, MIXER_VOL_CTL_NAME);
+    }
+    if (!out->vol_ctl) {
+        ALOGE("setVolume: Error opening the volume mixer control");
         return -EINVAL;
     }
-    // We are assured, because of the check in the previous elseif, that this
-    // buffer is null-terminated.  So this call is safe.
-    // 4 == strlen("card")
-    card = atoi(number_filepath + 4);
-    out->soundCardNo = card;
-    property_get("offload.compress.device", value, "0");
-    int device = atoi(value);
+    return 0;
+}
 
-#ifdef AUDIO_OFFLOAD_SCALABILITY
-    open_dev_for_scalability(out);
-#endif
+static uint16_t mixer_volume_value(float volume)
+{
+    // Set the mute value for the FW i.e -144dB
+    if (volume == 0)
+        return MIXER_VOLUME_MUTE;
+    // gain library expects user input of integer gain in 0.1dB
+    // Eg., 60 in decimal represents 6dB
+    return (uint16_t)offload_gain_to_db10(volume);
+}
 
-    ALOGV("open_device: device %d", device);
-    if (out->state != STREAM_CLOSED) {
-        ALOGE("open[%d] Error with stream state", out->state);
-        return -EINVAL;
+/* The ramp the DSP applies to the next volume write, skipped when unchanged */
+static int mixer_set_ramp_l(struct offload_stream_out *out, uint32_t ramp_ms)
+{
+    if (!out->ramp_ctl || out->ramp_ctl_ms == ramp_ms)
+        return 0;
+    int ret = mixer_ctl_set_value(out->ramp_ctl, 0, ramp_ms);
+    if (ret < 0) {
+        ALOGE("setVolume: Error setting volumeRamp %u ms", ramp_ms);
+        return ret;
     }
-    // update the configuration structure for given type of stream
-    if (out->format == AUDIO_FORMAT_MP3) {
-        codec.id = SND_AUDIOCODEC_MP3;
-        /* the channel maks is the one that come to hal. Converting the mask to channel number */
-        int channel_count = popcount(out->channels);
-#ifndef MRFLD_AUDIO
-        if (channel_count > 2) {
-            channel_count = 1;
-        }
-#endif
-        codec.ch_out = channel_count;
-        codec.ch_in = channel_count;
-        codec.sample_rate =  out->sample_rate;
-        codec.bit_rate = mCodec.avgBitRate ? mCodec.avgBitRate : CODEC_OFFLOAD_BITRATE;
-        codec.rate_control = 0;
-        codec.profile = 0;
-        codec.level = 0;
-        codec.ch_mode = 0;
-        codec.format = 0;
-
-        ALOGI("open_device: params: codec.id =%d,codec.ch_in=%d,codec.ch_out=%d,"
-          "codec.sample_rate=%d, codec.bit_rate=%d,codec.rate_control=%d,"
-          "codec.profile=%d,codec.level=%d,codec.ch_mode=%d,codec.format=%x",
-          codec.id, codec.ch_in,codec.ch_out,codec.sample_rate,
-          codec.bit_rate, codec.rate_control, codec.profile,
-          codec.level,codec.ch_mode, codec.format);
-
-    } else if (out->format == AUDIO_FORMAT_AAC) {
+    out->ramp_ctl_ms = ramp_ms;
+    return 0;
+}
 
-        /* AAC codec parameters  */
-        codec.id = SND_AUDIOCODEC_AAC;
-        /* Converting the mask to channel number */
-        int channel_count = popcount(out->channels);
-#ifndef MRFLD_AUDIO
-        if (channel_count > 2) {
-            channel_count = 1;
-        }
-#endif
-        codec.ch_out = channel_count;
-        codec.ch_in = channel_count;
-        codec.sample_rate =  out->sample_rate;
-        codec.bit_rate = mCodec.avgBitRate ? mCodec.avgBitRate : CODEC_OFFLOAD_BITRATE;
-        codec.rate_control = 0;
-        codec.profile = SND_AUDIOPROFILE_AAC;
-        codec.level = 0;
-        codec.ch_mode = 0;
-        codec.format = SND_AUDIOSTREAMFORMAT_RAW;
+static int mixer_set_volume_l(struct offload_stream_out *out, float left)
+{
+    int ret = mixer_get_ctls_l(out);
+    if (ret < 0)
+        return ret;
 
-        ALOGI("open_device: params: codec.id =%d,codec.ch_in=%d,codec.ch_out=%d,"
-          "codec.sample_rate=%d, codec.bit_rate=%d,codec.rate_control=%d,"
-          "codec.profile=%d,codec.level=%d,codec.ch_mode=%d,codec.format=%x",
-          codec.id, codec.ch_in,codec.ch_out,codec.sample_rate,
-          codec.bit_rate, codec.rate_control, codec.profile,
-          codec.level,codec.ch_mode, codec.format);
+    uint16_t volume = mixer_volume_value(left);
+    ALOGV("setVolume: volume computed: %d", volume);
+    if ((mixer_ctl_get_value(out->vol_ctl, 0)) == volume) {
+        ALOGV("setVolume: No update since volume requested matches to one in the system");
+        return 0;
     }
+    // A plain volume change is immediate, ramps go through out_ramp_volume_l
+    ret = mixer_set_ramp_l(out, 0);
+    if (ret < 0)
+        return ret;
+    ret = mixer_ctl_set_value(out->vol_ctl, 0, volume);
+    if (ret < 0) {
+        ALOGE("setVolume: Error setting volume with dB value %x", volume);
+        return ret;
+    }
+    ALOGV("setVolume: Successful in set volume=%2f (%x dB)", left, volume);
+    return 0;
+}
+
+static int mixer_set_mute_l(struct offload_stream_out *out, bool mute)
+{
+    int ret = mixer_get_ctls_l(out);
+    if (ret < 0)
+        return ret;
+    if (out->mute_ctl) {
+        // Gain stage after the volume: the volume control keeps its value
+        return mixer_ctl_set_value(out->mute_ctl, 0,
+                                   mute ? MIXER_VOLUME_MUTE : 0);
+    }
+    return mixer_ctl_set_value(out->vol_ctl, 0,
+                               mute ? MIXER_VOLUME_MUTE :
+                                      mixer_volume_value(out->volume));
+}
+
+static void mixer_release(struct offload_stream_out *out)
+{
+    if (out->mixer)
+        mixer_close(out->mixer);
+    out->mixer = NULL;
+    out->vol_ctl = NULL;
+    out->mute_ctl = NULL;
+    out->ramp_ctl = NULL;
+    out->route_ctl = NULL;
+}
+
+static const char *out_route_name(audio_devices_t devices)
+{
+    if (devices & (AUDIO_DEVICE_OUT_WIRED_HEADSET |
+                   AUDIO_DEVICE_OUT_WIRED_HEADPHONE))
+        return MIXER_ROUTE_HEADSET;
+    if (devices & AUDIO_DEVICE_OUT_SPEAKER)
+        return MIXER_ROUTE_SPEAKER;
+    return NULL;
+}
+
+/* Switches the DSP output path of the stream to out->devices. This only
+ * changes the route enum on the card: the compress stream keeps running
+ * with its buffered data and position. A stream in standby gets the route
+ * from open_device.
+ */
+static int out_apply_route_l(struct offload_stream_out *out)
+{
+    const char *route = out_route_name(out->devices);
+    int ret;
+
+    if (!route) {
+        ALOGW("out_apply_route: no output path for devices 0x%x",
+              out->devices);
+        return -EINVAL;
+    }
+    if (!out->compress || route == out->route)
+        return 0;
+    ret = out_open_mixer_l(out);
+    if (ret < 0)
+        return ret;
+    if (!out->route_ctl) {
+        out->route_ctl = mixer_get_ctl_by_name(out->mixer,
+                                               out->dev->mixRouteCtl);
+        if (!out->route_ctl) {
+            ALOGE("out_apply_route: no mixer control %s",
+                  out->dev->mixRouteCtl);
+            return -ENOSYS;
+        }
+    }
+    ret = mixer_ctl_set_enum_by_string(out->route_ctl, route);
+    if (ret < 0) {
+        ALOGE("out_apply_route: cannot select %s: %d", route, ret);
+        return ret;
+    }
+    ALOGV("out_apply_route: %s for devices 0x%x", route, out->devices);
+    out->route = route;
+    return 0;
+}
+
+/* Backend dispatch, called with out->lock held */
+static int out_backend_open_l(struct offload_stream_out *out)
+{
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        return sst_open_l(out);
+    default:
+        return 0;
+    }
+}
+
+static void out_backend_close_l(struct offload_stream_out *out)
+{
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        sst_close_l(out);
+        break;
+    default:
+        break;
+    }
+}
+
+static int out_backend_set_volume_l(struct offload_stream_out *out, float left)
+{
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        return sst_set_volume_l(out, left);
+    default:
+        return mixer_set_volume_l(out, left);
+    }
+}
+
+static int out_backend_set_mute_l(struct offload_stream_out *out, bool mute)
+{
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        return sst_set_mute_l(out, mute);
+    default:
+        return mixer_set_mute_l(out, mute);
+    }
+}
+
+/* Writes a gain straight to the volume control, without the read back of
+ * set_volume, skipping the value the ramp wrote last.
+ */
+static int out_backend_write_gain_l(struct offload_stream_out *out,
+                                    float gain)
+{
+    int value;
+    int ret;
+
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        if (!out->fd)
+            return -EAGAIN;
+        value = sst_volume_value(gain);
+        if (value == out->ramp_written)
+            return 0;
+        ret = sst_write_volume_l(out, value);
+        break;
+    default:
+        ret = mixer_get_ctls_l(out);
+        if (ret < 0)
+            return ret;
+        value = mixer_volume_value(gain);
+        if (value == out->ramp_written)
+            return 0;
+        ret = mixer_ctl_set_value(out->vol_ctl, 0, value);
+        break;
+    }
+    if (ret == 0) {
+        out->ramp_written = value;
+        out->ramp_writes++;
+    }
+    return ret;
+}
+
+static bool out_backend_has_mute_ctl(struct offload_stream_out *out)
+{
+    return out->backend != OFFLOAD_BACKEND_SST && out->mute_ctl != NULL;
+}
+
+static int out_apply_ppp_l(struct offload_stream_out *out, bool all)
+{
+    switch (out->backend) {
+    case OFFLOAD_BACKEND_SST:
+        return sst_apply_ppp_l(out, all);
+    default:
+        // No intel_sst_ctrl node on this platform; keep the preset.
+        if (out->ppp.num_algos)
+            ALOGW("out_apply_ppp: SET_ALGO not supported on this platform");
+        return -ENOSYS;
+    }
+}
+
+/* Resolves the audio.device.name card to its number, -EINVAL if missing */
+static int offload_get_sound_card(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char id_filepath[PATH_MAX] = {0};
+    char number_filepath[PATH_MAX] = {0};
+    ssize_t written;
+    // set the audio.device.name property in the init.<boardname>.rc file
+    // or set the property at runtime in adb shell using setprop
+    property_get("audio.device.name", value, "0");
+    snprintf(id_filepath, sizeof(id_filepath), FILE_PATH"/%s", value);
+    written = readlink(id_filepath, number_filepath, sizeof(number_filepath));
+    if (written < 0) {
+        ALOGE("open_device:Sound card %s does not exist", value);
+        return -EINVAL;
+    } else if (written >= (ssize_t)sizeof(id_filepath)) {
+        ALOGE("open_device:Sound card %s Name too long", value);
+        return -EINVAL;
+    }
+    // We are assured, because of the check in the previous elseif, that this
+    // buffer is null-terminated.  So this call is safe.
+    // 4 == strlen("card")
+    return atoi(number_filepath + 4);
+}
+
+/* Opens the least loaded compress endpoint taking the codec, or the next one
+ * when it is busy. With no endpoint discovered for it, the audio.device.name
+ * card and the device from 'device_prop' are opened as before. The endpoint
+ * taken, -1 for that fallback, is returned in *endpoint.
+ */
+static struct compress *offload_open_compress(struct offload_audio_device *dev,
+                                              uint32_t direction,
+                                              const char *device_prop,
+                                              const char *device_default,
+                                              struct compr_config *config,
+                                              int *card, int *endpoint)
+{
+    unsigned int flags = direction == OFFLOAD_ENDPOINT_PLAYBACK ?
+                                COMPRESS_IN : COMPRESS_OUT;
+    char value[PROPERTY_VALUE_MAX];
+    struct compress *compress;
+    uint32_t tried = 0;
+    int preferred = -1;
+    int device;
+
+    // The configured endpoint wins between equally loaded ones
+    property_get(device_prop, value, device_default);
+    if (dev->endpoints.count) {
+        *card = offload_get_sound_card();
+        if (*card >= 0)
+            preferred = offload_endpoints_find(&dev->endpoints, *card,
+                                               atoi(value));
+    }
+    for (;;) {
+        *endpoint = offload_endpoints_acquire(&dev->endpoints, direction,
+                                              config->codec->id, preferred,
+                                              &tried, card, &device);
+        if (*endpoint < 0) {
+            if (tried)
+                break;
+            *card = offload_get_sound_card();
+            if (*card < 0)
+                break;
+            device = atoi(value);
+        }
+        compress = compress_open(*card, device, flags, config);
+        if (compress && is_compress_ready(compress))
+            return compress;
+        ALOGE("offload_open_compress: card %d device %d: %s", *card, device,
+              compress_get_error(compress));
+        compress_close(compress);
+        if (*endpoint < 0)
+            break;
+        offload_endpoints_release(&dev->endpoints, *endpoint);
+    }
+    *endpoint = -1;
+    return NULL;
+}
+
+/* The format the stream plays now, in the form a track boundary announces
+ * the next one.
+ */
+static void out_current_format(const struct offload_stream_out *out,
+                               struct offload_next_format *fmt)
+{
+    fmt->format = out->format;
+    fmt->sample_rate = out->sample_rate;
+    fmt->channels = out->channels;
+    fmt->bit_rate = mCodec.avgBitRate;
+    fmt->aac_object_type = mCodec.codecID;
+    fmt->aac_down_sampling = mCodec.downSampling;
+}
+
+/* The snd_codec of fmt, for the device open and for a codec change at a
+ * track boundary.
+ */
+static int out_codec_params(const struct offload_stream_out *out,
+                            const struct offload_next_format *fmt,
+                            struct snd_codec *codec)
+{
+    // update the configuration structure for given type of stream; the
+    // codec options are only set for AAC
+    memset(codec, 0, sizeof(*codec));
+    if (fmt->format == AUDIO_FORMAT_MP3) {
+        codec->id = SND_AUDIOCODEC_MP3;
+        /* the channel maks is the one that come to hal. Converting the mask to channel number */
+        int channel_count = popcount(fmt->channels);
+        // The SST firmware decodes multichannel streams as mono
+        if (out->backend == OFFLOAD_BACKEND_SST && channel_count > 2) {
+            channel_count = 1;
+        }
+        codec->ch_out = channel_count;
+        codec->ch_in = channel_count;
+        codec->sample_rate =  fmt->sample_rate;
+        codec->bit_rate = fmt->bit_rate ? fmt->bit_rate : CODEC_OFFLOAD_BITRATE;
+        codec->rate_control = 0;
+        codec->profile = 0;
+        codec->level = 0;
+        codec->ch_mode = 0;
+        codec->format = 0;
+
+        ALOGI("out_codec_params: codec.id =%d,codec.ch_in=%d,codec.ch_out=%d,"
+          "codec.sample_rate=%d, codec.bit_rate=%d,codec.rate_control=%d,"
+          "codec.profile=%d,codec.level=%d,codec.ch_mode=%d,codec.format=%x",
+          codec->id, codec->ch_in,codec->ch_out,codec->sample_rate,
+          codec->bit_rate, codec->rate_control, codec->profile,
+          codec->level,codec->ch_mode, codec->format);
+
+    } else if (fmt->format == AUDIO_FORMAT_AAC) {
+
+        /* AAC codec parameters  */
+        codec->id = SND_AUDIOCODEC_AAC;
+        /* Converting the mask to channel number */
+        int channel_count = popcount(fmt->channels);
+        // The SST firmware decodes multichannel streams as mono
+        if (out->backend == OFFLOAD_BACKEND_SST && channel_count > 2) {
+            channel_count = 1;
+        }
+        codec->ch_out = channel_count;
+        codec->ch_in = channel_count;
+        codec->sample_rate =  fmt->sample_rate;
+        codec->bit_rate = fmt->bit_rate ? fmt->bit_rate : CODEC_OFFLOAD_BITRATE;
+        codec->rate_control = 0;
+        codec->level = 0;
+        // Object type and SBR mode, so that HE-AAC can decode downsampled
+        uint32_t dsp_rate = offload_aac_configure(codec, fmt->aac_object_type,
+                                                  fmt->aac_down_sampling,
+                                                  out->dev->aac_dsbr_min_rate);
+
+        ALOGI("out_codec_params: codec.id =%d,codec.ch_in=%d,codec.ch_out=%d,"
+          "codec.sample_rate=%d, codec.bit_rate=%d,codec.rate_control=%d,"
+          "codec.profile=%d,codec.level=%d,codec.ch_mode=%d,codec.format=%x,"
+          "object type %d, DSP output %u Hz",
+          codec->id, codec->ch_in,codec->ch_out,codec->sample_rate,
+          codec->bit_rate, codec->rate_control, codec->profile,
+          codec->level,codec->ch_mode, codec->format, fmt->aac_object_type,
+          dsp_rate);
+    } else if (offload_is_pcm(fmt->format)) {
+
+        /* PCM pass-through: the DSP only renders, in large fragments */
+        codec->id = SND_AUDIOCODEC_PCM;
+        int channel_count = popcount(fmt->channels);
+        codec->ch_out = channel_count;
+        codec->ch_in = channel_count;
+        codec->sample_rate =  fmt->sample_rate;
+        codec->bit_rate = fmt->sample_rate * channel_count *
+                         audio_bytes_per_sample(fmt->format) * 8;
+        codec->rate_control = 0;
+        codec->profile = 0;
+        codec->level = 0;
+        codec->ch_mode = 0;
+        codec->format = fmt->format == AUDIO_FORMAT_PCM_8_24_BIT ?
+                            SND_PCM_FORMAT_S24_LE :
+                            SND_PCM_FORMAT_S16_LE;
+
+        ALOGI("out_codec_params: codec.id =%d,codec.ch_in=%d,codec.ch_out=%d,"
+          "codec.sample_rate=%d, codec.bit_rate=%d,codec.format=%x",
+          codec->id, codec->ch_in,codec->ch_out,codec->sample_rate,
+          codec->bit_rate, codec->format);
+    } else {
+        ALOGE("out_codec_params: format %x cannot be offloaded", fmt->format);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Opens the device in fmt; out_reopen_codec passes the format of the next
+ * track, which the stream only takes once the open succeeded.
+ */
+static int open_device_format(struct offload_stream_out *out,
+                              const struct offload_next_format *fmt)
+{
+    int card  = -1;
+    int err = 0;
+    struct compr_config config;
+    struct snd_codec codec;
+
+    if (out->state != STREAM_CLOSED) {
+        ALOGE("open[%d] Error with stream state", out->state);
+        return -EINVAL;
+    }
+    err = out_codec_params(out, fmt, &codec);
+    if (err)
+        return err;
     config.fragment_size = out->buffer_size;
-    config.fragments = 2;
+    config.fragments = OFFLOAD_FRAGMENTS;
     config.codec = &codec;
 
     acquire_wake_lock(PARTIAL_WAKE_LOCK, lockid_offload);
-    out->compress = compress_open(card, device, COMPRESS_IN, &config);
-    if (!out->compress || !is_compress_ready(out->compress)) {
-        ALOGE("open_device: compress_open Error  %s\n",
-                                  compress_get_error(out->compress));
-        ALOGE("open_device:Unable to open Compress device %d:%d\n",
-                                  card, out->device_output);
-        compress_close(out->compress);
+    out->compress = offload_open_compress(out->dev, OFFLOAD_ENDPOINT_PLAYBACK,
+                                          "offload.compress.device", "0",
+                                          &config, &card, &out->endpoint);
+    if (!out->compress) {
+        ALOGE("open_device:Unable to open Compress device for output %d\n",
+                                  out->device_output);
         release_wake_lock(lockid_offload);
         return -EINVAL;
     }
+    out->soundCardNo = card;
     ALOGV("open_device: Compress device opened sucessfully");
     ALOGV("open_device: setting compress non block");
     compress_nonblock(out->compress, out->non_blocking);
-#ifndef MRFLD_AUDIO
-    out->fd = open("/dev/intel_sst_ctrl", O_RDWR);
-    if (out->fd < 0) {
-        ALOGE("error opening LPE device, error = %d",out->fd);
+    out_lock(out, OUT_LOCK_CONTROL);
+    err = out_backend_open_l(out);
+    if (!err) {
+        // The closed stream had no path; failing to set one is not fatal
+        out->route = NULL;
+        out_apply_route_l(out);
+    }
+    out_unlock(out);
+    if (err < 0) {
         close_device(&out->stream);
         release_wake_lock(lockid_offload);
-        //pthread_mutex_unlock(&out->lock);
-        return -EIO;
+        return err;
     }
-    ALOGV("open_device: intel_sst_ctrl opened sucessuflly with fd=%d", out->fd);
-#endif
     return 0;
 }
 
+static int open_device(struct offload_stream_out *out)
+{
+    struct offload_next_format fmt;
+
+    out_current_format(out, &fmt);
+    return open_device_format(out, &fmt);
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
     ALOGV("out_get_sample_rate:");
@@ -566,22 +1473,218 @@ static void stop_compressed_output_l(struct offload_stream_out *out)
     if (out->compress != NULL) {
         compress_stop(out->compress);
         while (out->offload_thread_blocked) {
-            pthread_cond_wait(&out->cond, &out->lock);
+            out_cond_wait(out, &out->cond);
         }
     }
 }
+/* Pause timeout. The timer thread finds the stream through the device, under
+ * dev->lock, so that closing the stream cannot race with a late expiry: the
+ * close clears dev->out under that lock before freeing it.
+ */
+static void out_pause_timer_expired(union sigval value)
+{
+    struct offload_audio_device *dev =
+                        (struct offload_audio_device *)value.sival_ptr;
+
+    pthread_mutex_lock(&dev->lock);
+    struct offload_stream_out *out = dev->out;
+    if (out) {
+        out_lock(out, OUT_LOCK_CONTROL);
+        // A late expiry of an earlier pause finds a later deadline
+        if (out->state == STREAM_PAUSING && !out->pause_released &&
+                out->pause_deadline_ns &&
+                offload_trace_now_ns() >= out->pause_deadline_ns)
+            out_pause_release_l(out);
+        out_unlock(out);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void out_pause_timer_set_l(struct offload_stream_out *out, bool arm)
+{
+    struct itimerspec its;
+
+    if (!out->pause_timer_created)
+        return;
+    memset(&its, 0, sizeof(its));
+    out->pause_deadline_ns = 0;
+    if (arm) {
+        its.it_value.tv_sec = out->pause_timeout_ms / 1000;
+        its.it_value.tv_nsec = (out->pause_timeout_ms % 1000) * 1000000;
+        out->pause_deadline_ns = offload_trace_now_ns() +
+                                 (uint64_t)out->pause_timeout_ms * 1000000;
+    }
+    timer_settime(out->paused_timer_id, 0, &its, NULL);
+}
+
+/* The shadow holds the last ring written until a shared ring is created */
+static bool out_pause_shadow_valid(const struct offload_stream_out *out)
+{
+    return out->pause_shadow && !out->shm.header;
+}
+
+/* Keeps the last ring of bytes handed to the driver */
+static void out_pause_shadow(struct offload_stream_out *out,
+                             const void *data, uint32_t bytes)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    uint32_t size = out->buffer_size * OFFLOAD_FRAGMENTS;
+
+    if (bytes > size) {
+        src += bytes - size;
+        out->pause_shadow_pos += bytes - size;
+        bytes = size;
+    }
+    while (bytes) {
+        uint32_t offset = out->pause_shadow_pos % size;
+        uint32_t chunk = size - offset < bytes ? size - offset : bytes;
+        memcpy(out->pause_shadow + offset, src, chunk);
+        out->pause_shadow_pos += chunk;
+        src += chunk;
+        bytes -= chunk;
+    }
+}
+
+/* Copies the last 'bytes' written, at most a ring, from the shadow */
+static void out_pause_shadow_tail_l(struct offload_stream_out *out,
+                                    uint8_t *dst, uint32_t bytes)
+{
+    uint32_t ring_size = out->buffer_size * OFFLOAD_FRAGMENTS;
+    uint32_t start = out->pause_shadow_pos - bytes;
+    uint32_t offset = start % ring_size;
+    uint32_t chunk = ring_size - offset < bytes ? ring_size - offset : bytes;
+
+    memcpy(dst, out->pause_shadow + offset, chunk);
+    memcpy(dst + chunk, out->pause_shadow, bytes - chunk);
+}
+
+/* Closes the compress device of a paused stream and drops the wake lock.
+ * The render position is kept in adjusted_render_offset, so the stream
+ * keeps reporting it, and the bytes the DSP had not consumed in
+ * pause_saved. Nothing is released if they cannot be saved.
+ */
+static void out_pause_release_l(struct offload_stream_out *out)
+{
+    uint32_t ring_size = out->buffer_size * OFFLOAD_FRAGMENTS;
+    struct timespec tstamp;
+    unsigned int avail;
+    uint32_t queued = 0;
+
+    if (!out->compress || !out_pause_shadow_valid(out))
+        return;
+    if (compress_get_hpointer(out->compress, &avail, &tstamp) < 0) {
+        ALOGW("out_pause_release: get_hpointer failed Err=%s",
+              compress_get_error(out->compress));
+        return;
+    }
+    if (avail < ring_size)
+        queued = ring_size - avail;
+    if (queued > out->pause_shadow_pos)
+        queued = out->pause_shadow_pos;
+    if (queued) {
+        out->pause_saved = (uint8_t *)malloc(queued);
+        if (!out->pause_saved) {
+            ALOGE("out_pause_release: cannot save %u bytes", queued);
+            return;
+        }
+        // The shadow ends with the queued bytes
+        out_pause_shadow_tail_l(out, out->pause_saved, queued);
+    }
+    out->pause_saved_bytes = queued;
+    out->adjusted_render_offset += tstamp.tv_sec * 1000 +
+                                   tstamp.tv_nsec / 1000000;
+
+    stop_compressed_output_l(out);
+    offload_notifier_post(&out->dev->notifier, AUDIO_OUTPUT_FLAG_NONE);
+    compress_close(out->compress);
+    out->compress = NULL;
+    out_release_endpoint(out);
+    out_backend_close_l(out);
+    release_wake_lock(lockid_offload);
+    out->pause_released = true;
+    out->pause_releases++;
+    ALOGI("out_pause_release: DSP released at %u ms, %u bytes saved",
+          out->adjusted_render_offset, queued);
+}
+
+static void out_pause_discard_l(struct offload_stream_out *out)
+{
+    free(out->pause_saved);
+    out->pause_saved = NULL;
+    out->pause_saved_bytes = 0;
+    out->pause_released = false;
+}
+
+/* Reopens the device of a released stream from out_resume: the saved bytes
+ * are queued again before the start, so playback continues where it paused
+ * and the reported position goes on from the saved one. Without saved bytes
+ * the stream starts with the next out_write. If the device does not open,
+ * the stream is left in standby and out_write retries.
+ */
+static int out_pause_restore(struct offload_stream_out *out)
+{
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret;
+
+    out_lock(out, OUT_LOCK_CONTROL);
+    uint8_t *saved = out->pause_saved;
+    uint32_t bytes = out->pause_saved_bytes;
+    out->pause_saved = NULL;
+    out_pause_discard_l(out);
+    out->state = STREAM_CLOSED;
+    out_unlock(out);
+
+    ret = open_device(out);
+    out_lock(out, OUT_LOCK_CONTROL);
+    if (ret) {
+        ALOGE("out_pause_restore: open_device failed %d", ret);
+        out->standby = true;
+        if (out_handoff_l(out, OFFLOAD_HANDOFF_OPEN_FAILED, bytes))
+            ret = 0;
+        out_unlock(out);
+        free(saved);
+        return ret;
+    }
+    out->state = STREAM_OPEN;
+    if (compress_set_gapless_metadata(out->compress, &out->gapless_mdata) == 0)
+        out->send_new_metadata = 0;
+    if (bytes) {
+        int sent = compress_write(out->compress, saved, bytes);
+        if (sent != (int)bytes)
+            ALOGW("out_pause_restore: %d of %u bytes queued", sent, bytes);
+        if (sent > 0 && compress_start(out->compress) == 0) {
+            offload_notifier_post(&out->dev->notifier,
+                                  AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD);
+            out->state = STREAM_RUNNING;
+        }
+    }
+    out->volume_change_requested = true;
+    uint32_t us = (uint32_t)((offload_trace_now_ns() - start_ns) / 1000);
+    out->pause_restores++;
+    if (us > out->pause_restore_max_us)
+        out->pause_restore_max_us = us;
+    out_unlock(out);
+    free(saved);
+    out_reapply_volume(out);
+    ALOGI("out_pause_restore: %u bytes queued again in %u us, position %u ms",
+          bytes, us, out->adjusted_render_offset);
+    return 0;
+}
+
 static int out_standby(struct audio_stream *stream)
 {
    struct offload_stream_out *out = (struct offload_stream_out *)stream;
 
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_CONTROL);
+    out_pause_timer_set_l(out, false);
+    out_pause_discard_l(out);
     if (!out->standby) {
         out->standby = true;
         stop_compressed_output_l(out);
         out->gapless_mdata.encoder_delay = 0;
         out->gapless_mdata.encoder_padding = 0;
     }
-    pthread_mutex_unlock(&out->lock);
+    out_unlock(out);
     close_device((audio_stream_out*)stream);
     ALOGV("%s: exit", __func__);
     return 0;
@@ -589,80 +1692,285 @@ static int out_standby(struct audio_stream *stream)
 
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    out_dump_lock_stats(out, fd);
+    offload_log_dump(fd);
+    if (out->write_ready_rtt_count) {
+        out_dump_printf(fd, "WRITE_READY to next write: %u samples, "
+                        "avg %llu us, max %u us\n", out->write_ready_rtt_count,
+                        (unsigned long long)(out->write_ready_rtt_total_us /
+                                             out->write_ready_rtt_count),
+                        out->write_ready_rtt_max_us);
+    }
+    struct out_latency_hist cmd_wake, callback;
+    struct out_cpu_usage write_cpu, thread_cpu, watchdog_cpu;
+    uint32_t writes, wakeups, wait_timeouts, watchdog_polls;
+    pthread_mutex_lock(&out->lock);
+    cmd_wake = out->cmd_wake_hist;
+    callback = out->callback_hist;
+    write_cpu = out->write_cpu;
+    writes = out->writes;
+    thread_cpu = out->thread_cpu;
+    wakeups = out->wakeups;
+    wait_timeouts = out->wait_timeouts;
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_lock(&out->watchdog_lock);
+    watchdog_cpu = out->watchdog_cpu;
+    watchdog_polls = out->watchdog_polls;
+    pthread_mutex_unlock(&out->watchdog_lock);
+    out_dump_latency_hist(fd, "offload command to thread wake", &cmd_wake);
+    out_dump_latency_hist(fd, "DSP wake to callback", &callback);
+    if (out->shm.header) {
+        out_dump_printf(fd, "shared ring: %u bytes, %llu bytes in %u driver "
+                        "writes\n", out->shm.header->size,
+                        (unsigned long long)out->shm_bytes, out->shm_writes);
+    }
+    if (out->recoveries) {
+        out_dump_printf(fd, "DSP stall recoveries: %u, last %u us, max %u us\n",
+                        out->recoveries, out->recovery_last_us,
+                        out->recovery_max_us);
+    }
+    if (out->ramps) {
+        out_dump_printf(fd, "volume ramps: %u, %u volume writes\n",
+                        out->ramps, out->ramp_writes);
+    }
+    if (out->pause_releases) {
+        out_dump_printf(fd, "DSP released in pause: %u, restored %u, max "
+                        "restore %u us\n", out->pause_releases,
+                        out->pause_restores, out->pause_restore_max_us);
+    }
+    if (out->handoffs) {
+        out_dump_printf(fd, "handoffs: %u, %u reopen attempts, %s\n",
+                        out->handoffs, out->handoff_retries,
+                        out->handoff_active ? "handed off" : "offloaded");
+    }
+    if (out->codec_switches || out->codec_reopens) {
+        out_dump_printf(fd, "codec changes at track boundaries: %u in place, "
+                        "%u reopened, max reopen %u us\n", out->codec_switches,
+                        out->codec_reopens, out->codec_reopen_max_us);
+    }
+    out_dump_printf(fd, "CPU: out_write %llu us in %u calls, offload thread "
+                    "%llu us, watchdog %llu us, %u buffer wakeups (%u timed "
+                    "out), %u watchdog polls\n",
+                    (unsigned long long)(write_cpu.cpu_ns / 1000), writes,
+                    (unsigned long long)(thread_cpu.cpu_ns / 1000),
+                    (unsigned long long)(watchdog_cpu.cpu_ns / 1000),
+                    wakeups, wait_timeouts, watchdog_polls);
     return 0;
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+struct out_set_parameters_ctx {
+    struct offload_stream_out *out;
+    int delay;
+    int padding;
+    int status;
+};
+
+static void out_set_parameter(void *context, offload_kv_key_t key,
+                              const char *value, size_t len)
 {
-    ALOGV("out_set_parameters kvpairs = %s", kvpairs);
+    struct out_set_parameters_ctx *ctx = (struct out_set_parameters_ctx *)context;
+    int ivalue;
+
+    if (key == OFFLOAD_KV_PPP_PARAMS) {
+        struct offload_stream_out *out = ctx->out;
+        out_lock(out, OUT_LOCK_CONTROL);
+        int ret = offload_ppp_merge(&out->ppp, value, len);
+        if (ret > 0)
+            ret = out_apply_ppp_l(out, false);
+        out_unlock(out);
+        if (ret < 0)
+            ctx->status = ret;
+        return;
+    }
 
-    struct str_parms *param;
-    int value = 0;
-    int delay = -1;
-    int padding = -1;
+    if (key == OFFLOAD_KV_VOLUME_RAMP) {
+        struct offload_stream_out *out = ctx->out;
+        float gain;
+        uint32_t duration_ms;
+        int ret = offload_volume_ramp_parse(value, len, &gain, &duration_ms);
+        if (ret == 0) {
+            out_lock(out, OUT_LOCK_SET_VOLUME);
+            ret = out_ramp_volume_l(out, gain, duration_ms);
+            out_unlock(out);
+        }
+        if (ret < 0)
+            ctx->status = ret;
+        return;
+    }
 
-    struct offload_stream_out *out = (struct offload_stream_out*)stream;
+    if (key == OFFLOAD_KV_NEXT_FORMAT) {
+        struct offload_stream_out *out = ctx->out;
+        struct offload_next_format next;
+        int ret = offload_next_format_parse(value, len, &next);
+        if (ret == 0 && !is_offload_device_available(out->dev, next.format,
+                                                     next.channels,
+                                                     next.sample_rate))
+            ret = -EINVAL;
+        if (ret < 0) {
+            ALOGW("out_set_parameters: invalid %s %.*s",
+                  OFFLOAD_NEXT_FORMAT_KEY, (int)len, value);
+            ctx->status = ret;
+            return;
+        }
+        out_lock(out, OUT_LOCK_CONTROL);
+        out->next_format = next;
+        out->next_format_pending = true;
+        out_unlock(out);
+        return;
+    }
 
-    param = str_parms_create_str(kvpairs);
-    if (param == NULL) {
-        ALOGE("out_set_parameters: Error creating str from kvpairs");
-        return 0;
+    if (key == OFFLOAD_KV_ROUTING) {
+        struct offload_stream_out *out = ctx->out;
+        // 0 is sent when the output is only being released
+        if (offload_kv_to_int(value, len, &ivalue) < 0 || !ivalue)
+            return;
+        out_lock(out, OUT_LOCK_CONTROL);
+        out->devices = (audio_devices_t)ivalue;
+        int ret = out_apply_route_l(out);
+        out_unlock(out);
+        if (ret < 0)
+            ctx->status = ret;
+        return;
     }
 
-    // Bits per sample - for WMA
-    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_BIT_PER_SAMPLE, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_BIT_PER_SAMPLE);
-        mCodec.bitsPerSample = value;
-    }
-    // Avg bitrate in bps - for WMA/AAC/MP3
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE);
-        mCodec.avgBitRate = value;
-        ALOGV("average bit rate set to %d", mCodec.avgBitRate);
-    }
-    // Number of channels present (for AAC)
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL);
-        mCodec.numChannels = value;
-    }
-    // Codec ID tag - Represents AudioObjectType (AAC) and FormatTag (WMA)
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_ID, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_ID);
-        mCodec.codecID = value;
-    }
-    // Block Align - for WMA
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_BLOCK_ALIGN, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_BLOCK_ALIGN);
-        mCodec.blockAlign = value;
-    }
-    // Sample rate - for WMA/AAC direct from parser
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE);
-        mCodec.sampleRate = value;
-    }
-    // Encode Option - for WMA
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_ENCODE_OPTION, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_ENCODE_OPTION);
-        mCodec.encodeOption = value;
-    }
-    // Delay samples - for MP3
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES);
-        delay = value;
-    }
-    // Padding samples - for MP3
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES);
-        padding = value;
-    }
-    if (delay >= 0 && padding >= 0) {
-        ALOGV("set_param: setting delay %d, padding %d", delay, padding);
-        out->gapless_mdata.encoder_delay = delay;
-        out->gapless_mdata.encoder_padding = padding;
+    if (offload_kv_to_int(value, len, &ivalue) < 0) {
+        ALOGW("out_set_parameters: invalid value for %s",
+                                           offload_kv_key_name(key));
+        return;
+    }
+    switch (key) {
+        // Bits per sample - for WMA
+        case OFFLOAD_KV_BIT_PER_SAMPLE:
+            mCodec.bitsPerSample = ivalue;
+            break;
+        // Avg bitrate in bps - for WMA/AAC/MP3
+        case OFFLOAD_KV_AVG_BIT_RATE:
+            mCodec.avgBitRate = ivalue;
+            ALOGV("average bit rate set to %d", mCodec.avgBitRate);
+            break;
+        // Number of channels present (for AAC)
+        case OFFLOAD_KV_NUM_CHANNEL:
+            mCodec.numChannels = ivalue;
+            break;
+        // Codec ID tag - Represents AudioObjectType (AAC) and FormatTag (WMA)
+        case OFFLOAD_KV_CODEC_ID:
+            mCodec.codecID = ivalue;
+            break;
+        // Downsampled SBR - for HE-AAC, taken at the next device open
+        case OFFLOAD_KV_DOWN_SAMPLING:
+            mCodec.downSampling = ivalue;
+            break;
+        // Block Align - for WMA
+        case OFFLOAD_KV_BLOCK_ALIGN:
+            mCodec.blockAlign = ivalue;
+            break;
+        // Sample rate - for WMA/AAC direct from parser
+        case OFFLOAD_KV_SAMPLE_RATE:
+            mCodec.sampleRate = ivalue;
+            break;
+        // Encode Option - for WMA
+        case OFFLOAD_KV_ENCODE_OPTION:
+            mCodec.encodeOption = ivalue;
+            break;
+        // Delay samples - for MP3
+        case OFFLOAD_KV_DELAY_SAMPLES:
+            ctx->delay = ivalue;
+            break;
+        // Padding samples - for MP3
+        case OFFLOAD_KV_PADDING_SAMPLES:
+            ctx->padding = ivalue;
+            break;
+        case OFFLOAD_KV_HANDOFF:
+            out_lock(ctx->out, OUT_LOCK_CONTROL);
+            ctx->out->handoff_enabled = ivalue != 0;
+            out_unlock(ctx->out);
+            break;
+        default:
+            break;
+    }
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    ALOGV("out_set_parameters kvpairs = %s", kvpairs);
+
+    struct out_set_parameters_ctx ctx;
+    ctx.out = (struct offload_stream_out*)stream;
+    ctx.delay = -1;
+    ctx.padding = -1;
+    ctx.status = 0;
+
+    offload_kv_parse(kvpairs, out_set_parameter, &ctx);
+
+    if (ctx.delay >= 0 && ctx.padding >= 0) {
+        struct offload_stream_out *out = ctx.out;
+        ALOGV("set_param: setting delay %d, padding %d", ctx.delay, ctx.padding);
+        out->gapless_mdata.encoder_delay = ctx.delay;
+        out->gapless_mdata.encoder_padding = ctx.padding;
         out->send_new_metadata = 1;
+        // Metadata comes with the next track, the handoff retry point
+        out_lock(out, OUT_LOCK_CONTROL);
+        if (out->handoff_active)
+            send_offload_cmd_l(out, OFFLOAD_CMD_HANDOFF_RETRY);
+        out_unlock(out);
     }
-    str_parms_destroy(param);
-    return 0;
+    return ctx.status;
+}
+
+static void out_add_cpu_usage(struct str_parms *param, const char *name,
+                              const struct out_cpu_usage *usage)
+{
+    char key[64];
+    char value[32];
+
+    snprintf(key, sizeof(key), "offload_%s_cpu_us", name);
+    snprintf(value, sizeof(value), "%llu",
+             (unsigned long long)(usage->cpu_ns / 1000));
+    str_parms_add_str(param, key, value);
+    snprintf(key, sizeof(key), "offload_%s_vcsw", name);
+    str_parms_add_int(param, key, usage->voluntary);
+    snprintf(key, sizeof(key), "offload_%s_ivcsw", name);
+    str_parms_add_int(param, key, usage->involuntary);
+}
+
+/* Reply to OFFLOAD_STATS_KEY: what the stream cost the AP since it opened.
+ * offload_{write,thread,watchdog}_{cpu_us,vcsw,ivcsw} give the CPU time and
+ * the voluntary and involuntary context switches spent inside out_write and
+ * by the two HAL threads. offload_wakeups counts every AP wakeup the HAL
+ * caused: each compress_wait return, offload_wait_timeouts of them the
+ * watchdog timeouts, plus offload_watchdog_polls, the watchdog thread
+ * checks during drains. offload_open_ms is the time the figures cover.
+ */
+static void out_add_stats(struct offload_stream_out *out,
+                          struct str_parms *param)
+{
+    struct out_cpu_usage write_cpu, thread_cpu, watchdog_cpu;
+    uint32_t writes, wakeups, wait_timeouts, watchdog_polls;
+    char value[32];
+
+    out_lock(out, OUT_LOCK_CONTROL);
+    write_cpu = out->write_cpu;
+    writes = out->writes;
+    thread_cpu = out->thread_cpu;
+    wakeups = out->wakeups;
+    wait_timeouts = out->wait_timeouts;
+    out_unlock(out);
+    pthread_mutex_lock(&out->watchdog_lock);
+    watchdog_cpu = out->watchdog_cpu;
+    watchdog_polls = out->watchdog_polls;
+    pthread_mutex_unlock(&out->watchdog_lock);
+
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)
+             ((offload_trace_now_ns() - out->open_ns) / 1000000));
+    str_parms_add_str(param, "offload_open_ms", value);
+    str_parms_add_int(param, "offload_writes", writes);
+    out_add_cpu_usage(param, "write", &write_cpu);
+    out_add_cpu_usage(param, "thread", &thread_cpu);
+    out_add_cpu_usage(param, "watchdog", &watchdog_cpu);
+    str_parms_add_int(param, "offload_wakeups", wakeups + watchdog_polls);
+    str_parms_add_int(param, "offload_wait_timeouts", wait_timeouts);
+    str_parms_add_int(param, "offload_watchdog_polls", watchdog_polls);
 }
 
 static char* out_get_parameters(const struct audio_stream *stream, const char *keys)
@@ -682,13 +1990,48 @@ static char* out_get_parameters(const struct audio_stream *stream, const char *k
     if (str_parms_get_str(param, AUDIO_PARAMETER_STREAM_ROUTING, value,
                                 strlen(AUDIO_PARAMETER_STREAM_ROUTING)) >= 0) {
         ret = str_parms_add_int(param, AUDIO_PARAMETER_STREAM_ROUTING,
-                                            out->device_output);
+                                            out->devices);
         if (ret >= 0) {
             temp = str_parms_to_str(param);
         } else {
             temp = strdup(keys);
         }
     }
+    if (str_parms_get_str(param, OFFLOAD_SHM_KEY, value, sizeof(value)) >= 0) {
+        // The ring is created on the first request and lives with the stream
+        out_lock(out, OUT_LOCK_CONTROL);
+        ret = out->shm.header ? 0 :
+              offload_shm_create(&out->shm,
+                                 out->buffer_size * OFFLOAD_SHM_FRAGMENTS);
+        if (ret == 0) {
+            snprintf(value, sizeof(value), "%d:%u", out->shm.fd,
+                     out->shm.header->size);
+            str_parms_add_str(param, OFFLOAD_SHM_KEY, value);
+        }
+        out_unlock(out);
+        free(temp);
+        temp = str_parms_to_str(param);
+    }
+    if (str_parms_get_str(param, OFFLOAD_HANDOFF_KEY, value,
+                          sizeof(value)) >= 0) {
+        out_lock(out, OUT_LOCK_CONTROL);
+        snprintf(value, sizeof(value), "%d,%u,%llu,%llu,%u",
+                 !out->handoff_active, out->handoff.reason,
+                 (unsigned long long)out->handoff.written,
+                 (unsigned long long)out->handoff.consumed,
+                 out->handoff.position_ms);
+        out_unlock(out);
+        str_parms_add_str(param, OFFLOAD_HANDOFF_KEY, value);
+        free(temp);
+        temp = str_parms_to_str(param);
+    }
+    if (str_parms_get_str(param, OFFLOAD_STATS_KEY, value,
+                          sizeof(value)) >= 0) {
+        str_parms_del(param, OFFLOAD_STATS_KEY);
+        out_add_stats(out, param);
+        free(temp);
+        temp = str_parms_to_str(param);
+    }
     str_parms_destroy(param);
     ALOGV("out_get_parameters: %s", temp);
     return temp;
@@ -699,175 +2042,342 @@ static uint32_t out_get_latency(const struct audio_stream_out *stream)
     return CODEC_OFFLOAD_LATENCY;
 }
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-                          float right)
+/* Mutes or unmutes with a single driver write, keeping out->volume as the
+ * gain to come back to: the dedicated mute control when there is one,
+ * otherwise the volume control itself, skipping the read back done by
+ * out_set_volume. A legacy stream in standby only records the state,
+ * out_write applies it.
+ */
+static int out_set_mute_l(struct offload_stream_out *out, bool mute)
 {
-    int ret = 0;
-    ALOGV("out_set_volume right vol= %f, left vol = %f", right, left);
-    // Check the boundary conditions and apply volume to LPE
-    if (left < 0.0f || left > 1.0f) {
-        ALOGE("setVolume: Invalid data as vol=%f ", left);
-        return -EINVAL;
-    }
-
-    struct offload_stream_out *out = (struct offload_stream_out *)stream ;
-    out->volume = left; // needed if we set volume in  out_write
-    // If error happens during setting the volume, try to set while in out_write
-    out->volume_change_requested = true;
-#ifndef MRFLD_AUDIO
-    // Device could be in standby state. Once active, set new volume
-    if (!out->fd){
-        ALOGV("setVolume: Requested for %2f, but yet to service when active", left);
+    int ret = out_backend_set_mute_l(out, mute);
+    if (ret == -EAGAIN) {
+        out->muted = mute;
+        out->volume_change_requested = true;
         return 0;
     }
-
-    pthread_mutex_lock(&out->lock);
-
-    struct offload_vol_algo_param  sst_vol;
-
-    ALOGV("setVolume Requested for %2f", left);
-    if (left == 0) {
-        /* Set the mute value for the FW i.e -96dB */
-        sst_vol.params = SST_VOLUME_MUTE; //2s compliment of -96 dB
-    } else {
-        sst_vol.params =  (uint8_t)(20*log10(left));
-    }
-    sst_vol.type = SST_VOLUME_TYPE;
-    sst_vol.size = SST_VOLUME_SIZE;
-
-
-    out->volume  = left;
-    out->volume_change_requested = false;
-    ALOGV("setVolume:  volume=%x in 2s compliment", sst_vol.params);
-
-   // Incase if device is already set with same volume, we can ignore this request
-    struct offload_vol_algo_param  sst_get_vol;
-    sst_get_vol.type = SST_VOLUME_TYPE; // 0x602;
-    sst_get_vol.size = SST_VOLUME_SIZE; // 1;
-
-    struct snd_ppp_params  sst_ppp_get_vol;
-    sst_ppp_get_vol.algo_id = SST_CODEC_VOLUME_CONTROL; // 0x67
-    sst_ppp_get_vol.str_id = SST_PPP_VOL_STR_ID; // 0x03;
-    sst_ppp_get_vol.enable = 1;
-    sst_ppp_get_vol.operation = 1;
-    sst_ppp_get_vol.size =  sizeof(struct offload_vol_algo_param);
-    sst_ppp_get_vol.params = &sst_get_vol;
-    ALOGV("calling get volume");
-    if (ioctl(out->fd, SNDRV_SST_GET_ALGO, &sst_ppp_get_vol) >=0) {
-        ALOGV("setVolume:  The volume read by getvolume stream_id =%d, volume = %d dB",
-                            sst_ppp_get_vol.str_id, sst_get_vol.params);
-        if (sst_get_vol.params == sst_vol.params) {
-            pthread_mutex_unlock(&out->lock);
-            ALOGV("setVolume: No update since volume requested matches to one in the system.");
-            out->volume_change_requested = false;
-            return 0;
-        }
-    }
-    ALOGV("setVolume:  The volume read by getvolume stream_id =%d, volume = %d dB",
-                            sst_ppp_get_vol.str_id, sst_get_vol.params);
-    struct snd_ppp_params  sst_ppp_vol;
-    sst_ppp_vol.algo_id = SST_CODEC_VOLUME_CONTROL;
-    sst_ppp_vol.str_id = SST_PPP_VOL_STR_ID; // 0x03;
-    sst_ppp_vol.enable = 1;
-    sst_ppp_vol.operation = 0;
-    sst_ppp_vol.size =  sizeof(struct offload_vol_algo_param);
-    sst_ppp_vol.params = &sst_vol;
-
-    // Proceed doing the new setVolume to the LPE device
-    int retval = ioctl(out->fd, SNDRV_SST_SET_ALGO, &sst_ppp_vol);
-    if (retval <0) {
-        ALOGE("setVolume: Error setting the ioctl with dB=%x", sst_vol.params);
-                pthread_mutex_unlock(&out->lock);
-        return retval;
-    }
-    ALOGV("setVolume: Successful in set volume=%2f (%x dB)", left, sst_vol.params);
-    pthread_mutex_unlock(&out->lock);
-#else //MRFLD_AUDIO
-#ifdef AUDIO_OFFLOAD_SCALABILITY
-    // Read the property to see if scalability is enabled in system.
-    // use this to set the mixer controls if enabled.
-    char propValue[PROPERTY_VALUE_MAX];
-    if ((property_get("audio.offload.scalability", propValue, "0")) &&
-        (atoi(propValue) == 1)) {
-        ALOGI("setVolume: Calling out_set_volume_scalability");
-        return out_set_volume_scalability(stream, left, right);
-    }
-#endif
-    if(out->soundCardNo < 0) {
-        ALOGE("setVolume: without sound card no %d open", out->soundCardNo);
-        return -EINVAL;
+    if (ret < 0) {
+        ALOGE("out_set_mute: %s failed %d", mute ? "mute" : "unmute", ret);
+        return ret;
     }
-    struct mixer *mixer;
-    struct mixer_ctl* vol_ctl;
-    uint16_t volume;
-    mixer = mixer_open(out->soundCardNo);
-    if (mixer == NULL) {
-        ALOGE("setVolume:Failed to open mixer for card %d\n", out->soundCardNo);
-        return -ENOSYS;
+    ALOGV("out_set_mute: %s, gain to restore %f", mute ? "muted" : "unmuted",
+          out->volume);
+    out->muted = mute;
+    return 0;
+}
+
+static int out_set_volume_l(struct offload_stream_out *out, float left)
+{
+    int ret;
+
+    // Mute toggles do not go through the volume transaction below
+    if (left == 0 || out->muted) {
+        if (left == 0)
+            return out->muted ? 0 : out_set_mute_l(out, true);
+        bool restore = left == out->volume;
+        if (restore || out_backend_has_mute_ctl(out)) {
+            ret = out_set_mute_l(out, false);
+            if (ret < 0 || restore)
+                return ret;
+        }
+        // Otherwise writing the new gain below unmutes
+        out->muted = false;
     }
-    vol_ctl = mixer_get_ctl_by_name(mixer, MIXER_VOL_CTL_NAME);
-    if (!vol_ctl) {
-        ALOGE("setVolume: Error opening the mixer control %s",
-                                              MIXER_VOL_CTL_NAME);
-        mixer_close(mixer);
+    out->volume = left; // needed if we set volume in  out_write
+    ALOGV("setVolume Requested for %2f", left);
+    ret = out_backend_set_volume_l(out, left);
+    // If the device is in standby, or setting the volume fails, try again
+    // in out_write once active
+    out->volume_change_requested = ret < 0;
+    if (ret == -EAGAIN)
+        ret = 0;
+    return ret;
+}
+
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    int ret = 0;
+    ALOGV("out_set_volume right vol= %f, left vol = %f", right, left);
+    // Check the boundary conditions and apply volume to LPE
+    if (left < 0.0f || left > 1.0f) {
+        ALOGE("setVolume: Invalid data as vol=%f ", left);
         return -EINVAL;
     }
 
-    if (left == 0) {
-        // Set the mute value for the FW i.e -144dB
-       volume = SST_VOLUME_MUTE; //2s compliment of -144 dB
-    } else {
-       // gain library expects user input of integer gain in 0.1dB
-       // Eg., 60 in decimal represents 6dB
-       volume = (uint16_t)((20 * log10(left)) * 10);
+    struct offload_stream_out *out = (struct offload_stream_out *)stream ;
+    out_lock(out, OUT_LOCK_SET_VOLUME);
+    // A new volume overrides a ramp in progress
+    out->ramp_active = false;
+    ret = out_set_volume_l(out, left);
+    out_unlock(out);
+    return ret;
+}
+
+/* Steps the ramps the DSP cannot run itself, one volume write per
+ * ramp_step_ms at most and only when the value on the device changes.
+ * The gain is interpolated linearly, like the AudioFlinger volume ramps.
+ */
+static void *offload_ramp_loop(void *context)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)context;
+
+    prctl(PR_SET_NAME, (unsigned long)"Offload Ramp", 0, 0, 0);
+    out_lock(out, OUT_LOCK_SET_VOLUME);
+    while (!out->ramp_exit) {
+        if (!out->ramp_active) {
+            out_cond_wait(out, &out->ramp_cond);
+            continue;
+        }
+        uint64_t elapsed_ms = (offload_trace_now_ns() - out->ramp_start_ns) /
+                              1000000;
+        bool done = elapsed_ms >= out->ramp_ms;
+        float gain = done ? out->ramp_to :
+                     out->ramp_from + (out->ramp_to - out->ramp_from) *
+                                      elapsed_ms / out->ramp_ms;
+        int ret = out_backend_write_gain_l(out, gain);
+        out->volume = gain;
+        if (ret < 0) {
+            // Standby or a failed write: out_write applies the target
+            ALOGV("offload_ramp: stopped at %f, %d", gain, ret);
+            out->volume = out->ramp_to;
+            out->volume_change_requested = true;
+            done = true;
+        }
+        if (done) {
+            out->ramp_active = false;
+            continue;
+        }
+        out_cond_timedwait(out, &out->ramp_cond, out->ramp_step_ms);
     }
-    ALOGV("setVolume: volume computed: %d", volume);
-    if ((mixer_ctl_get_value(vol_ctl, 0)) == volume) {
-        ALOGV("setVolume: No update since volume requested matches to one in the system");
-        mixer_close(mixer);
-        out->volume_change_requested = false;
+    out_unlock(out);
+    return NULL;
+}
+
+/* Fades from the current gain, 0 when muted, to 'gain' in 'duration_ms'.
+ * The scalability ramp control runs the fade on the DSP from a single
+ * volume write; the other backends are stepped by offload_ramp_loop.
+ */
+static int out_ramp_volume_l(struct offload_stream_out *out, float gain,
+                             uint32_t duration_ms)
+{
+    float from = out->muted ? 0 : out->volume;
+    int ret;
+
+    out->ramp_active = false;
+    if (!duration_ms || gain == from)
+        return out_set_volume_l(out, gain);
+    out->ramps++;
+    out->ramp_written = -1;
+    if (out->backend == OFFLOAD_BACKEND_SCALABILITY &&
+            mixer_get_ctls_l(out) == 0 && out->ramp_ctl) {
+        if (out->muted) {
+            // Start from silence on the volume control, then unmute
+            ret = mixer_set_ramp_l(out, 0);
+            if (ret == 0)
+                ret = mixer_ctl_set_value(out->vol_ctl, 0, MIXER_VOLUME_MUTE);
+            if (ret == 0 && out->mute_ctl)
+                ret = mixer_ctl_set_value(out->mute_ctl, 0, 0);
+            if (ret < 0)
+                return ret;
+            out->muted = false;
+        }
+        ret = mixer_set_ramp_l(out, duration_ms);
+        if (ret == 0)
+            ret = mixer_ctl_set_value(out->vol_ctl, 0, mixer_volume_value(gain));
+        if (ret < 0) {
+            ALOGE("out_ramp_volume: DSP ramp to %f failed %d", gain, ret);
+            return ret;
+        }
+        out->ramp_writes++;
+        out->volume = gain;
         return 0;
     }
+    ret = out_backend_write_gain_l(out, from);
+    if (ret == -EAGAIN)
+        return out_set_volume_l(out, gain);     /* standby: nothing to fade */
+    if (ret < 0)
+        return ret;
+    if (out->muted && out_backend_has_mute_ctl(out)) {
+        ret = out_set_mute_l(out, false);
+        if (ret < 0)
+            return ret;
+    }
+    out->muted = false;
+    if (!out->ramp_thread_started) {
+        char value[PROPERTY_VALUE_MAX];
+        out->ramp_step_ms = property_get("offload.volume.ramp.step.ms", value,
+                                         NULL) ? atoi(value) :
+                                                 OFFLOAD_RAMP_STEP_MS;
+        if (out->ramp_step_ms < OFFLOAD_RAMP_MIN_STEP_MS)
+            out->ramp_step_ms = OFFLOAD_RAMP_MIN_STEP_MS;
+        pthread_cond_init(&out->ramp_cond, NULL);
+        if (pthread_create(&out->ramp_thread, NULL, offload_ramp_loop, out)) {
+            pthread_cond_destroy(&out->ramp_cond);
+            return out_set_volume_l(out, gain);
+        }
+        out->ramp_thread_started = true;
+    }
+    out->ramp_from = from;
+    out->ramp_to = gain;
+    out->ramp_ms = duration_ms;
+    out->ramp_start_ns = offload_trace_now_ns();
+    out->ramp_active = true;
+    pthread_cond_signal(&out->ramp_cond);
+    return 0;
+}
 
-    int retval = mixer_ctl_set_value(vol_ctl, 0, volume);
-    if (retval < 0) {
-        ALOGE("setVolume: Error setting volume with dB value %x", volume);
-        mixer_close(mixer);
-        return retval;
+/* Applies the stream volume, or the mute, after the device was reopened */
+static void out_reapply_volume(struct offload_stream_out *out)
+{
+    if (out->muted) {
+        out_lock(out, OUT_LOCK_SET_VOLUME);
+        if (out_set_mute_l(out, true) == 0)
+            out->volume_change_requested = false;
+        out_unlock(out);
+        return;
     }
-    ALOGV("setVolume: Successful in set volume=%2f (%x dB)", left, volume);
-    mixer_close(mixer);
-#endif  //MRFLD_AUDIO
-    // Volume sucessfully set, no need to do again during out_write
-    out->volume_change_requested = false;
-    return ret;
+    out->stream.set_volume(&out->stream, out->volume, out->volume);
 }
 
 static int send_offload_cmd_l(struct offload_stream_out* out, int command)
 {
     struct offload_cmd *cmd = (struct offload_cmd *)calloc(1, sizeof(struct offload_cmd));
     if (!cmd) {
-        ALOGV("send_offload_cmd_l NO_MEMORY");
+        ALOGE("send_offload_cmd_l NO_MEMORY");
         return -ENOMEM;
     }
 
-    ALOGV("%s %d", __func__, command);
-
     cmd->cmd = command;
+    cmd->posted_ns = offload_trace_now_ns();
     list_add_tail(&out->offload_cmd_list, &cmd->node);
     pthread_cond_signal(&out->offload_cond);
     return 0;
 }
-static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
-                         size_t bytes)
+
+/* Hands the stream over to the client instead of failing, if it asked for
+ * that: records where the DSP stopped, with 'queued' bytes of what out_write
+ * took never played, and has the callback thread report it. Returns false
+ * when handoff is off and the caller fails as before.
+ */
+static bool out_handoff_l(struct offload_stream_out *out,
+                          offload_handoff_reason_t reason, uint32_t queued)
+{
+    if (!out->handoff_enabled)
+        return false;
+    if (out->handoff_active)
+        return true;
+    out->handoff_active = true;
+    out->handoff.reason = reason;
+    out->handoff.written = out->bytes_written;
+    out->handoff.consumed = out->bytes_written > queued ?
+                                out->bytes_written - queued : 0;
+    out->handoff.position_ms = out->adjusted_render_offset;
+    out->handoffs++;
+    ALOGW("out_handoff: reason %d at byte %llu, %u ms", reason,
+          (unsigned long long)out->handoff.consumed, out->handoff.position_ms);
+    send_offload_cmd_l(out, OFFLOAD_CMD_HANDOFF);
+    return true;
+}
+
+static uint32_t out_now_us(void)
+{
+    return (uint32_t)(offload_trace_now_ns() / 1000);
+}
+
+/* CPU time and context switches of the calling thread so far */
+static void out_cpu_sample(struct out_cpu_usage *usage)
+{
+    struct timespec ts;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    usage->cpu_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        usage->voluntary = ru.ru_nvcsw;
+        usage->involuntary = ru.ru_nivcsw;
+    } else {
+        usage->voluntary = 0;
+        usage->involuntary = 0;
+    }
+}
+
+/* Time from a WRITE_READY dispatch to the write it triggers */
+static void out_account_write_ready(struct offload_stream_out *out)
+{
+    int32_t dispatched = android_atomic_acquire_load(&out->write_ready_us);
+    if (!dispatched ||
+            android_atomic_release_cas(dispatched, 0, &out->write_ready_us))
+        return;
+    uint32_t rtt = out_now_us() - (uint32_t)dispatched;
+    out->write_ready_rtt_count++;
+    out->write_ready_rtt_total_us += rtt;
+    if (rtt > out->write_ready_rtt_max_us)
+        out->write_ready_rtt_max_us = rtt;
+}
+
+/* A NULL buffer hands the bytes committed to the shared ring to the driver,
+ * one fragment sized view at a time, without staging them anywhere.
+ */
+static int out_compress_write(struct offload_stream_out *out,
+                              const void *buffer, size_t bytes)
+{
+    if (buffer || !out->shm.header) {
+        int sent = compress_write(out->compress, buffer, bytes);
+        if (sent > 0 && out_pause_shadow_valid(out))
+            out_pause_shadow(out, buffer, sent);
+        return sent;
+    }
+
+    int done = 0;
+    for (;;) {
+        const uint8_t *src;
+        uint32_t avail = offload_shm_read_avail(&out->shm, &src);
+        if (!avail)
+            break;
+        if (avail > out->buffer_size)
+            avail = out->buffer_size;
+        int sent = compress_write(out->compress, src, avail);
+        if (sent < 0)
+            return done ? done : sent;
+        offload_shm_read_commit(&out->shm, sent);
+        out->shm_writes++;
+        out->shm_bytes += sent;
+        done += sent;
+        if (sent < (int)avail)
+            break;
+    }
+    return done;
+}
+
+/* Nothing of the current write was queued when the device failed to open */
+static bool out_handoff(struct offload_stream_out *out,
+                        offload_handoff_reason_t reason)
+{
+    out_lock(out, OUT_LOCK_WRITE);
+    bool handed_off = out_handoff_l(out, reason, 0);
+    out_unlock(out);
+    return handed_off;
+}
+
+static ssize_t out_write_compress(struct audio_stream_out *stream,
+                                  const void* buffer, size_t bytes)
 {
     struct offload_stream_out *out = (struct offload_stream_out *)stream;
-    AudioParameter param;
+    out_account_write_ready(out);
+    // Nothing is taken while paused, the device may even be released
+    if (out->state == STREAM_PAUSING) {
+        OFFLOAD_LOGW("out_write[%d]: Ignored", out->state);
+        return 0;
+    }
+    // Handed off, nothing is taken before the next track
+    if (out->handoff_active)
+        return 0;
     if (out->standby) {
         if (open_device(out)) {
             ALOGE("out_write[%d]: Device open error", out->state);
             close_device(stream);
-            return -EINVAL;
+            return out_handoff(out, OFFLOAD_HANDOFF_OPEN_FAILED) ? 0 : -EINVAL;
         }
         out->standby = false;
         out->state = STREAM_OPEN;
@@ -884,70 +2394,89 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     int sent = 0;
     int retval = 0;
 
-    ALOGV("out_write: state = %d", out->state);
+    OFFLOAD_LOGV("out_write: state = %d", out->state);
     switch (out->state) {
         case STREAM_CLOSED:
             // Due to standby the device could be closed (power-saving mode)
             if (open_device(out)) {
                 ALOGE("out_write[%d]: Device open error", out->state);
                 close_device(stream);
+                out_handoff(out, OFFLOAD_HANDOFF_OPEN_FAILED);
                 return retval;
             }
         case STREAM_OPEN:
-            ALOGV("out_write:Indicating primary HAL about offload starting");
-            param.addInt(String8(AudioParameter::keyStreamFlags),
-                                   AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD);
-            AudioSystem::setParameters(0, param.toString());
+            offload_notifier_post(&out->dev->notifier,
+                                  AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD);
             out->state = STREAM_READY;
         case STREAM_READY:
         case STREAM_DRAINING:
             if (out->volume_change_requested) {
-                out->stream.set_volume(&out->stream,out->volume, out->volume);
+                out_reapply_volume(out);
             }
-            ALOGV("out_write: state = %d: writting %d bytes", out->state, bytes);
-            sent = compress_write(out->compress, buffer, bytes);
+            sent = out_compress_write(out, buffer, bytes);
             if ((sent >= 0) && (sent < (int)bytes)) {
-                 ALOGV("out_write sending wait for buffer cmd");
+                 out_lock(out, OUT_LOCK_WRITE);
                  send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
+                 out_unlock(out);
             }
             if (sent < 0) {
-                ALOGE("Error: %s\n", compress_get_error(out->compress));
+                OFFLOAD_LOGE("Error: %s\n", compress_get_error(out->compress));
             }
-            ALOGV("out_write: state = %d: writting Done with %d bytes",
-                                                       out->state, sent);
             if (compress_start(out->compress) < 0) {
-                ALOGI("write: Failed in the compress_start Err=%s",
-                           compress_get_error(out->compress));
+                OFFLOAD_LOGW("write: Failed in the compress_start Err=%s",
+                             compress_get_error(out->compress));
             }
-            ALOGI("out_write[%d]: compress_start in state", out->state);
+            OFFLOAD_EVENT("out_write: compress_start in state %u, %u bytes",
+                          out->state, sent);
             out->state = STREAM_RUNNING;
             break;
         case STREAM_RUNNING:
             if (out->volume_change_requested) {
-                out->stream.set_volume(&out->stream,out->volume, out->volume);
+                out_reapply_volume(out);
             }
-            ALOGV("out_write:[%d] Writing to compress write with %d bytes..",
-                                                           out->state, bytes);
-            sent = compress_write(out->compress, buffer, bytes);
+            sent = out_compress_write(out, buffer, bytes);
             if ((sent >= 0) && (sent < (int)bytes)) {
+                 out_lock(out, OUT_LOCK_WRITE);
                  send_offload_cmd_l(out, OFFLOAD_CMD_WAIT_FOR_BUFFER);
+                 out_unlock(out);
             }
             if (sent < 0) {
-                ALOGE("out_write:[%d] compress_write: interrupted : %s",
-                                out->state, compress_get_error(out->compress));
+                OFFLOAD_LOGE("out_write:[%d] compress_write: interrupted : %s",
+                             out->state, compress_get_error(out->compress));
                 sent = 0;
             }
-            ALOGV("out_write:[%d] written %d bytes now",
-                                              out->state, (int) sent);
+            OFFLOAD_LOGV("out_write:[%d] written %d bytes now",
+                         out->state, (int) sent);
             break;
 
         default:
-            ALOGW("out_write[%d]: Ignored", out->state);
+            OFFLOAD_LOGW("out_write[%d]: Ignored", out->state);
             return retval;
     }
     return sent;
 }
 
+static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
+                         size_t bytes)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    struct out_cpu_usage start, end;
+
+    out_cpu_sample(&start);
+    ssize_t sent = out_write_compress(stream, buffer, bytes);
+    out_cpu_sample(&end);
+    // 64-bit sums read by get_parameters and the handoff: keep them whole
+    out_lock(out, OUT_LOCK_CONTROL);
+    out->write_cpu.cpu_ns += end.cpu_ns - start.cpu_ns;
+    out->write_cpu.voluntary += end.voluntary - start.voluntary;
+    out->write_cpu.involuntary += end.involuntary - start.involuntary;
+    out->writes++;
+    if (sent > 0)
+        out->bytes_written += sent;
+    out_unlock(out);
+    return sent;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
@@ -958,33 +2487,32 @@ static int out_get_render_position(const struct audio_stream_out *stream,
 
     *dsp_frames = out->adjusted_render_offset;
     if (!out->compress)  {
-        ALOGV("out_get_render_position: Retuning without calling compressAPI");
+        OFFLOAD_LOGV("out_get_render_position: no compress device");
         return 0;
     }
 
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_RENDER_POSITION);
     switch (out->state) {
         case STREAM_RUNNING:
         case STREAM_READY:
         case STREAM_PAUSING:
         case STREAM_DRAINING:
             if (compress_get_hpointer(out->compress, &avail,&tstamp) < 0) {
-                ALOGW("out_get_render_position: get_hposition Failed Err=%s",
-                      compress_get_error(out->compress));
-                pthread_mutex_unlock(&out->lock);
+                OFFLOAD_LOGW("out_get_render_position: get_hposition Failed "
+                             "Err=%s", compress_get_error(out->compress));
+                out_unlock(out);
                 return -EINVAL;
             }
 
           calTimeMs = (tstamp.tv_sec * 1000) + (tstamp.tv_nsec /1000000);
           *dsp_frames +=calTimeMs;
-          ALOGV("out_get_render_position : time in millisec returned = %d",
-                                                                *dsp_frames);
+          OFFLOAD_LOGV("out_get_render_position: %u ms", *dsp_frames);
         break;
         default:
-            pthread_mutex_unlock(&out->lock);
+            out_unlock(out);
             return -EINVAL;
     }
-    pthread_mutex_unlock(&out->lock);
+    out_unlock(out);
     return 0;
 }
 
@@ -994,30 +2522,35 @@ static int out_set_callback(struct audio_stream_out *stream,
     struct offload_stream_out *out = (struct offload_stream_out *)stream;
 
     ALOGV("%s", __func__);
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_SET_CALLBACK);
+    // Once this returns the previous callback must not be invoked anymore,
+    // unless the change comes from within that callback.
+    while (out->callback_in_progress &&
+           !pthread_equal(pthread_self(), out->offload_thread)) {
+        out_cond_wait(out, &out->cond);
+    }
     out->offload_callback = callback;
     out->offload_cookie = cookie;
-    pthread_mutex_unlock(&out->lock);
+    out_unlock(out);
     return 0;
 }
 /* The drain function implementation. This will send drain to driver */
 static int out_drain(struct audio_stream_out *stream,
                      audio_drain_type_t type)
 {
-    ALOGV("out_drain");
     struct offload_stream_out *out = (struct offload_stream_out *)stream ;
     int status = -ENOSYS;
-    pthread_mutex_lock(&out->lock);
+    OFFLOAD_EVENT("out_drain: type %u, state %u", type, out->state);
+    out_lock(out, OUT_LOCK_CONTROL);
     if ((type == AUDIO_DRAIN_EARLY_NOTIFY)) {
-        ALOGV("out_drain send command PARTIAL_DRAIN");
         status = send_offload_cmd_l(out, OFFLOAD_CMD_PARTIAL_DRAIN);
     }
     else {
-        ALOGV("out_drain send command DRAIN");
+        // The last track: no next one to change the codec for
+        out->next_format_pending = false;
         status = send_offload_cmd_l(out, OFFLOAD_CMD_DRAIN);
     }
-    pthread_mutex_unlock(&out->lock);
-    ALOGV("out_drain return status %d", status);
+    out_unlock(out);
     return status;
 
 }
@@ -1025,6 +2558,17 @@ static int out_drain(struct audio_stream_out *stream,
 static int out_flush (const struct audio_stream_out *stream)
 {
    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+   out_lock(out, OUT_LOCK_CONTROL);
+   out->bytes_written = 0;
+   // The announced format was the one of the track after the flushed one
+   out->next_format_pending = false;
+   if (out->handoff_active) {
+        // A flush starts new content: a track boundary to retry at
+        out->adjusted_render_offset = 0;
+        send_offload_cmd_l(out, OFFLOAD_CMD_HANDOFF_RETRY);
+        out_unlock(out);
+        return 0;
+   }
    switch (out->state) {
         case STREAM_RUNNING:
         case STREAM_READY:
@@ -1034,18 +2578,537 @@ static int out_flush (const struct audio_stream_out *stream)
             out->adjusted_render_offset = 0;
             break;
         default :
-            ALOGV("out_flush: ignored");
+            OFFLOAD_LOGV("out_flush: ignored");
             out->adjusted_render_offset = 0;
+            out_unlock(out);
             return 0;
     }
-    ALOGV("out_flush:[%d] calling Compress Stop", out->state);
-    pthread_mutex_lock(&out->lock);
+    OFFLOAD_EVENT("out_flush: state %u, released %u", out->state,
+                  out->pause_released);
+    out_pause_timer_set_l(out, false);
     stop_compressed_output_l(out);
-    pthread_mutex_unlock(&out->lock);
+    if (out->shm.header)
+        offload_shm_discard(&out->shm);
+    if (out->pause_released) {
+        // The device is closed, the next out_write reopens it
+        out_pause_discard_l(out);
+        out->standby = true;
+        out->state = STREAM_CLOSED;
+        out_unlock(out);
+        return 0;
+    }
+    out_unlock(out);
     out->state = STREAM_READY;
     return 0;
 }
 
+/* Invokes the AudioFlinger callback with out->lock released: the callback
+ * commonly calls straight back into out_write or out_get_render_position.
+ * The callback and cookie are snapshotted under the lock; events stay in
+ * order because only the offload thread dispatches them, and the stream
+ * cannot be freed meanwhile since closing it joins this thread first.
+ */
+/* wake_ns is when the DSP wait that produced the event returned */
+static void dispatch_offload_callback_l(struct offload_stream_out *out,
+                                        stream_callback_event_t event,
+                                        void *param, uint64_t wake_ns)
+{
+    stream_callback_t callback = out->offload_callback;
+    void *cookie = out->offload_cookie;
+
+    if (!callback) {
+        OFFLOAD_LOGW("offload_thread_loop: no callback set for event %d",
+                     event);
+        return;
+    }
+    out->callback_in_progress = true;
+    uint64_t start_ns = offload_trace_now_ns();
+    out_latency_hist_add(&out->callback_hist, start_ns - wake_ns);
+    OFFLOAD_EVENT("callback: event %u after %u us", event,
+                  (start_ns - wake_ns) / 1000);
+    out_unlock(out);
+
+    if (event == STREAM_CBK_EVENT_WRITE_READY) {
+        uint32_t now = (uint32_t)(start_ns / 1000);
+        android_atomic_release_store(now ? now : 1, &out->write_ready_us);
+    }
+    callback(event, param, cookie);
+    if (out->trace) {
+        offload_trace_record(out->trace, OFFLOAD_TRACE_CALLBACK,
+                             start_ns, event, 0, 0, 0, NULL, 0);
+    }
+
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+    out->callback_in_progress = false;
+    pthread_cond_broadcast(&out->cond);
+}
+
+static void offload_thread_config_from_properties(
+                struct offload_thread_config *config)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    memset(config, 0, sizeof(*config));
+    config->policy = SCHED_OTHER;
+    property_get("offload.cb.policy", value, "");
+    if (!strcmp(value, "fifo"))
+        config->policy = SCHED_FIFO;
+    else if (!strcmp(value, "rr"))
+        config->policy = SCHED_RR;
+    if (config->policy != SCHED_OTHER) {
+        int min = sched_get_priority_min(config->policy);
+        int max = sched_get_priority_max(config->policy);
+        property_get("offload.cb.priority", value, "2");
+        config->priority = atoi(value);
+        if (config->priority < min)
+            config->priority = min;
+        if (config->priority > max)
+            config->priority = max;
+    }
+    property_get("offload.cb.cpus", value, "0");
+    config->cpu_mask = strtoul(value, NULL, 16);
+    property_get("offload.cb.stack_kb", value, "0");
+    config->stack_size = (size_t)atoi(value) * 1024;
+    if (config->stack_size && config->stack_size < (size_t)PTHREAD_STACK_MIN)
+        config->stack_size = PTHREAD_STACK_MIN;
+}
+
+/* Runs on the offload thread. A real-time class the process is not allowed
+ * to use falls back to the default audio priority.
+ */
+static void offload_thread_apply_config(const struct offload_thread_config *config)
+{
+    bool realtime = false;
+
+    if (config->policy != SCHED_OTHER) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        if (sched_setscheduler(0, config->policy, &param) == 0)
+            realtime = true;
+        else
+            ALOGW("offload_thread: cannot set policy %d priority %d: %s",
+                  config->policy, config->priority, strerror(errno));
+    }
+    if (!realtime)
+        setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+    set_sched_policy(0, SP_FOREGROUND);
+
+    if (config->cpu_mask) {
+        cpu_set_t cpus;
+        unsigned int cpu;
+        CPU_ZERO(&cpus);
+        for (cpu = 0; cpu < 32; cpu++) {
+            if (config->cpu_mask & (1u << cpu))
+                CPU_SET(cpu, &cpus);
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            ALOGW("offload_thread: cannot set affinity 0x%x: %s",
+                  config->cpu_mask, strerror(errno));
+    }
+    ALOGV("offload_thread: policy %d priority %d cpus 0x%x",
+          realtime ? config->policy : SCHED_OTHER, config->priority,
+          config->cpu_mask);
+}
+
+/* One watchdog check, with watchdog_lock held: the DSP is hung when its
+ * position did not move since the previous check, watchdog_ms earlier,
+ * while data is queued and the stream is not paused. Records where it
+ * stopped. *last_ms is ~0 before the first check of an armed call.
+ */
+static bool out_watchdog_check_l(struct offload_stream_out *out,
+                                 struct compress *compress, uint64_t *last_ms)
+{
+    uint32_t ring_size = out->watchdog_ring_size;
+    struct timespec ts;
+    unsigned int avail;
+    uint64_t ms;
+
+    // The handle stays open while armed: disarming takes this lock
+    if (compress_get_hpointer(compress, &avail, &ts) < 0)
+        return false;
+    ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (out->watchdog_paused || avail >= ring_size || ms != *last_ms) {
+        *last_ms = ms;
+        return false;
+    }
+    ALOGE("offload_watchdog: DSP stuck at %llu ms for %u ms with %u bytes "
+          "queued", (unsigned long long)ms, out->watchdog_ms,
+          ring_size - avail);
+    out->dsp_stalled = true;
+    out->stall_position_ms = (uint32_t)ms;
+    out->stall_queued = ring_size - avail;
+    return true;
+}
+
+/* Watches the DSP while the offload thread is blocked in a drain, which
+ * has no timeout: it wakes once per watchdog_ms, and if the DSP is hung
+ * stops the stream, which returns the blocked drain, and the offload
+ * thread recovers it with out_recover_dsp. Buffer waits are checked by
+ * out_wait_for_buffer itself.
+ */
+static void *offload_watchdog_loop(void *context)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)context;
+
+    prctl(PR_SET_NAME, (unsigned long)"Offload Watchdog", 0, 0, 0);
+    pthread_mutex_lock(&out->watchdog_lock);
+    while (!out->watchdog_exit) {
+        struct compress *compress = out->watchdog_compress;
+        uint64_t last_ms = ~0ull;
+
+        if (!compress || !out->watchdog_drain || out->dsp_stalled) {
+            pthread_cond_wait(&out->watchdog_cond, &out->watchdog_lock);
+            continue;
+        }
+        out_watchdog_check_l(out, compress, &last_ms);
+        while (!out->watchdog_exit && out->watchdog_compress == compress) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += out->watchdog_ms / 1000;
+            ts.tv_nsec += (out->watchdog_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&out->watchdog_cond, &out->watchdog_lock,
+                                   &ts);
+            out_cpu_sample(&out->watchdog_cpu);
+            out->watchdog_polls++;
+            if (out->watchdog_exit || out->watchdog_compress != compress)
+                break;
+            if (out_watchdog_check_l(out, compress, &last_ms)) {
+                compress_stop(compress);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&out->watchdog_lock);
+    return NULL;
+}
+
+/* Called with out->lock held: the watchdog thread never takes it, so the
+ * stream state it needs is copied here and kept current by pause/resume.
+ */
+static void out_watchdog_arm_l(struct offload_stream_out *out,
+                               struct compress *compress, bool drain)
+{
+    if (!out->watchdog_ms)
+        return;
+    pthread_mutex_lock(&out->watchdog_lock);
+    out->watchdog_compress = compress;
+    out->watchdog_drain = drain;
+    out->watchdog_paused = out->state == STREAM_PAUSING;
+    out->watchdog_ring_size = out->buffer_size * OFFLOAD_FRAGMENTS;
+    pthread_cond_signal(&out->watchdog_cond);
+    pthread_mutex_unlock(&out->watchdog_lock);
+}
+
+static void out_watchdog_pause_l(struct offload_stream_out *out, bool paused)
+{
+    if (!out->watchdog_ms)
+        return;
+    pthread_mutex_lock(&out->watchdog_lock);
+    out->watchdog_paused = paused;
+    pthread_mutex_unlock(&out->watchdog_lock);
+}
+
+/* Returns true when the watchdog stopped the DSP during the armed call */
+static bool out_watchdog_disarm(struct offload_stream_out *out)
+{
+    bool stalled;
+
+    if (!out->watchdog_ms)
+        return false;
+    pthread_mutex_lock(&out->watchdog_lock);
+    out->watchdog_compress = NULL;
+    stalled = out->dsp_stalled;
+    pthread_cond_signal(&out->watchdog_cond);
+    pthread_mutex_unlock(&out->watchdog_lock);
+    return stalled;
+}
+
+/* Waits for room in the DSP ring. With the watchdog on, the wait times out
+ * after watchdog_ms, and only then is the DSP position checked; a hung DSP
+ * ends the wait with dsp_stalled set. Returns how many times compress_wait
+ * returned, *timeouts of them on the watchdog timeout.
+ */
+static uint32_t out_wait_for_buffer(struct offload_stream_out *out,
+                                    struct compress *compress,
+                                    uint32_t *timeouts)
+{
+    uint64_t last_ms = ~0ull;
+
+    *timeouts = 0;
+    if (!out->watchdog_ms) {
+        compress_wait(compress, -1);
+        return 1;
+    }
+    pthread_mutex_lock(&out->watchdog_lock);
+    out_watchdog_check_l(out, compress, &last_ms);
+    pthread_mutex_unlock(&out->watchdog_lock);
+    while (compress_wait(compress, out->watchdog_ms) < 0 && errno == ETIME) {
+        ++*timeouts;
+        pthread_mutex_lock(&out->watchdog_lock);
+        bool stalled = out_watchdog_check_l(out, compress, &last_ms);
+        pthread_mutex_unlock(&out->watchdog_lock);
+        if (stalled)
+            return *timeouts;
+    }
+    return *timeouts + 1;
+}
+
+/* Audio time of 'bytes' of the stream, 0 when its bit rate is unknown */
+static uint32_t out_bytes_to_ms(const struct offload_stream_out *out,
+                                uint32_t bytes)
+{
+    struct offload_buffer_config config;
+
+    offload_buffer_config_get(out->format, mCodec.avgBitRate, out->sample_rate,
+                              out->channels, &config);
+    if (!config.wakeup_ms || !config.fragment_size)
+        return 0;
+    return (uint32_t)((uint64_t)bytes * config.wakeup_ms /
+                      config.fragment_size);
+}
+
+/* Replaces a hung compress stream, on the offload thread with out->lock
+ * released. The render position and gapless metadata of the old stream are
+ * carried over, and the bytes it had not consumed are queued again from the
+ * pause shadow, before AudioFlinger is told, through the pending callback,
+ * to refill the new one. Without the shadow (offload.watchdog.replay off)
+ * or when they cannot be queued again, they are skipped in the position. Bounded by OFFLOAD_WATCHDOG_REOPENS device opens; if they
+ * all fail the stream is left in standby and out_write retries. Returns
+ * the number of bytes the new stream plays again, or the open error.
+ */
+static int out_recover_dsp(struct offload_stream_out *out)
+{
+    uint64_t start_ns = offload_trace_now_ns();
+    struct compr_gapless_mdata mdata;
+    uint32_t position, queued, saved = 0;
+    uint8_t *tail = NULL;
+    int sent = 0;
+    int attempt, ret = -EINVAL;
+
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+    position = out->adjusted_render_offset + out->stall_position_ms;
+    mdata = out->gapless_mdata;
+    queued = out->stall_queued;
+    if (queued && out_pause_shadow_valid(out)) {
+        saved = queued < out->pause_shadow_pos ? queued : out->pause_shadow_pos;
+        tail = (uint8_t *)malloc(saved);
+        if (tail)
+            out_pause_shadow_tail_l(out, tail, saved);
+        else
+            saved = 0;
+    }
+    // close_device must not drain a hung DSP
+    out->state = STREAM_OPEN;
+    out_unlock(out);
+
+    close_device(&out->stream);
+    for (attempt = 0; attempt < OFFLOAD_WATCHDOG_REOPENS && ret; attempt++) {
+        ret = open_device(out);
+        if (ret)
+            ALOGE("out_recover_dsp: reopen %d failed %d", attempt, ret);
+    }
+
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+    if (!ret) {
+        if ((mdata.encoder_delay || mdata.encoder_padding) &&
+                compress_set_gapless_metadata(out->compress, &mdata) < 0)
+            out->send_new_metadata = 1;
+        // The new stream starts with the next out_write
+        out->volume_change_requested = true;
+        out->state = STREAM_OPEN;
+        out->standby = false;
+        if (saved) {
+            sent = compress_write(out->compress, tail, saved);
+            if (sent < 0)
+                sent = 0;
+            if (sent && compress_start(out->compress) == 0) {
+                offload_notifier_post(&out->dev->notifier,
+                                      AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD);
+                out->state = STREAM_RUNNING;
+            } else {
+                sent = 0;
+            }
+        }
+        if ((uint32_t)sent < queued) {
+            uint32_t lost_ms = out_bytes_to_ms(out, queued - sent);
+            ALOGW("out_recover_dsp: %u of %u queued bytes not played, %u ms "
+                  "skipped", queued - sent, queued, lost_ms);
+            position += lost_ms;
+        }
+    } else {
+        out->standby = true;
+        out_handoff_l(out, OFFLOAD_HANDOFF_DSP_LOST, out->stall_queued);
+    }
+    out->adjusted_render_offset = position;
+    uint32_t us = (uint32_t)((offload_trace_now_ns() - start_ns) / 1000);
+    out->recoveries++;
+    out->recovery_last_us = us;
+    if (us > out->recovery_max_us)
+        out->recovery_max_us = us;
+    out_unlock(out);
+    free(tail);
+
+    pthread_mutex_lock(&out->watchdog_lock);
+    out->dsp_stalled = false;
+    pthread_mutex_unlock(&out->watchdog_lock);
+    ALOGW("out_recover_dsp: %s in %u us, position %u ms, %d bytes queued "
+          "again", ret ? "failed" : "recovered", us, position, sent);
+    return ret ? ret : sent;
+}
+
+/* Takes the format of the next track into the stream once the device
+ * plays it: after the drain passed a codec changed in place, or once the
+ * device was reopened.
+ */
+static void out_take_next_format_l(struct offload_stream_out *out,
+                                   const struct offload_next_format *next)
+{
+    OFFLOAD_EVENT("out_next_format: format %x, rate %u", next->format,
+                  next->sample_rate);
+    out->format = next->format;
+    out->sample_rate = next->sample_rate;
+    out->channels = next->channels;
+    mCodec.sampleRate = next->sample_rate;
+    mCodec.numChannels = popcount(next->channels);
+    if (next->bit_rate)
+        mCodec.avgBitRate = next->bit_rate;
+    mCodec.codecID = next->aac_object_type;
+    mCodec.downSampling = next->aac_down_sampling;
+}
+
+/* The announced format of the next track, with the stream bit rate when it
+ * gave none. Taken at the partial drain so that a later announcement, a
+ * flush or offload_dev_set_parameters cannot change it midway.
+ */
+static void out_next_format_l(const struct offload_stream_out *out,
+                              struct offload_next_format *next)
+{
+    *next = out->next_format;
+    if (!next->bit_rate)
+        next->bit_rate = mCodec.avgBitRate;
+}
+
+/* Changes the codec to next in place after compress_next_track, on the
+ * offload thread with out->lock released. Fails when tinycompress or the
+ * driver cannot, and the caller reopens the device instead.
+ */
+static int out_switch_codec(struct offload_stream_out *out,
+                            struct compress *compress,
+                            const struct offload_next_format *next)
+{
+    struct snd_codec codec;
+    int ret;
+
+    if (!compress_set_codec_params)
+        return -ENOSYS;
+    ret = out_codec_params(out, next, &codec);
+    if (ret)
+        return ret;
+    if (compress_set_codec_params(compress, &codec) < 0) {
+        OFFLOAD_LOGW("out_switch_codec: refused, Err=%s",
+                     compress_get_error(compress));
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Reopens the drained device in next, the format of the next track, on
+ * the offload thread with out->lock released, when it could not be changed
+ * in place. The render position carries over as in out_recover_dsp; if the
+ * open fails the stream keeps its format and is handed off.
+ */
+static void out_reopen_codec(struct offload_stream_out *out,
+                             const struct offload_next_format *next)
+{
+    uint64_t start_ns = offload_trace_now_ns();
+    struct compr_gapless_mdata mdata;
+    struct timespec tstamp;
+    unsigned int avail;
+    uint32_t position;
+    int ret;
+
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+    position = out->adjusted_render_offset;
+    if (compress_get_hpointer(out->compress, &avail, &tstamp) == 0)
+        position += tstamp.tv_sec * 1000 + tstamp.tv_nsec / 1000000;
+    mdata = out->gapless_mdata;
+    // Drained already, close_device must not wait again
+    out->state = STREAM_OPEN;
+    out_unlock(out);
+
+    close_device(&out->stream);
+    ret = open_device_format(out, next);
+
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+    out->adjusted_render_offset = position;
+    if (!ret) {
+        out_take_next_format_l(out, next);
+        if ((mdata.encoder_delay || mdata.encoder_padding) &&
+                compress_set_gapless_metadata(out->compress, &mdata) < 0)
+            out->send_new_metadata = 1;
+        // The new stream starts with the next track
+        out->volume_change_requested = true;
+        out->state = STREAM_OPEN;
+        out->standby = false;
+    } else {
+        ALOGE("out_reopen_codec: format %x not opened, %d", next->format,
+              ret);
+        out->standby = true;
+        out_handoff_l(out, OFFLOAD_HANDOFF_OPEN_FAILED, 0);
+    }
+    uint32_t us = (uint32_t)((offload_trace_now_ns() - start_ns) / 1000);
+    out->codec_reopens++;
+    if (us > out->codec_reopen_max_us)
+        out->codec_reopen_max_us = us;
+    out_unlock(out);
+    ALOGI("out_reopen_codec: format %x in %u us, position %u ms",
+          next->format, us, position);
+}
+
+/* Runs on the offload thread, so that the handoff events are ordered with
+ * the other callbacks. The retry opens the device with out->lock released;
+ * out_write keeps returning 0 until it succeeded.
+ */
+static void out_run_handoff_cmd_l(struct offload_stream_out *out, int command)
+{
+    uint64_t wake_ns = offload_trace_now_ns();
+
+    if (command == OFFLOAD_CMD_HANDOFF_RETRY) {
+        if (!out->handoff_active)
+            return;
+        out_unlock(out);
+        int ret = open_device(out);
+        out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+        out->handoff_retries++;
+        if (ret) {
+            ALOGW("out_handoff: reopen failed %d, still handed off", ret);
+            return;
+        }
+        out->standby = false;
+        out->state = STREAM_OPEN;
+        out->send_new_metadata = 1;
+        out->volume_change_requested = true;
+        out->handoff_active = false;
+        out->handoff.reason = OFFLOAD_HANDOFF_NONE;
+        out->handoff.written = out->bytes_written;
+        out->handoff.consumed = out->bytes_written;
+        out->handoff.position_ms = out->adjusted_render_offset;
+        ALOGI("out_handoff: offloaded again at byte %llu",
+              (unsigned long long)out->bytes_written);
+    }
+    struct offload_handoff handoff = out->handoff;
+    dispatch_offload_callback_l(out, out->handoff_active ?
+                                        OFFLOAD_CBK_EVENT_UNAVAILABLE :
+                                        OFFLOAD_CBK_EVENT_AVAILABLE,
+                                &handoff, wake_ns);
+}
+
 static void *offload_thread_loop(void *context)
 {
     struct offload_stream_out *out = (struct offload_stream_out *) context;
@@ -1054,65 +3117,102 @@ static void *offload_thread_loop(void *context)
 //    out->offload_state = OFFLOAD_STATE_IDLE;
     out->playback_started = 0;
 
-    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
-    set_sched_policy(0, SP_FOREGROUND);
+    offload_thread_apply_config(&out->thread_config);
     prctl(PR_SET_NAME, (unsigned long)"Offload Callback", 0, 0, 0);
 
     ALOGV("%s", __func__);
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
     for (;;) {
         struct offload_cmd *cmd = NULL;
         stream_callback_event_t event;
         bool send_callback = false;
 
-        ALOGV("%s offload_cmd_list %d",
-              __func__, list_empty(&out->offload_cmd_list));
         if (list_empty(&out->offload_cmd_list)) {
-            ALOGV("%s SLEEPING", __func__);
-            pthread_cond_wait(&out->offload_cond, &out->lock);
-            ALOGV("%s RUNNING", __func__);
+            // The trace is written out once its oldest record is old enough,
+            // so that a crash or a hang loses little of it
+            uint32_t ms = out->trace ? offload_trace_flush_wait_ms(out->trace) :
+                                       ~0u;
+            if (ms == ~0u) {
+                out_cond_wait(out, &out->offload_cond);
+            } else if (ms) {
+                out_cond_timedwait(out, &out->offload_cond, ms);
+            } else {
+                out_unlock(out);
+                offload_trace_flush(out->trace);
+                out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+            }
             continue;
         }
 
         item = list_head(&out->offload_cmd_list);
         cmd = node_to_item(item, struct offload_cmd, node);
         list_remove(item);
+        out_latency_hist_add(&out->cmd_wake_hist,
+                             offload_trace_now_ns() - cmd->posted_ns);
 
-        ALOGV("%s CMD %d out->compress %p",
-               __func__, cmd->cmd, out->compress);
+        OFFLOAD_EVENT("offload thread: command %u, compress %u", cmd->cmd,
+                      out->compress != NULL);
 
         if (cmd->cmd == OFFLOAD_CMD_EXIT) {
             free(cmd);
-            break;
+            break;
+        }
+        if (cmd->cmd == OFFLOAD_CMD_TRACE_FLUSH) {
+            out->trace_flush_posted = false;
+            out_unlock(out);
+            offload_trace_flush(out->trace);
+            out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
+            free(cmd);
+            continue;
+        }
+        if (cmd->cmd == OFFLOAD_CMD_HANDOFF ||
+                cmd->cmd == OFFLOAD_CMD_HANDOFF_RETRY) {
+            out_run_handoff_cmd_l(out, cmd->cmd);
+            free(cmd);
+            continue;
         }
 
         if (out->compress == NULL) {
-            ALOGE("%s: Compress handle is NULL", __func__);
+            OFFLOAD_LOGE("%s: Compress handle is NULL", __func__);
             pthread_cond_signal(&out->cond);
             continue;
         }
+        struct offload_next_format next;
+        bool next_format = false;
+        bool reopen_codec = false;
+        if (cmd->cmd == OFFLOAD_CMD_PARTIAL_DRAIN && out->next_format_pending) {
+            out_next_format_l(out, &next);
+            out->next_format_pending = false;
+            next_format = true;
+        }
         out->offload_thread_blocked = true;
-        pthread_mutex_unlock(&out->lock);
+        struct compress *compress = out->compress;
+        out_watchdog_arm_l(out, compress,
+                           cmd->cmd != OFFLOAD_CMD_WAIT_FOR_BUFFER);
+        out_unlock(out);
         send_callback = false;
+        uint64_t wake_ns;
+        uint32_t wakeups = 0, wait_timeouts = 0;
         switch(cmd->cmd) {
         case OFFLOAD_CMD_WAIT_FOR_BUFFER:
-            ALOGV("OFFLOAD_CMD_WAIT_FOR_BUFFER waiting on Compress_wait");
-            compress_wait(out->compress, -1);
-            ALOGV("OFFLOAD_CMD_WAIT_FOR_BUFFER coming out of Compress_wait");
+            wakeups = out_wait_for_buffer(out, compress, &wait_timeouts);
             send_callback = true;
             event = STREAM_CBK_EVENT_WRITE_READY;
             break;
         case OFFLOAD_CMD_PARTIAL_DRAIN:
-            ALOGV("OFFLOAD_CMD_PARTIAL_DRAIN: Calling compress_next_track");
             compress_next_track(out->compress);
-            ALOGV("OFFLOAD_CMD_PARTIAL_DRAIN: Calling compress_drain");
-            compress_partial_drain(out->compress);
+            if (next_format && out_switch_codec(out, compress, &next) < 0) {
+                // The current track plays out, then the device is reopened
+                compress_drain(compress);
+                reopen_codec = true;
+            } else {
+                compress_partial_drain(out->compress);
+                out->state = STREAM_DRAINING;
+            }
             send_callback = true;
             event = STREAM_CBK_EVENT_DRAIN_READY;
-            out->state = STREAM_DRAINING;
             break;
         case OFFLOAD_CMD_DRAIN:
-            ALOGV("OFFLOAD_CMD_DRAIN: calling compress_drain");
             compress_drain(out->compress);
             send_callback = true;
             event = STREAM_CBK_EVENT_DRAIN_READY;
@@ -1122,12 +3222,47 @@ static void *offload_thread_loop(void *context)
             ALOGE("%s unknown command received: %d", __func__, cmd->cmd);
             break;
         }
-        pthread_mutex_lock(&out->lock);
+        bool stalled = out_watchdog_disarm(out);
+        int replayed = 0;
+        if (stalled) {
+            replayed = out_recover_dsp(out);
+            // Nothing of the current track is left to play: the new stream
+            // starts with the next one
+            if (next_format && replayed == 0) {
+                out_reopen_codec(out, &next);
+                reopen_codec = true;
+            }
+        } else if (reopen_codec) {
+            out_reopen_codec(out, &next);
+        }
+        wake_ns = offload_trace_now_ns();
+        out_lock(out, OUT_LOCK_OFFLOAD_THREAD);
         out->offload_thread_blocked = false;
+        if (next_format && stalled && replayed > 0) {
+            // The boundary was not reached: the tail plays again first
+            if (!out->next_format_pending) {
+                out->next_format = next;
+                out->next_format_pending = true;
+            }
+        } else if (next_format && stalled && replayed < 0) {
+            // The stream is reopened by out_write, with the next track
+            out_take_next_format_l(out, &next);
+        } else if (next_format && !reopen_codec) {
+            out_take_next_format_l(out, &next);
+            out->codec_switches++;
+        }
+        if (replayed > 0 && cmd->cmd != OFFLOAD_CMD_WAIT_FOR_BUFFER) {
+            // The tail of the track is queued again: drain it before
+            // reporting the drain done
+            send_offload_cmd_l(out, cmd->cmd);
+            send_callback = false;
+        }
+        out_cpu_sample(&out->thread_cpu);
+        out->wakeups += wakeups;
+        out->wait_timeouts += wait_timeouts;
         pthread_cond_signal(&out->cond);
         if (send_callback) {
-            ALOGV("offload_thread_loop sending callback event %d", event);
-            out->offload_callback(event, NULL, out->offload_cookie);
+            dispatch_offload_callback_l(out, event, NULL, wake_ns);
         }
         free(cmd);
     }
@@ -1138,16 +3273,178 @@ static void *offload_thread_loop(void *context)
         list_remove(item);
         free(node_to_item(item, struct offload_cmd, node));
     }
-    pthread_mutex_unlock(&out->lock);
+    out_unlock(out);
 
     return NULL;
 }
+/* Entry points installed instead of the plain ones when the trace recorder
+ * is enabled, so that a disabled recorder costs nothing on the hot paths.
+ */
+static int out_float_bits(float value)
+{
+    int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/* Has the offload thread write the trace out when enough is buffered, or
+ * right away ('now') before a standby or a pause, where a session often
+ * ends; the entry points never write the file themselves.
+ */
+static void out_trace_kick(struct offload_stream_out *out, bool now)
+{
+    if (!now && !offload_trace_flush_due(out->trace))
+        return;
+    out_lock(out, OUT_LOCK_CONTROL);
+    if (!out->trace_flush_posted &&
+            send_offload_cmd_l(out, OFFLOAD_CMD_TRACE_FLUSH) == 0)
+        out->trace_flush_posted = true;
+    out_unlock(out);
+}
+
+static ssize_t out_write_traced(struct audio_stream_out *stream,
+                                const void* buffer, size_t bytes)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    ssize_t sent = out_write(stream, buffer, bytes);
+    bool payload = offload_trace_wants_payload(out->trace);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_WRITE, start_ns, bytes,
+                         0, 0, sent, payload ? buffer : NULL, bytes);
+    out_trace_kick(out, false);
+    return sent;
+}
+
+static int out_set_parameters_traced(struct audio_stream *stream,
+                                     const char *kvpairs)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_set_parameters(stream, kvpairs);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_SET_PARAMETERS, start_ns,
+                         0, 0, 0, ret, kvpairs, strlen(kvpairs));
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static int out_standby_traced(struct audio_stream *stream)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_standby(stream);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_STANDBY, start_ns,
+                         0, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, true);
+    return ret;
+}
+
+static int out_set_volume_traced(struct audio_stream_out *stream, float left,
+                                 float right)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_set_volume(stream, left, right);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_SET_VOLUME, start_ns,
+                         out_float_bits(left), out_float_bits(right), 0, ret,
+                         NULL, 0);
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static int out_get_render_position_traced(const struct audio_stream_out *stream,
+                                          uint32_t *dsp_frames)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_get_render_position(stream, dsp_frames);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_RENDER_POSITION, start_ns,
+                         *dsp_frames, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static int out_pause_traced(struct audio_stream_out *stream)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_pause(stream);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_PAUSE, start_ns,
+                         0, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, true);
+    return ret;
+}
+
+static int out_resume_traced(struct audio_stream_out *stream)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_resume(stream);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_RESUME, start_ns,
+                         0, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static int out_drain_traced(struct audio_stream_out *stream,
+                            audio_drain_type_t type)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_drain(stream, type);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_DRAIN, start_ns,
+                         type, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static int out_flush_traced(const struct audio_stream_out *stream)
+{
+    struct offload_stream_out *out = (struct offload_stream_out *)stream;
+    uint64_t start_ns = offload_trace_now_ns();
+    int ret = out_flush(stream);
+    offload_trace_record(out->trace, OFFLOAD_TRACE_FLUSH, start_ns,
+                         0, 0, 0, ret, NULL, 0);
+    out_trace_kick(out, false);
+    return ret;
+}
+
+static void out_install_trace(struct offload_stream_out *out)
+{
+    out->trace = offload_trace_open_from_properties();
+    if (!out->trace)
+        return;
+    out->stream.common.standby = out_standby_traced;
+    out->stream.common.set_parameters = out_set_parameters_traced;
+    out->stream.set_volume = out_set_volume_traced;
+    out->stream.write = out_write_traced;
+    out->stream.get_render_position = out_get_render_position_traced;
+    out->stream.pause = out_pause_traced;
+    out->stream.resume = out_resume_traced;
+    out->stream.drain = out_drain_traced;
+    out->stream.flush = out_flush_traced;
+}
+
 static int create_offload_callback_thread(struct offload_stream_out *out)
 {
+    pthread_attr_t attr;
+
     pthread_cond_init(&out->offload_cond, (const pthread_condattr_t *) NULL);
     list_init(&out->offload_cmd_list);
-    pthread_create(&out->offload_thread, (const pthread_attr_t *) NULL,
-                    offload_thread_loop, out);
+    offload_thread_config_from_properties(&out->thread_config);
+    pthread_attr_init(&attr);
+    if (out->thread_config.stack_size)
+        pthread_attr_setstacksize(&attr, out->thread_config.stack_size);
+    char value[PROPERTY_VALUE_MAX];
+    out->watchdog_ms = property_get("offload.watchdog.ms", value, NULL) ?
+                           atoi(value) : OFFLOAD_WATCHDOG_MS;
+    property_get("offload.watchdog.replay", value, "0");
+    out->watchdog_replay = out->watchdog_ms && atoi(value) == 1;
+    pthread_mutex_init(&out->watchdog_lock, NULL);
+    pthread_cond_init(&out->watchdog_cond, NULL);
+    pthread_create(&out->offload_thread, &attr, offload_thread_loop, out);
+    pthread_attr_destroy(&attr);
+    if (out->watchdog_ms)
+        pthread_create(&out->watchdog_thread, NULL, offload_watchdog_loop, out);
     return 0;
 }
 static int offload_dev_open_output_stream(struct audio_hw_device *dev,
@@ -1171,6 +3468,10 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
         ALOGE("offload_dev_open_output_stream: Already device open");
         return -EINVAL;
     }
+    if (!is_offload_device_available(loffload_dev, config->format,
+                                     config->channel_mask,
+                                     config->sample_rate))
+        return -EINVAL;
 
     out = (struct offload_stream_out *)
                         calloc(1, sizeof(struct offload_stream_out));
@@ -1179,6 +3480,9 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
         return -ENOMEM;
     }
 
+    out->dev = loffload_dev;
+    out->endpoint = -1;
+    out->backend = loffload_dev->backend;
     out->stream.common.get_sample_rate = out_get_sample_rate;
     out->stream.common.set_sample_rate = out_set_sample_rate;
     out->stream.common.get_buffer_size = out_get_buffer_size;
@@ -1198,6 +3502,10 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
     out->stream.resume = out_resume;
     out->stream.drain = out_drain;
     out->stream.flush = out_flush;
+    out_install_trace(out);
+    char value[PROPERTY_VALUE_MAX];
+    property_get("offload.lock.stats", value, "0");
+    out->lock_stats_enabled = (atoi(value) == 1);
     if (flags & AUDIO_OUTPUT_FLAG_NON_BLOCKING) {
         ALOGV("offload_dev_open_output_stream: setting non-blocking to 1");
         out->non_blocking = 1;
@@ -1209,12 +3517,47 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
     out->format = config->format;
     out->sample_rate = config->sample_rate;
     out->channels = config->channel_mask;
-    out->buffer_size = offload_dev_get_offload_buffer_size(dev,
-                                               config->offload_info.bit_rate,
-                                               config->sample_rate,
-                                               config->channel_mask);
+    struct offload_buffer_config buffer_config;
+    offload_buffer_config_get(config->format, config->offload_info.bit_rate,
+                              config->sample_rate, config->channel_mask,
+                              &buffer_config);
+    out->buffer_size = buffer_config.fragment_size;
+    // The codec settings open_device sends to the DSP
+    mCodec.avgBitRate = config->offload_info.bit_rate;
+    mCodec.sampleRate = config->sample_rate;
+    mCodec.numChannels = config->channel_mask;
     //Default route is done for offload and let primary HAL do the routing
     out->device_output = OFFLOAD_STREAM_DEFAULT_OUTPUT;
+    out->devices = devices ? devices : AUDIO_DEVICE_OUT_SPEAKER;
+    out->open_ns = offload_trace_now_ns();
+    out->pause_timeout_ms = property_get("offload.pause.timeout.ms", value,
+                                         NULL) ? atoi(value) :
+                                                 OFFLOAD_PAUSE_TIMEOUT_MS;
+    if (out->pause_timeout_ms || out->watchdog_replay) {
+        out->pause_shadow = (uint8_t *)malloc(out->buffer_size *
+                                              OFFLOAD_FRAGMENTS);
+        if (!out->pause_shadow)
+            ALOGW("offload_dev_open_output_stream: no shadow ring, nothing "
+                  "is queued again after a release or a DSP stall");
+    }
+    if (out->pause_timeout_ms) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD;
+        sev.sigev_value.sival_ptr = loffload_dev;
+        sev.sigev_notify_function = out_pause_timer_expired;
+        if (out->pause_shadow &&
+                timer_create(CLOCK_MONOTONIC, &sev, &out->paused_timer_id) == 0)
+            out->pause_timer_created = true;
+        else
+            ALOGW("offload_dev_open_output_stream: no pause timeout");
+    }
+    if (out->trace) {
+        offload_trace_record(out->trace, OFFLOAD_TRACE_OPEN,
+                             offload_trace_now_ns(), config->format,
+                             config->sample_rate, config->channel_mask,
+                             config->offload_info.bit_rate, NULL, 0);
+    }
     ret = open_device(out);
     if (ret != 0) {
         ALOGE("offload_dev_open_output_stream: open_device error");
@@ -1222,7 +3565,9 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
     }
 
     loffload_dev->offload_out_ref_count += 1;
+    pthread_mutex_lock(&loffload_dev->lock);
     loffload_dev->out = out;
+    pthread_mutex_unlock(&loffload_dev->lock);
 
     ALOGV("offload_dev_open_output_stream: offload device opened");
 
@@ -1232,7 +3577,11 @@ static int offload_dev_open_output_stream(struct audio_hw_device *dev,
 
 err_open:
     ALOGE("offload_dev_open_output_stream -> err_open:");
+    if (out->pause_timer_created)
+        timer_delete(out->paused_timer_id);
+    free(out->pause_shadow);
     destroy_offload_callback_thread(out);
+    offload_trace_close(out->trace);
     free(out);
     *stream_out = NULL;
     return ret;
@@ -1241,14 +3590,33 @@ err_open:
 static int destroy_offload_callback_thread(struct offload_stream_out *out)
 {
     ALOGI("destroy_offload_callback_thread");
-    pthread_mutex_lock(&out->lock);
+    out_lock(out, OUT_LOCK_CONTROL);
     stop_compressed_output_l(out);
     send_offload_cmd_l(out, OFFLOAD_CMD_EXIT);
 
-    pthread_mutex_unlock(&out->lock);
+    out_unlock(out);
     pthread_join(out->offload_thread, (void **) NULL);
     pthread_cond_destroy(&out->offload_cond);
 
+    if (out->watchdog_ms) {
+        pthread_mutex_lock(&out->watchdog_lock);
+        out->watchdog_exit = true;
+        pthread_cond_signal(&out->watchdog_cond);
+        pthread_mutex_unlock(&out->watchdog_lock);
+        pthread_join(out->watchdog_thread, NULL);
+    }
+    pthread_cond_destroy(&out->watchdog_cond);
+    pthread_mutex_destroy(&out->watchdog_lock);
+
+    if (out->ramp_thread_started) {
+        out_lock(out, OUT_LOCK_CONTROL);
+        out->ramp_exit = true;
+        pthread_cond_signal(&out->ramp_cond);
+        out_unlock(out);
+        pthread_join(out->ramp_thread, NULL);
+        pthread_cond_destroy(&out->ramp_cond);
+    }
+
     return 0;
 }
 static void offload_dev_close_output_stream(struct audio_hw_device *dev,
@@ -1257,65 +3625,446 @@ static void offload_dev_close_output_stream(struct audio_hw_device *dev,
     struct offload_audio_device *loffload_dev = (struct offload_audio_device *)dev;
     struct offload_stream_out *out = (struct offload_stream_out *)stream;
     ALOGV("offload_dev_close_output_stream");
+    pthread_mutex_lock(&loffload_dev->lock);
+    loffload_dev->out = NULL;
+    pthread_mutex_unlock(&loffload_dev->lock);
+    if (out->pause_timer_created)
+        timer_delete(out->paused_timer_id);
     out_standby(&stream->common);
     destroy_offload_callback_thread(out);
+    mixer_release(out);
+    if (out->shm.header)
+        offload_shm_release(&out->shm);
+    free(out->pause_shadow);
     pthread_cond_destroy(&out->cond);
     pthread_mutex_destroy(&out->lock);
     //close_device(stream);
+    if (out->trace) {
+        offload_trace_record(out->trace, OFFLOAD_TRACE_CLOSE,
+                             offload_trace_now_ns(), 0, 0, 0, 0, NULL, 0);
+        offload_trace_close(out->trace);
+    }
     loffload_dev->offload_out_ref_count = 0;
     free(stream);
     release_wake_lock(lockid_offload);
 }
 
-static int offload_dev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
+static uint32_t capture_bit_rate(audio_format_t format, uint32_t bit_rate)
 {
-    ALOGV("offload_dev_set_parameters kvpairs = %s", kvpairs);
+    if (bit_rate)
+        return bit_rate;
+    switch (format) {
+    case AUDIO_FORMAT_AAC:
+        return CAPTURE_AAC_BITRATE;
+    case AUDIO_FORMAT_AMR_NB:
+        return CAPTURE_AMR_NB_BITRATE;
+    case AUDIO_FORMAT_AMR_WB:
+        return CAPTURE_AMR_WB_BITRATE;
+    default:
+        return 0;
+    }
+}
+
+/* Sized by codec_offload_buffer, like the playback fragments */
+static size_t capture_buffer_size(audio_format_t format, uint32_t bit_rate)
+{
+    struct offload_buffer_config buffer_config;
+
+    offload_buffer_capture_config_get(format, bit_rate, &buffer_config);
+    return buffer_config.fragment_size;
+}
+
+static int capture_open_device(struct offload_stream_in *in)
+{
+    struct compr_config config;
+    struct snd_codec codec;
+    int card;
+
+    memset(&codec, 0, sizeof(codec));
+    codec.ch_in = popcount(in->channels);
+    codec.ch_out = codec.ch_in;
+    codec.sample_rate = in->sample_rate;
+    codec.bit_rate = in->bit_rate;
+    switch (in->format) {
+    case AUDIO_FORMAT_AAC:
+        codec.id = SND_AUDIOCODEC_AAC;
+        codec.profile = SND_AUDIOPROFILE_AAC;
+        codec.ch_mode = SND_AUDIOMODE_AAC_LC;
+        codec.format = SND_AUDIOSTREAMFORMAT_MP4ADTS;
+        break;
+    case AUDIO_FORMAT_AMR_NB:
+        codec.id = SND_AUDIOCODEC_AMR;
+        codec.profile = SND_AUDIOPROFILE_AMR;
+        codec.format = SND_AUDIOSTREAMFORMAT_FSF;
+        break;
+    case AUDIO_FORMAT_AMR_WB:
+        codec.id = SND_AUDIOCODEC_AMRWB;
+        codec.profile = SND_AUDIOPROFILE_AMRWB;
+        codec.format = SND_AUDIOSTREAMFORMAT_FSF;
+        break;
+    default:
+        return -EINVAL;
+    }
+    ALOGI("capture_open_device: codec.id=%d ch=%d sample_rate=%d bit_rate=%d "
+          "format=%x fragment=%d", codec.id, codec.ch_in, codec.sample_rate,
+          codec.bit_rate, codec.format, in->buffer_size);
+
+    config.fragment_size = in->buffer_size;
+    config.fragments = OFFLOAD_FRAGMENTS;
+    config.codec = &codec;
+    // No wake lock: AudioFlinger holds its own while the record thread
+    // runs, and blocking in compress_read lets the AP sleep between
+    // fragments.
+    in->compress = offload_open_compress(in->dev, OFFLOAD_ENDPOINT_CAPTURE,
+                                         "offload.compress.capture.device",
+                                         "1", &config, &card, &in->endpoint);
+    if (!in->compress) {
+        ALOGE("capture_open_device: no compress device for format %x",
+              in->format);
+        return -EINVAL;
+    }
+    if (compress_start(in->compress) < 0) {
+        ALOGE("capture_open_device: compress_start error %s",
+              compress_get_error(in->compress));
+        compress_close(in->compress);
+        in->compress = NULL;
+        offload_endpoints_release(&in->dev->endpoints, in->endpoint);
+        in->endpoint = -1;
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Capture time in ms, carried across standby like the render position */
+static uint32_t capture_position_ms_l(struct offload_stream_in *in)
+{
+    unsigned int avail;
+    struct timespec tstamp;
+
+    if (!in->compress ||
+            compress_get_hpointer(in->compress, &avail, &tstamp) < 0)
+        return in->captured_offset_ms;
+    return in->captured_offset_ms + tstamp.tv_sec * 1000 +
+           tstamp.tv_nsec / 1000000;
+}
+
+static void capture_close_device_l(struct offload_stream_in *in)
+{
+    if (!in->compress)
+        return;
+    in->captured_offset_ms = capture_position_ms_l(in);
+    compress_stop(in->compress);
+    compress_close(in->compress);
+    in->compress = NULL;
+    offload_endpoints_release(&in->dev->endpoints, in->endpoint);
+    in->endpoint = -1;
+}
+
+static uint32_t in_get_sample_rate(const struct audio_stream *stream)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+    return in->sample_rate;
+}
+
+static int in_set_sample_rate(struct audio_stream *stream, uint32_t rate)
+{
+    return 0;
+}
+
+static size_t in_get_buffer_size(const struct audio_stream *stream)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+    return in->buffer_size;
+}
 
+static uint32_t in_get_channels(const struct audio_stream *stream)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+    return in->channels;
+}
+
+static audio_format_t in_get_format(const struct audio_stream *stream)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+    return in->format;
+}
+
+static int in_set_format(struct audio_stream *stream, audio_format_t format)
+{
+    return -ENOSYS;
+}
+
+static int in_standby(struct audio_stream *stream)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+
+    pthread_mutex_lock(&in->lock);
+    if (!in->standby) {
+        capture_close_device_l(in);
+        in->standby = true;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return 0;
+}
+
+static int in_dump(const struct audio_stream *stream, int fd)
+{
+    return 0;
+}
+
+static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    return 0;
+}
+
+static char *in_get_parameters(const struct audio_stream *stream,
+                               const char *keys)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
     struct str_parms *param;
-    int value=0;
+    char value[32];
+    char *temp;
 
-    param = str_parms_create_str(kvpairs);
-    if (param == NULL) {
-        ALOGE("offload_dev_set_parameters: Error creating str from kvpairs");
-        return 0;
+    param = str_parms_create_str(keys);
+    if (param == NULL)
+        return NULL;
+    if (str_parms_get_str(param, CAPTURE_POSITION_KEY, value,
+                          sizeof(value)) >= 0) {
+        pthread_mutex_lock(&in->lock);
+        str_parms_add_int(param, CAPTURE_POSITION_KEY,
+                          capture_position_ms_l(in));
+        pthread_mutex_unlock(&in->lock);
+    }
+    temp = str_parms_to_str(param);
+    str_parms_destroy(param);
+    return temp;
+}
+
+static int in_add_audio_effect(const struct audio_stream *stream,
+                               effect_handle_t effect)
+{
+    return 0;
+}
+
+static int in_remove_audio_effect(const struct audio_stream *stream,
+                                  effect_handle_t effect)
+{
+    return 0;
+}
+
+static int in_set_gain(struct audio_stream_in *stream, float gain)
+{
+    return 0;
+}
+
+/* Blocks until 'bytes' of encoded data are available, opening the device
+ * when leaving standby.
+ */
+static ssize_t in_read(struct audio_stream_in *stream, void *buffer,
+                       size_t bytes)
+{
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+    int ret;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->standby) {
+        ret = capture_open_device(in);
+        if (ret < 0) {
+            pthread_mutex_unlock(&in->lock);
+            ALOGE("in_read: capture_open_device error %d", ret);
+            return ret;
+        }
+        in->standby = false;
+    }
+    ret = compress_read(in->compress, buffer, bytes);
+    if (ret < 0) {
+        ALOGE("in_read: compress_read error %s",
+              compress_get_error(in->compress));
+        capture_close_device_l(in);
+        in->standby = true;
+        pthread_mutex_unlock(&in->lock);
+        return -EIO;
     }
+    pthread_mutex_unlock(&in->lock);
+    ALOGV("in_read: %d of %d bytes", ret, bytes);
+    return ret;
+}
+
+static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
+{
+    return 0;
+}
 
-    // Avg bitrate in bps - for WMA/AAC/MP3
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE);
-        mCodec.avgBitRate = value;
-        ALOGV("offload_dev_set_parameters: average bit rate %d", mCodec.avgBitRate);
+static int offload_dev_open_input_stream(struct audio_hw_device *dev,
+                                         audio_io_handle_t handle,
+                                         audio_devices_t devices,
+                                         struct audio_config *config,
+                                         struct audio_stream_in **stream_in)
+{
+    struct offload_audio_device *loffload_dev =
+                                (struct offload_audio_device *)dev;
+    struct offload_stream_in *in;
+
+    ALOGV("offload_dev_open_input_stream: format 0x%x", config->format);
+    *stream_in = NULL;
+    uint32_t bit_rate = capture_bit_rate(config->format,
+                                         config->offload_info.bit_rate);
+    if (!bit_rate) {
+        ALOGV("offload_dev_open_input_stream: not an encoded format");
+        return -EINVAL;
     }
-    // Sample rate - for WMA/AAC direct from parser
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE);
-        mCodec.sampleRate = value;
-        ALOGV("offload_dev_set_parameters: sample rate %d", mCodec.sampleRate);
+    if (loffload_dev->in) {
+        ALOGE("offload_dev_open_input_stream: Already device open");
+        return -EINVAL;
     }
-    // Number of channels present (for AAC)
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL);
-        mCodec.numChannels = value;
-        ALOGV("offload_dev_set_parameters: num of channels %d", mCodec.numChannels);
+
+    in = (struct offload_stream_in *)calloc(1, sizeof(struct offload_stream_in));
+    if (!in)
+        return -ENOMEM;
+
+    in->stream.common.get_sample_rate = in_get_sample_rate;
+    in->stream.common.set_sample_rate = in_set_sample_rate;
+    in->stream.common.get_buffer_size = in_get_buffer_size;
+    in->stream.common.get_channels = in_get_channels;
+    in->stream.common.get_format = in_get_format;
+    in->stream.common.set_format = in_set_format;
+    in->stream.common.standby = in_standby;
+    in->stream.common.dump = in_dump;
+    in->stream.common.set_parameters = in_set_parameters;
+    in->stream.common.get_parameters = in_get_parameters;
+    in->stream.common.add_audio_effect = in_add_audio_effect;
+    in->stream.common.remove_audio_effect = in_remove_audio_effect;
+    in->stream.set_gain = in_set_gain;
+    in->stream.read = in_read;
+    in->stream.get_input_frames_lost = in_get_input_frames_lost;
+
+    pthread_mutex_init(&in->lock, NULL);
+    in->dev = loffload_dev;
+    in->endpoint = -1;
+    if (!config->sample_rate) {
+        config->sample_rate = config->format == AUDIO_FORMAT_AMR_NB ? 8000 :
+                              config->format == AUDIO_FORMAT_AMR_WB ? 16000 :
+                                                                      44100;
     }
-    // Codec ID tag - Represents AudioObjectType (AAC)
-    if ( str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_ID, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_ID);
-        mCodec.codecID = value;
+    if (!config->channel_mask)
+        config->channel_mask = AUDIO_CHANNEL_IN_MONO;
+    in->format = config->format;
+    in->sample_rate = config->sample_rate;
+    in->channels = config->channel_mask;
+    in->bit_rate = bit_rate;
+    in->buffer_size = capture_buffer_size(config->format, bit_rate);
+    in->device = devices;
+    in->standby = true;
+
+    loffload_dev->in = in;
+    *stream_in = &in->stream;
+    return 0;
+}
+
+static void offload_dev_close_input_stream(struct audio_hw_device *dev,
+                                           struct audio_stream_in *stream)
+{
+    struct offload_audio_device *loffload_dev =
+                                (struct offload_audio_device *)dev;
+    struct offload_stream_in *in = (struct offload_stream_in *)stream;
+
+    ALOGV("offload_dev_close_input_stream");
+    in_standby(&stream->common);
+    pthread_mutex_destroy(&in->lock);
+    loffload_dev->in = NULL;
+    free(in);
+}
+
+static void offload_dev_set_parameter(void *context, offload_kv_key_t key,
+                                      const char *value, size_t len)
+{
+    int ivalue;
+
+    if (offload_kv_to_int(value, len, &ivalue) < 0) {
+        ALOGW("offload_dev_set_parameters: invalid value for %s",
+                                           offload_kv_key_name(key));
+        return;
     }
-    if ( str_parms_get_int(
-            param, AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING, &value) >= 0) {
-        str_parms_del(param, AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING);
-        mCodec.downSampling = value;
+    switch (key) {
+        // Avg bitrate in bps - for WMA/AAC/MP3
+        case OFFLOAD_KV_AVG_BIT_RATE:
+            mCodec.avgBitRate = ivalue;
+            ALOGV("offload_dev_set_parameters: average bit rate %d",
+                                                     mCodec.avgBitRate);
+            break;
+        // Sample rate - for WMA/AAC direct from parser
+        case OFFLOAD_KV_SAMPLE_RATE:
+            mCodec.sampleRate = ivalue;
+            ALOGV("offload_dev_set_parameters: sample rate %d", mCodec.sampleRate);
+            break;
+        // Number of channels present (for AAC)
+        case OFFLOAD_KV_NUM_CHANNEL:
+            mCodec.numChannels = ivalue;
+            ALOGV("offload_dev_set_parameters: num of channels %d",
+                                                     mCodec.numChannels);
+            break;
+        // Codec ID tag - Represents AudioObjectType (AAC)
+        case OFFLOAD_KV_CODEC_ID:
+            mCodec.codecID = ivalue;
+            break;
+        case OFFLOAD_KV_DOWN_SAMPLING:
+            mCodec.downSampling = ivalue;
+            break;
+        default:
+            break;
     }
-    str_parms_destroy(param);
+}
+
+static int offload_dev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
+{
+    ALOGV("offload_dev_set_parameters kvpairs = %s", kvpairs);
+
+    offload_kv_parse(kvpairs, offload_dev_set_parameter, NULL);
     return 0;
 }
 
+/* Answers OFFLOAD_BUFFER_SIZE_KEY, see codec_offload_buffer.h */
 static char * offload_dev_get_parameters(const struct audio_hw_device *dev,
                                   const char *keys)
 {
-    return NULL;
+    struct offload_audio_device *loffload_dev =
+                                (struct offload_audio_device *)dev;
+    struct offload_buffer_config buffer_config;
+    struct str_parms *query;
+    struct str_parms *reply;
+    char value[64];
+    int format = 0, sample_rate = 0, channels = 0, bit_rate = 0;
+    char *str;
+
+    query = str_parms_create_str(keys);
+    if (!query)
+        return NULL;
+    if (str_parms_get_str(query, OFFLOAD_BUFFER_SIZE_KEY, value,
+                          sizeof(value)) < 0) {
+        str_parms_destroy(query);
+        return NULL;
+    }
+    str_parms_get_int(query, AUDIO_PARAMETER_STREAM_FORMAT, &format);
+    str_parms_get_int(query, AUDIO_PARAMETER_STREAM_SAMPLING_RATE,
+                      &sample_rate);
+    str_parms_get_int(query, AUDIO_PARAMETER_STREAM_CHANNELS, &channels);
+    str_parms_get_int(query, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE, &bit_rate);
+    str_parms_destroy(query);
+    if (!is_offload_device_available(loffload_dev, (audio_format_t)format,
+                                     channels, sample_rate))
+        return NULL;
+
+    offload_buffer_config_get((audio_format_t)format, bit_rate, sample_rate,
+                              channels, &buffer_config);
+    reply = str_parms_create();
+    if (!reply)
+        return NULL;
+    snprintf(value, sizeof(value), "%u,%u,%u", buffer_config.fragment_size,
+             buffer_config.fragments, buffer_config.wakeup_ms);
+    str_parms_add_str(reply, OFFLOAD_BUFFER_SIZE_KEY, value);
+    str = str_parms_to_str(reply);
+    str_parms_destroy(reply);
+    return str;
 }
 // TBD - Do we need to open the compress device do init check ???
 static int offload_dev_init_check(const struct audio_hw_device *dev)
@@ -1344,69 +4093,28 @@ static int offload_dev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
 }
 
 static size_t offload_dev_get_input_buffer_size(const struct audio_hw_device *dev,
-                                         uint32_t sample_rate, audio_format_t format,
-                                         int channel_count)
-{
-    return CODEC_OFFLOAD_INPUT_BUFFERSIZE;
-}
-
-static size_t offload_dev_get_offload_buffer_size(const struct audio_hw_device *dev,
-                                           uint32_t bitRate, uint32_t samplingRate,
-                                           uint32_t channel)
+                                         const struct audio_config *config)
 {
-    // Goal is to compute an optimal bufferSize that shall be used by
-    // Multimedia framework in transferring the encoded stream to LPE firmware
-    // in duration of OFFLOAD_TRANSFER_INTERVAL defined
-    struct offload_audio_device *loffload_dev = (struct offload_audio_device *)dev;
-
-    //set bit rate, sample rate and channel
-    mCodec.avgBitRate = bitRate;
-    mCodec.sampleRate = samplingRate;
-    mCodec.numChannels = channel;
-
-    size_t bufSize = 0;
-    if (bitRate >= 12000) {
-        bufSize = (OFFLOAD_TRANSFER_INTERVAL*bitRate)/8; /* in bytes */
-    }
-    else {
-        // Though we could not take the decision based on exact bit-rate,
-        // select optimal bufferSize based on samplingRate & Channel of the stream
-        if (samplingRate<=8000)
-            bufSize = 2*1024; // Voice data in Mono/Stereo
-        else if (channel == AUDIO_CHANNEL_OUT_MONO)
-            bufSize = 4*1024; // Mono music
-        else if (samplingRate<=32000)
-            bufSize = 16*1024; // Stereo low quality music
-        else if (samplingRate<=48000)
-            bufSize = 32*1024; // Stereo high quality music
-        else
-            bufSize = 64*1024; // HiFi stereo music
-    }
-
-    if (bufSize < OFFLOAD_MIN_ALLOWED_BUFSIZE)
-        bufSize = OFFLOAD_MIN_ALLOWED_BUFSIZE;
-    if (bufSize > OFFLOAD_MAX_ALLOWED_BUFSIZE)
-        bufSize = OFFLOAD_MAX_ALLOWED_BUFSIZE;
-
-    // Make the bufferSize to be of 2^n bytes
-    for (size_t i = 1; (bufSize & ~i) != 0; i<<=1)
-         bufSize &= ~i;
-
-    loffload_dev->buffer_size = bufSize;
-
-    ALOGV("getOffloadBufferSize: BR=%d SR=%d CC=%x bufSize=%d",
-                             bitRate, samplingRate, channel, bufSize);
-    return bufSize;
-
+    uint32_t bit_rate = capture_bit_rate(config->format,
+                                         config->offload_info.bit_rate);
+    return capture_buffer_size(config->format, bit_rate);
 }
 
 static int offload_dev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct offload_audio_device *offload_dev =
+                                (struct offload_audio_device *)device;
+    offload_endpoints_dump(&offload_dev->endpoints, fd);
     return 0;
 }
 
 static int offload_dev_close(hw_device_t *device)
 {
+    struct offload_audio_device *offload_dev =
+                                (struct offload_audio_device *)device;
+    offload_notifier_destroy(&offload_dev->notifier);
+    offload_endpoints_destroy(&offload_dev->endpoints);
+    pthread_mutex_destroy(&offload_dev->lock);
     free(device);
     return 0;
 }
@@ -1419,6 +4127,50 @@ static uint32_t offload_dev_get_supported_devices(const struct audio_hw_device *
             AUDIO_DEVICE_OUT_WIRED_HEADPHONE);
 }
 
+/* Picks the hardware backend once for the device: offload.backend forces one
+ * by name, otherwise audio.offload.scalability selects the per stream mixer
+ * controls and the presence of intel_sst_ctrl the legacy ioctls.
+ */
+static void offload_select_backend(struct offload_audio_device *dev)
+{
+    char value[PROPERTY_VALUE_MAX];
+    int i;
+
+    dev->backend = OFFLOAD_BACKEND_NUM;
+    if (property_get("offload.backend", value, NULL)) {
+        for (i = 0; i < OFFLOAD_BACKEND_NUM; i++) {
+            if (!strcmp(value, offload_backend_names[i]))
+                dev->backend = (offload_backend_t)i;
+        }
+        if (dev->backend == OFFLOAD_BACKEND_NUM)
+            ALOGW("offload_select_backend: unknown backend %s", value);
+    }
+    if (dev->backend == OFFLOAD_BACKEND_NUM) {
+        if (property_get("audio.offload.scalability", value, "0") &&
+                atoi(value) == 1)
+            dev->backend = OFFLOAD_BACKEND_SCALABILITY;
+        else if (access(SST_CTRL_DEVICE, F_OK) == 0)
+            dev->backend = OFFLOAD_BACKEND_SST;
+        else
+            dev->backend = OFFLOAD_BACKEND_MIXER;
+    }
+    property_get("offload.mixer.route.ctl.name", dev->mixRouteCtl,
+                 MIXER_ROUTE_CTL_NAME);
+    dev->aac_dsbr_min_rate = property_get("offload.aac.dsbr.min.rate", value,
+                                          NULL) ? atoi(value) :
+                                                  OFFLOAD_AAC_DSBR_MIN_RATE;
+    if (dev->backend == OFFLOAD_BACKEND_SCALABILITY) {
+        // Read the property to get the mixer control names
+        property_get("offload.mixer.volume.ctl.name", dev->mixVolumeCtl, "0");
+        property_get("offload.mixer.mute.ctl.name", dev->mixMuteCtl, "0");
+        property_get("offload.mixer.volume.ramp.ctl.name",
+                     dev->mixVolumeRampCtl, "0");
+        ALOGI("The mixer control name for volume = %s, mute = %s, Ramp = %s",
+              dev->mixVolumeCtl, dev->mixMuteCtl, dev->mixVolumeRampCtl);
+    }
+    ALOGI("offload_select_backend: %s", offload_backend_names[dev->backend]);
+}
+
 static int offload_dev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
@@ -1440,6 +4192,7 @@ static int offload_dev_open(const hw_module_t* module, const char* name,
     offload_dev->device.common.version = AUDIO_DEVICE_API_VERSION_2_0;
     offload_dev->device.common.module = (struct hw_module_t *) module;
     offload_dev->device.common.close = offload_dev_close;
+    offload_select_backend(offload_dev);
 
     offload_dev->device.get_supported_devices = offload_dev_get_supported_devices;
     offload_dev->device.init_check = offload_dev_init_check;
@@ -1448,11 +4201,19 @@ static int offload_dev_open(const hw_module_t* module, const char* name,
     offload_dev->device.set_mode = offload_dev_set_mode;
     offload_dev->device.set_parameters = offload_dev_set_parameters;
     offload_dev->device.get_parameters = offload_dev_get_parameters;
-    //offload_dev->device.get_input_buffer_size = offload_dev_get_input_buffer_size;
-    //offload_dev->device.get_offload_buffer_size = offload_dev_get_offload_buffer_size;
+    offload_dev->device.get_input_buffer_size = offload_dev_get_input_buffer_size;
     offload_dev->device.open_output_stream = offload_dev_open_output_stream;
     offload_dev->device.close_output_stream = offload_dev_close_output_stream;
+    offload_dev->device.open_input_stream = offload_dev_open_input_stream;
+    offload_dev->device.close_input_stream = offload_dev_close_input_stream;
     offload_dev->device.dump = offload_dev_dump;
+    offload_notifier_init(&offload_dev->notifier);
+    pthread_mutex_init(&offload_dev->lock, NULL);
+    offload_endpoints_init(&offload_dev->endpoints);
+    offload_endpoints_scan(&offload_dev->endpoints, FILE_PATH);
+    // A key added without regenerating the hash table would not be matched
+    if (offload_kv_check_table() < 0)
+        ALOGE("offload_dev_open: stale set_parameters key table");
 
     *device = &offload_dev->device.common;
     return 0;
@@ -1476,4 +4237,4 @@ struct audio_module HAL_MODULE_INFO_SYM = {
         dso : NULL,
         reserved : {0},
     },
-};}
+};
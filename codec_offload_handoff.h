@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_HANDOFF_H
+#define CODEC_OFFLOAD_HANDOFF_H
+
+#include <stdint.h>
+#include <hardware/audio.h>
+
+/* Handoff of an offloaded stream the DSP cannot play, to a client able to
+ * continue on another output.
+ *
+ * The client opts in with set_parameters("offload_handoff=1"). From then on,
+ * when the compress device cannot be opened or a hung DSP cannot be
+ * recovered, out_write does not fail: the stream callback receives
+ * OFFLOAD_CBK_EVENT_UNAVAILABLE with a struct offload_handoff telling where
+ * the DSP stopped, and out_write takes nothing until the device is back.
+ *
+ * At the next track boundary, i.e. new gapless metadata through
+ * set_parameters or a flush, the HAL retries the device on its callback
+ * thread and sends OFFLOAD_CBK_EVENT_AVAILABLE when it succeeds; out_write
+ * then takes the next track.
+ *
+ * get_parameters("offload_handoff") returns the last event as
+ * "offload_handoff=<available>,<reason>,<written>,<consumed>,<position_ms>".
+ */
+#define OFFLOAD_HANDOFF_KEY             "offload_handoff"
+
+/* Events beyond the stream_callback_event_t ones; param is a
+ * struct offload_handoff, valid during the callback only.
+ */
+#define OFFLOAD_CBK_EVENT_UNAVAILABLE   ((stream_callback_event_t)0x100)
+#define OFFLOAD_CBK_EVENT_AVAILABLE     ((stream_callback_event_t)0x101)
+
+typedef enum {
+    OFFLOAD_HANDOFF_NONE,
+    OFFLOAD_HANDOFF_OPEN_FAILED,    /* compress_open refused, DSP busy */
+    OFFLOAD_HANDOFF_DSP_LOST,       /* hung DSP not recovered */
+} offload_handoff_reason_t;
+
+struct offload_handoff {
+    uint32_t reason;                /* offload_handoff_reason_t */
+    uint64_t written;               /* bytes out_write took since the open or
+                                       the last flush */
+    uint64_t consumed;              /* of them, taken by the DSP */
+    uint32_t position_ms;           /* render position */
+};
+
+#endif /* CODEC_OFFLOAD_HANDOFF_H */
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_kvparser"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <cutils/log.h>
+#include <system/audio.h>
+#include <hardware/audio.h>
+
+#include "codec_offload_handoff.h"
+#include "codec_offload_kvparser.h"
+#include "codec_offload_next_format.h"
+#include "codec_offload_ppp.h"
+#include "codec_offload_volume.h"
+
+#define KV_HASH_EMPTY   0xff
+
+#define KV_KEY(name)    { name, sizeof(name) - 1 }
+
+static const struct kv_key {
+    const char *name;
+    size_t len;
+} kv_keys[] = {
+    KV_KEY(AUDIO_OFFLOAD_CODEC_BIT_PER_SAMPLE),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_NUM_CHANNEL),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_ID),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_BLOCK_ALIGN),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_SAMPLE_RATE),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_ENCODE_OPTION),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES),
+    KV_KEY(AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING),
+    KV_KEY(OFFLOAD_PPP_PARAMS_KEY),
+    KV_KEY(AUDIO_PARAMETER_STREAM_ROUTING),
+    KV_KEY(OFFLOAD_VOLUME_RAMP_KEY),
+    KV_KEY(OFFLOAD_HANDOFF_KEY),
+    KV_KEY(OFFLOAD_NEXT_FORMAT_KEY),
+};
+
+/* One string per offload_kv_key_t, in the same order */
+typedef char kv_keys_match_enum[sizeof(kv_keys) / sizeof(kv_keys[0]) ==
+                                OFFLOAD_KV_NUM_KEYS ? 1 : -1];
+
+/* Generated by offload_kvparse_bench -g from kv_keys: with KV_HASH_SEED
+ * every key hashes to its own slot, which holds its index. Regenerate when
+ * a key is added or renamed; offload_kv_check_table() catches a stale one.
+ */
+#define KV_HASH_SEED    14
+static const uint8_t kv_slots[OFFLOAD_KV_HASH_SLOTS] = {
+    0xff, 0xff, 0xff, 0xff,    9, 0xff, 0xff, 0xff,
+    0xff,    1, 0xff, 0xff, 0xff, 0xff, 0xff,   11,
+    0xff, 0xff,   10, 0xff,    8, 0xff,   14, 0xff,
+       3, 0xff, 0xff,   13,    2, 0xff,    7, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+       4, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,    0, 0xff,   12, 0xff, 0xff,    6, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,    5,
+};
+
+static inline int kv_lookup(const char *key, size_t len)
+{
+    uint8_t index = kv_slots[offload_kv_hash(KV_HASH_SEED, key, len)];
+    if (index == KV_HASH_EMPTY || kv_keys[index].len != len ||
+            memcmp(kv_keys[index].name, key, len))
+        return -1;
+    return index;
+}
+
+int offload_kv_parse(const char *kvpairs, offload_kv_handler_t handler,
+                     void *context)
+{
+    const char *p = kvpairs;
+    int found = 0;
+
+    if (!kvpairs)
+        return 0;
+
+    while (*p) {
+        const char *key = p;
+        const char *eq = NULL;
+        while (*p && *p != ';') {
+            if (*p == '=' && !eq)
+                eq = p;
+            p++;
+        }
+        if (eq) {
+            int index = kv_lookup(key, eq - key);
+            if (index >= 0) {
+                handler(context, (offload_kv_key_t)index, eq + 1,
+                        p - (eq + 1));
+                found++;
+            }
+        }
+        if (*p == ';')
+            p++;
+    }
+    return found;
+}
+
+int offload_kv_to_int(const char *value, size_t len, int *out)
+{
+    const char *p = value;
+    const char *end = value + len;
+    bool negative = false;
+    unsigned int base = 10;
+    long long result = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (end - p > 1 && p[0] == '0') {
+        base = 8;
+        p++;
+    }
+    if (p == end)
+        return -EINVAL;
+    for (; p < end; p++) {
+        unsigned int digit;
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else
+            return -EINVAL;
+        if (digit >= base)
+            return -EINVAL;
+        result = result * base + digit;
+        if (result > (long long)UINT_MAX)
+            return -EINVAL;
+    }
+    *out = (int)(negative ? -result : result);
+    return 0;
+}
+
+const char *offload_kv_key_name(offload_kv_key_t key)
+{
+    if (key < 0 || key >= OFFLOAD_KV_NUM_KEYS)
+        return "unknown";
+    return kv_keys[key].name;
+}
+
+int offload_kv_check_table(void)
+{
+    int i, slot;
+    int used = 0;
+
+    for (i = 0; i < OFFLOAD_KV_NUM_KEYS; i++) {
+        slot = offload_kv_hash(KV_HASH_SEED, kv_keys[i].name, kv_keys[i].len);
+        if (kv_slots[slot] != i) {
+            ALOGE("offload_kv_check_table: %s not in slot %d", kv_keys[i].name,
+                  slot);
+            return -EINVAL;
+        }
+    }
+    for (slot = 0; slot < OFFLOAD_KV_HASH_SLOTS; slot++)
+        used += kv_slots[slot] != KV_HASH_EMPTY;
+    return used == OFFLOAD_KV_NUM_KEYS ? 0 : -EINVAL;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_KVPARSER_H
+#define CODEC_OFFLOAD_KVPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Keys understood by the offload HAL set_parameters entry points. The key
+ * strings live in codec_offload_kvparser.cpp, in the same order.
+ */
+typedef enum {
+    OFFLOAD_KV_BIT_PER_SAMPLE,
+    OFFLOAD_KV_AVG_BIT_RATE,
+    OFFLOAD_KV_NUM_CHANNEL,
+    OFFLOAD_KV_CODEC_ID,
+    OFFLOAD_KV_BLOCK_ALIGN,
+    OFFLOAD_KV_SAMPLE_RATE,
+    OFFLOAD_KV_ENCODE_OPTION,
+    OFFLOAD_KV_DELAY_SAMPLES,
+    OFFLOAD_KV_PADDING_SAMPLES,
+    OFFLOAD_KV_DOWN_SAMPLING,
+    OFFLOAD_KV_PPP_PARAMS,
+    OFFLOAD_KV_ROUTING,
+    OFFLOAD_KV_VOLUME_RAMP,
+    OFFLOAD_KV_HANDOFF,
+    OFFLOAD_KV_NEXT_FORMAT,
+    OFFLOAD_KV_NUM_KEYS
+} offload_kv_key_t;
+
+#define OFFLOAD_KV_HASH_SLOTS   64      /* power of two, > 2 * keys */
+
+/* FNV-1a of a key, seeded, folded to a slot. The seed and the slot table
+ * are precomputed, see offload_kv_check_table().
+ */
+static inline uint32_t offload_kv_hash(uint32_t seed, const char *key,
+                                       size_t len)
+{
+    uint32_t h = 2166136261u ^ seed;
+    while (len--) {
+        h ^= (uint8_t)*key++;
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (OFFLOAD_KV_HASH_SLOTS - 1);
+}
+
+/* Called once per recognized key=value pair, in string order. 'value' is not
+ * NUL terminated.
+ */
+typedef void (*offload_kv_handler_t)(void *context, offload_kv_key_t key,
+                                     const char *value, size_t len);
+
+/* Single pass over "k1=v1;k2=v2", without any allocation. Keys are matched
+ * through a perfect hash of the key table; unknown keys are skipped.
+ * Returns the number of recognized pairs.
+ */
+int offload_kv_parse(const char *kvpairs, offload_kv_handler_t handler,
+                     void *context);
+
+/* Parses an integer value the way str_parms_get_int does (strtol base 0,
+ * whole value consumed). Returns 0 on success, -EINVAL otherwise.
+ */
+int offload_kv_to_int(const char *value, size_t len, int *out);
+
+const char *offload_kv_key_name(offload_kv_key_t key);
+
+/* Checks the precomputed hash table against the key strings: every key
+ * must sit alone in its slot. Returns 0, or -EINVAL when the table is stale
+ * and must be regenerated with offload_kvparse_bench -g.
+ */
+int offload_kv_check_table(void);
+
+#endif /* CODEC_OFFLOAD_KVPARSER_H */
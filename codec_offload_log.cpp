@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_log"
+//#define LOG_NDEBUG 0
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include "codec_offload_log.h"
+
+struct offload_log_entry {
+    volatile int32_t seq;       /* index + 1 once complete, 0 while written */
+    uint32_t arg0;
+    uint32_t arg1;
+    const char *fmt;
+    uint64_t ns;
+};
+
+static struct offload_log_entry offload_log_ring[OFFLOAD_LOG_RING_SIZE];
+static volatile int32_t offload_log_head;
+static volatile int32_t offload_log_suppressed;
+
+static uint64_t offload_log_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool offload_log_allow(struct offload_log_site *site, uint32_t *suppressed)
+{
+    uint64_t now = offload_log_now_ns();
+
+    if (now < site->next_ns) {
+        site->suppressed++;
+        android_atomic_inc(&offload_log_suppressed);
+        return false;
+    }
+    site->next_ns = now + OFFLOAD_LOG_INTERVAL_MS * 1000000ull;
+    *suppressed = site->suppressed;
+    site->suppressed = 0;
+    return true;
+}
+
+/* Writers claim a slot with one atomic increment; the sequence number lets
+ * the dump skip a slot being written or already reused.
+ */
+void offload_log_event(const char *fmt, uint32_t arg0, uint32_t arg1)
+{
+    int32_t index = android_atomic_inc(&offload_log_head);
+    struct offload_log_entry *entry =
+            &offload_log_ring[index & (OFFLOAD_LOG_RING_SIZE - 1)];
+
+    android_atomic_release_store(0, &entry->seq);
+    __sync_synchronize();
+    entry->ns = offload_log_now_ns();
+    entry->fmt = fmt;
+    entry->arg0 = arg0;
+    entry->arg1 = arg1;
+    android_atomic_release_store(index + 1, &entry->seq);
+}
+
+static void offload_log_printf(int fd, const char *fmt, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+    write(fd, line, len);
+}
+
+void offload_log_dump(int fd)
+{
+    int32_t head = android_atomic_acquire_load(&offload_log_head);
+    int32_t first = head > OFFLOAD_LOG_RING_SIZE ?
+                            head - OFFLOAD_LOG_RING_SIZE : 0;
+    int32_t index;
+
+    offload_log_printf(fd, "event log: %d events, %d log messages rate "
+                       "limited\n", head,
+                       android_atomic_acquire_load(&offload_log_suppressed));
+    for (index = first; index < head; index++) {
+        struct offload_log_entry *entry =
+                &offload_log_ring[index & (OFFLOAD_LOG_RING_SIZE - 1)];
+        struct offload_log_entry copy;
+        char text[160];
+
+        if (android_atomic_acquire_load(&entry->seq) != index + 1)
+            continue;
+        copy.ns = entry->ns;
+        copy.fmt = entry->fmt;
+        copy.arg0 = entry->arg0;
+        copy.arg1 = entry->arg1;
+        __sync_synchronize();
+        if (android_atomic_acquire_load(&entry->seq) != index + 1)
+            continue;
+        snprintf(text, sizeof(text), copy.fmt, copy.arg0, copy.arg1);
+        offload_log_printf(fd, "  %6llu.%03u ms  %s\n",
+                           (unsigned long long)(copy.ns / 1000000),
+                           (unsigned int)(copy.ns / 1000 % 1000), text);
+    }
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_LOG_H
+#define CODEC_OFFLOAD_LOG_H
+
+#include <stdint.h>
+#include <cutils/log.h>
+
+/* Logging of the stream hot paths: out_write, the control calls, the
+ * offload thread and the render position polls.
+ *
+ * OFFLOAD_LOGV/D/I/W/E go to logcat. Calls below OFFLOAD_LOG_LEVEL are
+ * removed at compile time, arguments included, and each call site prints
+ * at most once every OFFLOAD_LOG_INTERVAL_MS, telling how many messages it
+ * dropped meanwhile. The level follows LOG_NDEBUG unless set explicitly:
+ * verbose when the file defines LOG_NDEBUG 0 before the includes, info
+ * otherwise.
+ *
+ * OFFLOAD_EVENT records a format string and two integer arguments into a
+ * process wide binary ring, without formatting or a logcat write; the ring
+ * is formatted by offload_log_dump(), from out_dump. The format takes the
+ * two arguments as unsigned int, e.g. "out_pause: state %u, %u ms", and
+ * must be a literal: the ring keeps the pointer only.
+ */
+#define OFFLOAD_LOG_VERBOSE     2
+#define OFFLOAD_LOG_DEBUG       3
+#define OFFLOAD_LOG_INFO        4
+#define OFFLOAD_LOG_WARN        5
+#define OFFLOAD_LOG_ERROR       6
+#define OFFLOAD_LOG_SILENT      7
+
+#ifndef OFFLOAD_LOG_LEVEL
+#if LOG_NDEBUG
+#define OFFLOAD_LOG_LEVEL       OFFLOAD_LOG_INFO
+#else
+#define OFFLOAD_LOG_LEVEL       OFFLOAD_LOG_VERBOSE
+#endif
+#endif
+
+#ifndef OFFLOAD_LOG_EVENTS
+#define OFFLOAD_LOG_EVENTS      1
+#endif
+
+#define OFFLOAD_LOG_INTERVAL_MS 1000
+#define OFFLOAD_LOG_RING_SIZE   256     /* events, a power of two */
+
+/* Rate limit state of one call site */
+struct offload_log_site {
+    uint64_t next_ns;
+    uint32_t suppressed;
+};
+
+/* Returns true when the site may print now, with the number of messages
+ * it dropped since the last one in *suppressed. The site state is updated
+ * without a lock; racing threads may both print or miscount a drop.
+ */
+bool offload_log_allow(struct offload_log_site *site, uint32_t *suppressed);
+
+void offload_log_event(const char *fmt, uint32_t arg0, uint32_t arg1);
+
+/* Writes the ring, oldest event first, and the rate limit totals */
+void offload_log_dump(int fd);
+
+#define OFFLOAD_LOG_SITE_(level, emit, ...)                                 \
+    do {                                                                    \
+        if ((level) >= OFFLOAD_LOG_LEVEL) {                                 \
+            static struct offload_log_site _log_site = { 0, 0 };            \
+            uint32_t _log_suppressed;                                       \
+            if (offload_log_allow(&_log_site, &_log_suppressed)) {          \
+                if (_log_suppressed)                                        \
+                    emit("(%u similar messages suppressed)",                \
+                         _log_suppressed);                                  \
+                emit(__VA_ARGS__);                                          \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+#define OFFLOAD_LOGV(...) OFFLOAD_LOG_SITE_(OFFLOAD_LOG_VERBOSE, ALOGV, __VA_ARGS__)
+#define OFFLOAD_LOGD(...) OFFLOAD_LOG_SITE_(OFFLOAD_LOG_DEBUG, ALOGD, __VA_ARGS__)
+#define OFFLOAD_LOGI(...) OFFLOAD_LOG_SITE_(OFFLOAD_LOG_INFO, ALOGI, __VA_ARGS__)
+#define OFFLOAD_LOGW(...) OFFLOAD_LOG_SITE_(OFFLOAD_LOG_WARN, ALOGW, __VA_ARGS__)
+#define OFFLOAD_LOGE(...) OFFLOAD_LOG_SITE_(OFFLOAD_LOG_ERROR, ALOGE, __VA_ARGS__)
+
+#if OFFLOAD_LOG_EVENTS
+#define OFFLOAD_EVENT(fmt, arg0, arg1) \
+    offload_log_event(fmt, (uint32_t)(arg0), (uint32_t)(arg1))
+#else
+#define OFFLOAD_EVENT(fmt, arg0, arg1) do { } while (0)
+#endif
+
+#endif /* CODEC_OFFLOAD_LOG_H */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_next_format"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec_offload_next_format.h"
+
+int offload_next_format_parse(const char *value, size_t len,
+                              struct offload_next_format *next)
+{
+    unsigned long fields[6] = { 0, 0, 0, 0, 0, 0 };
+    char buffer[64];
+    char *p = buffer;
+    char *end;
+    unsigned int i;
+
+    if (len == 0 || len >= sizeof(buffer))
+        return -EINVAL;
+    memcpy(buffer, value, len);
+    buffer[len] = '\0';
+    for (i = 0; i < 6; i++) {
+        fields[i] = strtoul(p, &end, 0);
+        if (end == p || (*end && *end != ','))
+            return -EINVAL;
+        p = end;
+        if (!*p)
+            break;
+        p++;
+    }
+    // The bit rate and the AAC fields are optional, the rest is not
+    if (i < 2 || *p || !fields[1] || !fields[2])
+        return -EINVAL;
+    next->format = (audio_format_t)fields[0];
+    next->sample_rate = (uint32_t)fields[1];
+    next->channels = (uint32_t)fields[2];
+    next->bit_rate = (uint32_t)fields[3];
+    next->aac_object_type = (int32_t)fields[4];
+    next->aac_down_sampling = (int32_t)fields[5];
+    return 0;
+}
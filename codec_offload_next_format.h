@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_NEXT_FORMAT_H
+#define CODEC_OFFLOAD_NEXT_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <system/audio.h>
+
+/* Codec change at a gapless track boundary.
+ *
+ * A client whose next track has another format, sample rate or channel
+ * mask announces it before drain(AUDIO_DRAIN_EARLY_NOTIFY) ends the current
+ * one, with set_parameters("offload_next_format=<audio_format_t>,
+ * <sample rate>,<channel mask>,<bit rate>,<AAC object type>,
+ * <downsampling>"), e.g. "offload_next_format=0x4000000,48000,3,128000,5,1"
+ * for HE-AAC after MP3, decoded with downsampled SBR where allowed. The
+ * object type and downsampling flag are those of music_offload_codec_id
+ * and music_offload_down_sampling; only AAC uses them.
+ *
+ * Where the kernel takes SNDRV_COMPRESS_SET_PARAMS after next_track
+ * (Linux 5.7) and tinycompress has compress_set_codec_params(), the codec
+ * is changed in place and the next track follows gaplessly in the same
+ * compress stream. Otherwise the HAL plays the current track out and
+ * reopens the device in the new format before DRAIN_READY: the stream
+ * stays offloaded but the boundary is not gapless.
+ *
+ * A flush or a full drain drops the announced format.
+ */
+#define OFFLOAD_NEXT_FORMAT_KEY     "offload_next_format"
+
+struct offload_next_format {
+    audio_format_t format;
+    uint32_t sample_rate;
+    uint32_t channels;          /* audio_channel_mask_t */
+    uint32_t bit_rate;          /* 0 for the default */
+    int32_t aac_object_type;    /* OFFLOAD_AAC_AOT_*, 0 if not given */
+    int32_t aac_down_sampling;  /* non-zero allows downsampled SBR */
+};
+
+/* Parses "<format>,<sample rate>,<channel mask>[,<bit rate>[,<AAC object
+ * type>[,<downsampling>]]]", numbers in C notation. Returns 0 or -EINVAL.
+ */
+int offload_next_format_parse(const char *value, size_t len,
+                              struct offload_next_format *next);
+
+#endif /* CODEC_OFFLOAD_NEXT_FORMAT_H */
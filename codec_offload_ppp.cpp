@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_ppp"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <string.h>
+#include <cutils/log.h>
+
+#include "codec_offload_kvparser.h"
+#include "codec_offload_ppp.h"
+
+#define PPP_NUM_FIELDS  5
+
+static int ppp_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int ppp_parse_u8(const char *value, size_t len, uint8_t *out)
+{
+    int ivalue;
+    if (offload_kv_to_int(value, len, &ivalue) < 0 || ivalue < 0 ||
+            ivalue > 0xff)
+        return -EINVAL;
+    *out = (uint8_t)ivalue;
+    return 0;
+}
+
+/* One "<algo>:<str>:<enable>:<type>:<hex>" entry */
+static int ppp_parse_entry(const char *entry, size_t len,
+                           struct offload_ppp_algo *algo,
+                           struct offload_ppp_param *param)
+{
+    const char *fields[PPP_NUM_FIELDS];
+    size_t lengths[PPP_NUM_FIELDS];
+    const char *end = entry + len;
+    const char *p = entry;
+    int i, type;
+
+    for (i = 0; i < PPP_NUM_FIELDS; i++) {
+        const char *sep = i < PPP_NUM_FIELDS - 1 ?
+                              (const char *)memchr(p, ':', end - p) : end;
+        if (!sep)
+            return -EINVAL;
+        fields[i] = p;
+        lengths[i] = sep - p;
+        p = sep + 1;
+    }
+    if (ppp_parse_u8(fields[0], lengths[0], &algo->algo_id) < 0 ||
+            ppp_parse_u8(fields[1], lengths[1], &algo->str_id) < 0 ||
+            ppp_parse_u8(fields[2], lengths[2], &algo->enable) < 0 ||
+            offload_kv_to_int(fields[3], lengths[3], &type) < 0)
+        return -EINVAL;
+    if (lengths[4] % 2 || lengths[4] / 2 > OFFLOAD_PPP_MAX_DATA)
+        return -EINVAL;
+
+    param->type = (uint32_t)type;
+    param->size = lengths[4] / 2;
+    for (i = 0; i < (int)param->size; i++) {
+        int hi = ppp_hex_digit(fields[4][2 * i]);
+        int lo = ppp_hex_digit(fields[4][2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -EINVAL;
+        param->data[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+static struct offload_ppp_algo *ppp_find_algo(struct offload_ppp_preset *preset,
+                                              uint8_t algo_id, uint8_t str_id)
+{
+    int i;
+    for (i = 0; i < preset->num_algos; i++) {
+        struct offload_ppp_algo *algo = &preset->algos[i];
+        if (algo->algo_id == algo_id && algo->str_id == str_id)
+            return algo;
+    }
+    if (preset->num_algos == OFFLOAD_PPP_MAX_ALGOS)
+        return NULL;
+    struct offload_ppp_algo *algo = &preset->algos[preset->num_algos++];
+    memset(algo, 0, sizeof(*algo));
+    algo->algo_id = algo_id;
+    algo->str_id = str_id;
+    return algo;
+}
+
+int offload_ppp_merge(struct offload_ppp_preset *preset, const char *value,
+                      size_t len)
+{
+    // Merge into a copy so that a bad entry late in the batch leaves the
+    // current preset as it was.
+    struct offload_ppp_preset merged = *preset;
+    const char *end = value + len;
+    const char *p = value;
+    int entries = 0;
+
+    while (p < end) {
+        const char *sep = (const char *)memchr(p, ',', end - p);
+        size_t entry_len = (sep ? sep : end) - p;
+        struct offload_ppp_algo parsed;
+        struct offload_ppp_param param;
+        int i;
+
+        if (ppp_parse_entry(p, entry_len, &parsed, &param) < 0) {
+            ALOGW("offload_ppp_merge: invalid entry \"%.*s\"", (int)entry_len, p);
+            return -EINVAL;
+        }
+        struct offload_ppp_algo *algo = ppp_find_algo(&merged, parsed.algo_id,
+                                                      parsed.str_id);
+        if (!algo)
+            return -ENOSPC;
+        for (i = 0; i < algo->num_params; i++) {
+            if (algo->params[i].type == param.type)
+                break;
+        }
+        if (i == OFFLOAD_PPP_MAX_PARAMS)
+            return -ENOSPC;
+        algo->params[i] = param;
+        if (i == algo->num_params)
+            algo->num_params++;
+        algo->enable = parsed.enable;
+        algo->dirty = true;
+        entries++;
+        p += entry_len + 1;
+    }
+    if (!entries)
+        return -EINVAL;
+    *preset = merged;
+    return entries;
+}
+
+size_t offload_ppp_serialize(const struct offload_ppp_algo *algo,
+                             uint8_t *blob, size_t size)
+{
+    size_t used = 0;
+    int i;
+
+    for (i = 0; i < algo->num_params; i++) {
+        const struct offload_ppp_param *param = &algo->params[i];
+        if (used + 2 * sizeof(uint32_t) + param->size > size)
+            break;
+        memcpy(blob + used, &param->type, sizeof(uint32_t));
+        memcpy(blob + used + sizeof(uint32_t), &param->size, sizeof(uint32_t));
+        memcpy(blob + used + 2 * sizeof(uint32_t), param->data, param->size);
+        used += 2 * sizeof(uint32_t) + param->size;
+    }
+    return used;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_PPP_H
+#define CODEC_OFFLOAD_PPP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* DSP post-processing (ppp) parameters of an offloaded stream.
+ *
+ * A batch comes in through the offload_ppp_params set_parameters key as a
+ * comma separated list of entries
+ *
+ *     <algo_id>:<str_id>:<enable>:<type>:<hex data>
+ *
+ * e.g. "offload_ppp_params=0x6a:3:1:0x601:0a000000,0x6a:3:1:0x602:ff". Every
+ * entry is one parameter of an SNDRV_SST_SET_ALGO algorithm; a batch is
+ * accepted or rejected as a whole. Parameters of the same algorithm are
+ * coalesced into one blob of packed {u32 type, u32 size, data} records, the
+ * layout of offload_vol_algo_param, so a preset costs one ioctl per
+ * algorithm.
+ */
+#define OFFLOAD_PPP_PARAMS_KEY      "offload_ppp_params"
+
+#define OFFLOAD_PPP_MAX_ALGOS       8
+#define OFFLOAD_PPP_MAX_PARAMS      8       /* per algorithm */
+#define OFFLOAD_PPP_MAX_DATA        64      /* bytes per parameter */
+#define OFFLOAD_PPP_MAX_BLOB        (OFFLOAD_PPP_MAX_PARAMS * \
+                                     (8 + OFFLOAD_PPP_MAX_DATA))
+
+struct offload_ppp_param {
+    uint32_t type;
+    uint32_t size;
+    uint8_t data[OFFLOAD_PPP_MAX_DATA];
+};
+
+struct offload_ppp_algo {
+    uint8_t algo_id;
+    uint8_t str_id;
+    uint8_t enable;
+    bool dirty;                 /* changed since the last submit */
+    int num_params;
+    struct offload_ppp_param params[OFFLOAD_PPP_MAX_PARAMS];
+};
+
+struct offload_ppp_preset {
+    int num_algos;
+    struct offload_ppp_algo algos[OFFLOAD_PPP_MAX_ALGOS];
+};
+
+/* Validates a whole batch (the value of the key, not NUL terminated) and
+ * merges it into 'preset': a parameter replaces an earlier one of the same
+ * algorithm, stream and type, and the algorithms it touches are marked
+ * dirty. 'preset' is left untouched when the batch is invalid or does not
+ * fit. Returns the number of entries, -EINVAL or -ENOSPC.
+ */
+int offload_ppp_merge(struct offload_ppp_preset *preset, const char *value,
+                      size_t len);
+
+/* Packs the parameters of one algorithm into 'blob', returns its size */
+size_t offload_ppp_serialize(const struct offload_ppp_algo *algo,
+                             uint8_t *blob, size_t size);
+
+#endif /* CODEC_OFFLOAD_PPP_H */
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_shm"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include "codec_offload_shm.h"
+
+int offload_shm_create(struct offload_shm *shm, size_t size)
+{
+    size_t ring = 1;
+    void *base;
+    int fd;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+    while (ring < size)
+        ring <<= 1;
+    fd = ashmem_create_region("offload_shm", sizeof(struct offload_shm_header) +
+                                             ring);
+    if (fd < 0) {
+        ALOGE("offload_shm_create: cannot allocate %zu bytes", ring);
+        return -ENOMEM;
+    }
+    base = mmap(NULL, sizeof(struct offload_shm_header) + ring,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        ALOGE("offload_shm_create: mmap failed: %s", strerror(errno));
+        close(fd);
+        return -errno;
+    }
+    shm->fd = fd;
+    shm->map_size = sizeof(struct offload_shm_header) + ring;
+    shm->header = (struct offload_shm_header *)base;
+    shm->data = (uint8_t *)(shm->header + 1);
+    memset(shm->header, 0, sizeof(*shm->header));
+    shm->header->size = ring;
+    android_atomic_release_store(OFFLOAD_SHM_MAGIC,
+                                 (volatile int32_t *)&shm->header->magic);
+    ALOGV("offload_shm_create: fd %d ring %zu bytes", fd, ring);
+    return 0;
+}
+
+int offload_shm_map(struct offload_shm *shm, int fd)
+{
+    struct offload_shm_header header;
+    void *base;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            header.magic != OFFLOAD_SHM_MAGIC || !header.size ||
+            (header.size & (header.size - 1)))
+        return -EINVAL;
+    base = mmap(NULL, sizeof(header) + header.size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return -errno;
+    shm->map_size = sizeof(header) + header.size;
+    shm->header = (struct offload_shm_header *)base;
+    shm->data = (uint8_t *)(shm->header + 1);
+    return 0;
+}
+
+void offload_shm_release(struct offload_shm *shm)
+{
+    if (shm->header)
+        munmap(shm->header, shm->map_size);
+    if (shm->fd >= 0)
+        close(shm->fd);
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+}
+
+uint32_t offload_shm_write_space(const struct offload_shm *shm, uint8_t **ptr)
+{
+    uint32_t size = shm->header->size;
+    uint32_t wr = (uint32_t)shm->header->write_pos;
+    uint32_t rd = (uint32_t)android_atomic_acquire_load(&shm->header->read_pos);
+    uint32_t offset = wr & (size - 1);
+    uint32_t space = size - (wr - rd);
+
+    *ptr = shm->data + offset;
+    return space < size - offset ? space : size - offset;
+}
+
+void offload_shm_write_commit(struct offload_shm *shm, uint32_t bytes)
+{
+    android_atomic_release_store(shm->header->write_pos + bytes,
+                                 &shm->header->write_pos);
+}
+
+uint32_t offload_shm_pending(const struct offload_shm *shm)
+{
+    return (uint32_t)android_atomic_acquire_load(&shm->header->write_pos) -
+           (uint32_t)android_atomic_acquire_load(&shm->header->read_pos);
+}
+
+uint32_t offload_shm_read_avail(const struct offload_shm *shm,
+                                const uint8_t **ptr)
+{
+    uint32_t size = shm->header->size;
+    uint32_t rd = (uint32_t)shm->header->read_pos;
+    uint32_t wr = (uint32_t)android_atomic_acquire_load(&shm->header->write_pos);
+    uint32_t offset = rd & (size - 1);
+    uint32_t avail = wr - rd;
+
+    *ptr = shm->data + offset;
+    return avail < size - offset ? avail : size - offset;
+}
+
+void offload_shm_read_commit(struct offload_shm *shm, uint32_t bytes)
+{
+    android_atomic_release_store(shm->header->read_pos + bytes,
+                                 &shm->header->read_pos);
+}
+
+void offload_shm_discard(struct offload_shm *shm)
+{
+    android_atomic_release_store(
+            android_atomic_acquire_load(&shm->header->write_pos),
+            &shm->header->read_pos);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_SHM_H
+#define CODEC_OFFLOAD_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shared memory ring between the writer of an offloaded stream and the HAL.
+ *
+ * Asking the stream for the offload_shm key with get_parameters creates the
+ * ring and returns "offload_shm=<fd>:<size>", an ashmem descriptor valid in
+ * the calling process. The client maps it with offload_shm_map, fills the
+ * ring in place and commits; out_write(stream, NULL, pending) then hands
+ * the committed bytes to the driver in fragment sized pieces, straight from
+ * the ring. The return value and WRITE_READY follow the usual non-blocking
+ * write rules; whatever was not taken stays in the ring. A write with a
+ * buffer keeps working in this mode.
+ *
+ * Single producer (the client) and single consumer (the HAL). The
+ * positions are free running byte counts, so the size is a power of two.
+ */
+#define OFFLOAD_SHM_KEY             "offload_shm"
+#define OFFLOAD_SHM_MAGIC           0x4f53484d      /* "OSHM" */
+
+struct offload_shm_header {
+    uint32_t magic;
+    uint32_t size;                  /* ring bytes after the header */
+    volatile int32_t write_pos;     /* advanced by the client */
+    volatile int32_t read_pos;      /* advanced by the HAL */
+    uint32_t reserved[4];
+};
+
+struct offload_shm {
+    int fd;                         /* owned by the creator, -1 for a map */
+    size_t map_size;
+    struct offload_shm_header *header;
+    uint8_t *data;
+};
+
+/* HAL side: allocates a ring of at least 'size' bytes. Returns 0 or -errno */
+int offload_shm_create(struct offload_shm *shm, size_t size);
+/* Client side: maps a ring created by the HAL, the fd stays the HAL's */
+int offload_shm_map(struct offload_shm *shm, int fd);
+void offload_shm_release(struct offload_shm *shm);
+
+/* Contiguous room at the write position, for the client to fill */
+uint32_t offload_shm_write_space(const struct offload_shm *shm, uint8_t **ptr);
+void offload_shm_write_commit(struct offload_shm *shm, uint32_t bytes);
+/* Committed bytes not yet taken by the HAL */
+uint32_t offload_shm_pending(const struct offload_shm *shm);
+
+/* Contiguous committed bytes at the read position, for the HAL to take */
+uint32_t offload_shm_read_avail(const struct offload_shm *shm,
+                                const uint8_t **ptr);
+void offload_shm_read_commit(struct offload_shm *shm, uint32_t bytes);
+/* Drops everything committed, on flush */
+void offload_shm_discard(struct offload_shm *shm);
+
+#endif /* CODEC_OFFLOAD_SHM_H */
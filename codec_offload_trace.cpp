@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_trace"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "codec_offload_trace.h"
+
+uint64_t offload_trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Appends a whole record, so that a dropped one leaves the file readable.
+ * A full active buffer is swapped with the other one if that one is empty.
+ */
+static bool offload_trace_append_l(struct offload_trace *trace,
+                                   const struct offload_trace_record *record,
+                                   const void *data, uint32_t len)
+{
+    uint32_t size = (record ? sizeof(*record) : 0) + len;
+    int active = trace->active;
+
+    if (trace->used[active] + size > OFFLOAD_TRACE_BUFSIZE) {
+        if (trace->used[active ^ 1]) {
+            trace->dropped++;
+            return false;
+        }
+        active ^= 1;
+        trace->active = active;
+    }
+    uint8_t *dst = trace->buf[active] + trace->used[active];
+    if (record) {
+        memcpy(dst, record, sizeof(*record));
+        dst += sizeof(*record);
+    }
+    if (len)
+        memcpy(dst, data, len);
+    trace->used[active] += size;
+    if (!trace->pending_ns)
+        trace->pending_ns = offload_trace_now_ns();
+    return true;
+}
+
+struct offload_trace *offload_trace_open(const char *path, uint16_t flags)
+{
+    struct offload_trace *trace;
+    struct offload_trace_header header;
+
+    trace = (struct offload_trace *)calloc(1, sizeof(struct offload_trace));
+    if (!trace) {
+        ALOGE("offload_trace_open: NO_MEMORY");
+        return NULL;
+    }
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (trace->fd < 0) {
+        ALOGE("offload_trace_open: cannot open %s: %s", path, strerror(errno));
+        free(trace);
+        return NULL;
+    }
+    pthread_mutex_init(&trace->lock, (const pthread_mutexattr_t *) NULL);
+    pthread_mutex_init(&trace->flush_lock, (const pthread_mutexattr_t *) NULL);
+    trace->flags = flags;
+    trace->last_ns = offload_trace_now_ns();
+
+    header.magic = OFFLOAD_TRACE_MAGIC;
+    header.version = OFFLOAD_TRACE_VERSION;
+    header.flags = flags;
+    header.start_ns = trace->last_ns;
+    offload_trace_append_l(trace, NULL, &header, sizeof(header));
+    ALOGI("offload_trace_open: recording to %s (flags %x)", path, flags);
+    return trace;
+}
+
+struct offload_trace *offload_trace_open_from_properties(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX];
+    uint16_t flags = 0;
+
+    property_get(OFFLOAD_TRACE_PROP_ENABLE, value, "0");
+    if (atoi(value) != 1)
+        return NULL;
+    property_get(OFFLOAD_TRACE_PROP_PAYLOAD, value, "0");
+    if (atoi(value) == 1)
+        flags |= OFFLOAD_TRACE_F_PAYLOAD;
+    property_get(OFFLOAD_TRACE_PROP_PATH, path, OFFLOAD_TRACE_DEFAULT_PATH);
+    return offload_trace_open(path, flags);
+}
+
+void offload_trace_flush(struct offload_trace *trace)
+{
+    int pass;
+
+    if (!trace)
+        return;
+    pthread_mutex_lock(&trace->flush_lock);
+    // The inactive buffer holds the older records: it goes first, then the
+    // active one is swapped out and written too
+    for (pass = 0; pass < 2; pass++) {
+        pthread_mutex_lock(&trace->lock);
+        int index = trace->active ^ 1;
+        if (!trace->used[index] && trace->used[trace->active]) {
+            index = trace->active;
+            trace->active ^= 1;
+        }
+        uint32_t used = trace->used[index];
+        pthread_mutex_unlock(&trace->lock);
+        if (!used)
+            break;
+
+        uint32_t done = 0;
+        while (done < used) {
+            ssize_t ret = write(trace->fd, trace->buf[index] + done,
+                                used - done);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                ALOGE("offload_trace_flush: write failed %s", strerror(errno));
+                break;
+            }
+            done += ret;
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        trace->used[index] = 0;
+        if (!trace->used[index ^ 1])
+            trace->pending_ns = 0;
+        pthread_mutex_unlock(&trace->lock);
+    }
+    pthread_mutex_unlock(&trace->flush_lock);
+}
+
+bool offload_trace_flush_due(struct offload_trace *trace)
+{
+    bool due;
+
+    pthread_mutex_lock(&trace->lock);
+    due = trace->used[trace->active] >= OFFLOAD_TRACE_FLUSH_BYTES ||
+          trace->used[trace->active ^ 1];
+    pthread_mutex_unlock(&trace->lock);
+    return due;
+}
+
+uint32_t offload_trace_flush_wait_ms(struct offload_trace *trace)
+{
+    uint64_t pending_ns;
+
+    pthread_mutex_lock(&trace->lock);
+    pending_ns = trace->pending_ns;
+    pthread_mutex_unlock(&trace->lock);
+    if (!pending_ns)
+        return ~0u;
+    uint64_t age_ms = (offload_trace_now_ns() - pending_ns) / 1000000;
+    return age_ms >= OFFLOAD_TRACE_FLUSH_MS ? 0 :
+                     (uint32_t)(OFFLOAD_TRACE_FLUSH_MS - age_ms);
+}
+
+void offload_trace_close(struct offload_trace *trace)
+{
+    if (!trace)
+        return;
+    offload_trace_flush(trace);
+    if (trace->dropped)
+        ALOGW("offload_trace_close: %u records dropped, buffers full",
+              trace->dropped);
+    close(trace->fd);
+    pthread_mutex_destroy(&trace->flush_lock);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+}
+
+void offload_trace_record(struct offload_trace *trace, offload_trace_op_t op,
+                          uint64_t start_ns, int32_t arg0, int32_t arg1,
+                          int32_t arg2, int32_t ret,
+                          const void *data, uint32_t len)
+{
+    struct offload_trace_record record;
+    uint64_t now = offload_trace_now_ns();
+
+    if (!trace)
+        return;
+
+    record.op = op;
+    record.flags = 0;
+    if (len > OFFLOAD_TRACE_MAX_DATA) {
+        len = OFFLOAD_TRACE_MAX_DATA;
+        record.flags |= OFFLOAD_TRACE_RF_TRUNCATED;
+    }
+    record.len = data ? len : 0;
+    record.duration_us = (uint32_t)((now - start_ns) / 1000);
+    record.arg0 = arg0;
+    record.arg1 = arg1;
+    record.arg2 = arg2;
+    record.ret = ret;
+
+    pthread_mutex_lock(&trace->lock);
+    // Records of concurrent entry points may be appended out of entry order,
+    // keep the deltas non negative so the replay timeline stays monotonic.
+    if (start_ns < trace->last_ns)
+        start_ns = trace->last_ns;
+    record.delta_us = (uint32_t)((start_ns - trace->last_ns) / 1000);
+    trace->last_ns = start_ns;
+    offload_trace_append_l(trace, &record, data, record.len);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+int offload_trace_reader_open(struct offload_trace_reader *reader,
+                              const char *path)
+{
+    reader->file = fopen(path, "rb");
+    if (!reader->file) {
+        ALOGE("offload_trace_reader_open: cannot open %s", path);
+        return -errno;
+    }
+    if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+            reader->header.magic != OFFLOAD_TRACE_MAGIC ||
+            reader->header.version != OFFLOAD_TRACE_VERSION) {
+        ALOGE("offload_trace_reader_open: %s is not an offload trace", path);
+        fclose(reader->file);
+        reader->file = NULL;
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int offload_trace_reader_next(struct offload_trace_reader *reader,
+                              struct offload_trace_record *record)
+{
+    if (fread(record, sizeof(*record), 1, reader->file) != 1)
+        return 0;
+    if (record->op == 0 || record->op >= OFFLOAD_TRACE_OP_MAX) {
+        ALOGE("offload_trace_reader_next: corrupted record op %d", record->op);
+        return -EINVAL;
+    }
+    if (record->len &&
+            fread(reader->data, record->len, 1, reader->file) != 1) {
+        ALOGE("offload_trace_reader_next: truncated record");
+        return -EINVAL;
+    }
+    reader->data[record->len] = '\0';
+    return 1;
+}
+
+void offload_trace_reader_close(struct offload_trace_reader *reader)
+{
+    if (reader->file)
+        fclose(reader->file);
+    reader->file = NULL;
+}
+
+const char *offload_trace_op_name(int op)
+{
+    static const char *names[OFFLOAD_TRACE_OP_MAX] = {
+        "none", "open", "close", "set_parameters", "write", "pause", "resume",
+        "drain", "flush", "standby", "set_volume", "render_position",
+        "callback",
+    };
+    if (op <= 0 || op >= OFFLOAD_TRACE_OP_MAX)
+        return "unknown";
+    return names[op];
+}
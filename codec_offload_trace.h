@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_TRACE_H
+#define CODEC_OFFLOAD_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Binary trace of the HAL entry points of one offload output stream.
+ *
+ * File layout: one offload_trace_header followed by a sequence of
+ * offload_trace_record, each immediately followed by 'len' bytes of extra
+ * data (kvpairs string for SET_PARAMETERS, audio payload for WRITE when
+ * payload capture is enabled). All fields are little endian, as written by
+ * the device.
+ */
+#define OFFLOAD_TRACE_MAGIC      0x5254464f /* "OFTR" */
+#define OFFLOAD_TRACE_VERSION    1
+#define OFFLOAD_TRACE_F_PAYLOAD  0x0001     /* WRITE records carry the data */
+#define OFFLOAD_TRACE_RF_TRUNCATED 0x01     /* payload cut to the record limit */
+
+/* Properties controlling the recorder, read when a stream is opened */
+#define OFFLOAD_TRACE_PROP_ENABLE   "offload.trace.enable"
+#define OFFLOAD_TRACE_PROP_PATH     "offload.trace.path"
+#define OFFLOAD_TRACE_PROP_PAYLOAD  "offload.trace.payload"
+#define OFFLOAD_TRACE_DEFAULT_PATH  "/data/misc/media/offload_trace.bin"
+
+typedef enum {
+    OFFLOAD_TRACE_OPEN = 1,        /* arg0 = format, arg1 = sample rate,
+                                      arg2 = channel mask, ret = bitrate */
+    OFFLOAD_TRACE_CLOSE,
+    OFFLOAD_TRACE_SET_PARAMETERS,  /* data = kvpairs */
+    OFFLOAD_TRACE_WRITE,           /* arg0 = bytes requested, ret = sent */
+    OFFLOAD_TRACE_PAUSE,
+    OFFLOAD_TRACE_RESUME,
+    OFFLOAD_TRACE_DRAIN,           /* arg0 = audio_drain_type_t */
+    OFFLOAD_TRACE_FLUSH,
+    OFFLOAD_TRACE_STANDBY,
+    OFFLOAD_TRACE_SET_VOLUME,      /* arg0 = left, arg1 = right (float bits) */
+    OFFLOAD_TRACE_RENDER_POSITION, /* arg0 = dsp_frames */
+    OFFLOAD_TRACE_CALLBACK,        /* arg0 = stream_callback_event_t */
+    OFFLOAD_TRACE_OP_MAX
+} offload_trace_op_t;
+
+struct offload_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t start_ns;             /* CLOCK_MONOTONIC at stream open */
+} __attribute__((packed));
+
+struct offload_trace_record {
+    uint8_t  op;
+    uint8_t  flags;                /* OFFLOAD_TRACE_RF_* */
+    uint16_t len;                  /* bytes of extra data following */
+    uint32_t delta_us;             /* entry time since the previous record */
+    uint32_t duration_us;          /* time spent inside the entry point */
+    int32_t  arg0;
+    int32_t  arg1;
+    int32_t  arg2;
+    int32_t  ret;
+} __attribute__((packed));
+
+#define OFFLOAD_TRACE_BUFSIZE    (128*1024) /* per buffer, fits any record */
+#define OFFLOAD_TRACE_FLUSH_BYTES (16*1024) /* buffered before a flush is due */
+#define OFFLOAD_TRACE_FLUSH_MS   500        /* age of a record left unwritten */
+#define OFFLOAD_TRACE_MAX_DATA   0xffff
+
+/* Records go to the active buffer, the other one is being written or waits
+ * to be. The file is only written by offload_trace_flush, so the recorded
+ * entry points never block on it; with both buffers full records are
+ * dropped and counted instead.
+ */
+struct offload_trace {
+    pthread_mutex_t lock;           /* buffers */
+    pthread_mutex_t flush_lock;     /* file */
+    int             fd;
+    uint16_t        flags;
+    uint64_t        last_ns;
+    int             active;
+    uint32_t        used[2];
+    uint64_t        pending_ns;     /* oldest record not written, 0 none */
+    uint32_t        dropped;
+    uint8_t         buf[2][OFFLOAD_TRACE_BUFSIZE];
+};
+
+uint64_t offload_trace_now_ns(void);
+
+/* Returns NULL unless tracing is enabled through OFFLOAD_TRACE_PROP_ENABLE */
+struct offload_trace *offload_trace_open_from_properties(void);
+struct offload_trace *offload_trace_open(const char *path, uint16_t flags);
+void offload_trace_close(struct offload_trace *trace);
+
+/* Writes what is buffered to the file. Blocking: for the offload thread and
+ * the close, not for the recorded entry points.
+ */
+void offload_trace_flush(struct offload_trace *trace);
+/* True when OFFLOAD_TRACE_FLUSH_BYTES are buffered or a buffer is full */
+bool offload_trace_flush_due(struct offload_trace *trace);
+/* Milliseconds before the oldest unwritten record is OFFLOAD_TRACE_FLUSH_MS
+ * old, 0 if it is already, ~0 with nothing buffered.
+ */
+uint32_t offload_trace_flush_wait_ms(struct offload_trace *trace);
+
+/* Appends one record. 'start_ns' is the entry time of the call being
+ * recorded, the duration is taken up to now.
+ */
+void offload_trace_record(struct offload_trace *trace, offload_trace_op_t op,
+                          uint64_t start_ns, int32_t arg0, int32_t arg1,
+                          int32_t arg2, int32_t ret,
+                          const void *data, uint32_t len);
+
+static inline bool offload_trace_wants_payload(const struct offload_trace *trace)
+{
+    return trace && (trace->flags & OFFLOAD_TRACE_F_PAYLOAD);
+}
+
+/* Reader side, used by the replay tool */
+struct offload_trace_reader {
+    FILE *file;
+    struct offload_trace_header header;
+    uint8_t data[OFFLOAD_TRACE_MAX_DATA + 1];
+};
+
+int offload_trace_reader_open(struct offload_trace_reader *reader,
+                              const char *path);
+/* Returns 1 when a record was read, 0 at end of trace, negative on error.
+ * The extra data is NUL terminated in reader->data.
+ */
+int offload_trace_reader_next(struct offload_trace_reader *reader,
+                              struct offload_trace_record *record);
+void offload_trace_reader_close(struct offload_trace_reader *reader);
+
+const char *offload_trace_op_name(int op);
+
+#endif /* CODEC_OFFLOAD_TRACE_H */
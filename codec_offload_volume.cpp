@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "codec_offload_volume"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cutils/log.h>
+
+#include "codec_offload_volume.h"
+
+#define GAIN_TABLE_SIZE     (1 - OFFLOAD_GAIN_MIN_DB10)
+
+/* gain_table[i] is the gain of -i/10 dB, decreasing */
+static float gain_table[GAIN_TABLE_SIZE];
+static pthread_once_t gain_once = PTHREAD_ONCE_INIT;
+
+static void gain_build_table(void)
+{
+    int i;
+
+    for (i = 0; i < GAIN_TABLE_SIZE; i++)
+        gain_table[i] = (float)pow(10.0, -i / 200.0);
+}
+
+int offload_gain_to_db10(float gain)
+{
+    int lo = 0;
+    int hi = GAIN_TABLE_SIZE - 1;
+
+    pthread_once(&gain_once, gain_build_table);
+    if (gain >= gain_table[0])
+        return 0;
+    if (gain <= gain_table[hi])
+        return OFFLOAD_GAIN_MIN_DB10;
+    // Last entry not below the gain: gain_table[lo] >= gain > [hi]
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (gain_table[mid] >= gain)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return -lo;
+}
+
+int offload_volume_ramp_parse(const char *value, size_t len, float *gain,
+                              uint32_t *duration_ms)
+{
+    char buffer[32];
+    char *end;
+
+    if (len == 0 || len >= sizeof(buffer))
+        return -EINVAL;
+    memcpy(buffer, value, len);
+    buffer[len] = '\0';
+    *gain = strtof(buffer, &end);
+    if (end == buffer || *end != ',' || !(*gain >= 0.0f && *gain <= 1.0f))
+        return -EINVAL;
+    value = end + 1;
+    long ms = strtol(value, &end, 10);
+    if (end == value || *end || ms < 0)
+        return -EINVAL;
+    *duration_ms = (uint32_t)ms;
+    return 0;
+}
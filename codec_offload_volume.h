@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CODEC_OFFLOAD_VOLUME_H
+#define CODEC_OFFLOAD_VOLUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Volume ramps of an offloaded stream.
+ *
+ * The offload_volume_ramp set_parameters key fades the stream from its
+ * current gain to a target gain, e.g. "offload_volume_ramp=0.25,300" for
+ * 300 ms down to 0.25. The HAL hands the ramp to the DSP in one call when
+ * the mixer has a ramp control, otherwise it steps through it, at most
+ * once per offload.volume.ramp.step.ms.
+ */
+#define OFFLOAD_VOLUME_RAMP_KEY     "offload_volume_ramp"
+
+/* Lowest gain of the table, -144 dB: the mixer mute level */
+#define OFFLOAD_GAIN_MIN_DB10       (-1440)
+
+/* Gain in 0.1 dB, truncated toward 0 dB like (int)(200 * log10(gain)),
+ * looked up in a table built once instead of computed per call.
+ */
+int offload_gain_to_db10(float gain);
+
+/* Parses "<gain>,<duration ms>", gain in [0, 1]. Returns 0 or -EINVAL */
+int offload_volume_ramp_parse(const char *value, size_t len, float *gain,
+                              uint32_t *duration_ms);
+
+#endif /* CODEC_OFFLOAD_VOLUME_H */
@@ -0,0 +1,148 @@
+# Copyright (C) 2011 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+# Development tools that run the offload HAL against a simulated compress
+# backend (compress_sim.cpp replaces libtinycompress and the tinyalsa mixer).
+# They are not part of the product build.
+
+offload_sim_hal_src := ../codec_offload_hal.cpp \
+                       ../codec_offload_aac.cpp \
+                       ../codec_offload_buffer.cpp \
+                       ../codec_offload_endpoint.cpp \
+                       ../codec_offload_kvparser.cpp \
+                       ../codec_offload_log.cpp \
+                       ../codec_offload_next_format.cpp \
+                       ../codec_offload_ppp.cpp \
+                       ../codec_offload_shm.cpp \
+                       ../codec_offload_trace.cpp \
+                       ../codec_offload_volume.cpp
+
+offload_sim_cflags := -DFILE_PATH=\"/data/local/tmp/offload_sim/asound\"
+
+offload_sim_includes := $(LOCAL_PATH)/.. \
+                        $(call include-path-for, alsa-lib) \
+                        $(call include-path-for, frameworks-base) \
+                        $(call include-path-for, tinycompress)/tinycompress \
+                        $(call include-path-for, tinycompress)/sound \
+                        external/tinyalsa/include
+
+offload_sim_shared_libs := liblog libcutils \
+                           libutils \
+                           libasound \
+                           libhardware_legacy \
+                           libmedia
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := libcodec_offload_sim
+LOCAL_SRC_FILES := compress_sim.cpp
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_replay
+LOCAL_SRC_FILES := offload_replay.cpp offload_harness.cpp $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_kvparse_bench
+LOCAL_SRC_FILES := offload_kvparse_bench.cpp ../codec_offload_kvparser.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/..
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_lock_bench
+LOCAL_SRC_FILES := offload_lock_bench.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_stall_check
+LOCAL_SRC_FILES := offload_stall_check.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_endpoint_check
+LOCAL_SRC_FILES := offload_endpoint_check.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_aac_load_bench
+LOCAL_SRC_FILES := offload_aac_load_bench.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_shm_bench
+LOCAL_SRC_FILES := offload_shm_bench.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_transition_bench
+LOCAL_SRC_FILES := offload_transition_bench.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := offload_gapless_check
+LOCAL_SRC_FILES := offload_gapless_check.cpp offload_harness.cpp \
+                   $(offload_sim_hal_src)
+LOCAL_CFLAGS := $(offload_sim_cflags)
+LOCAL_C_INCLUDES := $(offload_sim_includes)
+LOCAL_SHARED_LIBRARIES := $(offload_sim_shared_libs)
+LOCAL_STATIC_LIBRARIES := libcodec_offload_sim libmedia_helper
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,1014 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "compress_sim"
+//#define LOG_NDEBUG 0
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <compress_params.h>
+#include <tinycompress.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "codec_offload_aac.h"
+#include "compress_sim.h"
+
+#define SIM_DEFAULT_BYTE_RATE   16000   /* used when the codec has no rate */
+#define SIM_MAX_MIXER_CTLS      32
+#define SIM_MAX_MIXER_ENUMS     8
+#define SIM_MAX_SEGMENTS        8
+#define SIM_MAX_CODEC_CHANGES   4
+#define SIM_PCM_FORMAT_S24_LE   6       /* SNDRV_PCM_FORMAT_S24_LE, 32 bit words */
+
+/* Codec of a track not decoded yet, from compress_set_codec_params() */
+struct sim_codec_change {
+    struct snd_codec codec;
+    uint64_t at;                /* rendered offset of its first byte */
+};
+
+/* Decoded samples of one track waiting for the DSP output */
+struct sim_segment {
+    int      track;             /* timeline entry, -1 when not recorded */
+    uint64_t samples;
+};
+
+struct compress {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       dsp_thread;
+    bool            exit;
+    unsigned int    flags;
+    struct compr_config config;
+    struct snd_codec codec;
+    bool            nonblock;
+    bool            ready;
+    bool            running;
+    bool            paused;
+    uint32_t        byte_rate;
+    uint32_t        cycles_per_sample;  /* decoder cost, all channels */
+    uint8_t         *ring;
+    uint32_t        ring_size;
+    uint32_t        write_pos;
+    bool            capture;         /* COMPRESS_OUT: the DSP encodes */
+    uint32_t        queued;          /* bytes written, not yet rendered;
+                                        for capture encoded, not yet read */
+    uint64_t        rendered;        /* bytes rendered since last start */
+    uint64_t        track_end;       /* rendered offset of the track boundary */
+    bool            next_track;
+    /* Codecs of the next tracks; the client may be a boundary ahead of
+     * the decoder. Played time is counted from base_ms at base_rendered,
+     * where the byte rate last changed.
+     */
+    struct sim_codec_change codec_changes[SIM_MAX_CODEC_CHANGES];
+    unsigned int    num_codec_changes;
+    uint64_t        base_rendered;
+    uint64_t        base_ms;
+    bool            stall;           /* fault injection armed */
+    bool            hung;            /* the DSP stopped consuming */
+    struct compr_gapless_mdata gapless;
+    /* Playback timeline */
+    uint32_t        sample_rate;     /* of the timeline, byte_rate if unknown */
+    uint64_t        out_samples;     /* output position, silence included */
+    struct sim_segment segments[SIM_MAX_SEGMENTS];
+    unsigned int    num_segments;
+    uint64_t        decoded;         /* decoded samples not yet played */
+    bool            in_track;        /* a track is being decoded */
+    bool            track_end_known; /* track_end ends that track */
+    int             track;           /* its timeline entry or -1 */
+    uint64_t        track_start;     /* rendered offset of its first byte */
+    uint64_t        track_samples;   /* decoded, trimming included */
+    uint64_t        track_played;    /* decoded, trimming excluded */
+    uint32_t        track_delay;     /* gapless metadata it started with */
+    uint32_t        track_padding;
+    char            error[128];
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compress_sim_config sim_config = {
+    1, 5000, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+static struct compress_sim_stats sim_stats;
+static uint32_t sim_stalls_left;
+static uint32_t sim_open_failures_left;
+static struct compress_sim_track sim_tracks[COMPRESS_SIM_MAX_TRACKS];
+static int sim_num_tracks;
+
+static void sim_delay(uint32_t us)
+{
+    if (us)
+        usleep(us);
+}
+
+static void sim_count(uint32_t *counter)
+{
+    pthread_mutex_lock(&sim_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static void sim_add(uint64_t *counter, uint64_t value)
+{
+    pthread_mutex_lock(&sim_lock);
+    *counter += value;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static int sim_oops(struct compress *compress, int err, const char *msg)
+{
+    if (compress)
+        snprintf(compress->error, sizeof(compress->error), "%s", msg);
+    errno = err;
+    return -1;
+}
+
+static uint32_t sim_byte_rate(const struct snd_codec *codec)
+{
+    if (codec->id == SND_AUDIOCODEC_PCM)
+        return codec->sample_rate * codec->ch_in *
+               (codec->format == SIM_PCM_FORMAT_S24_LE ? 4 : 2);
+    if (codec->bit_rate)
+        return codec->bit_rate / 8;
+    return SIM_DEFAULT_BYTE_RATE;
+}
+
+/* Rough decoder cost in DSP cycles per stream sample and channel, for the
+ * load model only: relative figures, not measured on any firmware. HE-AAC
+ * runs the AAC core at half the rate, then SBR (and PS for v2) at the
+ * output rate, which downsampled SBR halves.
+ */
+#define SIM_CYCLES_PCM          20
+#define SIM_CYCLES_MP3          300
+#define SIM_CYCLES_AAC          250
+#define SIM_CYCLES_AAC_CORE     125
+#define SIM_CYCLES_SBR          450
+#define SIM_CYCLES_PS           150
+#define SIM_CYCLES_OTHER        200
+
+static uint32_t sim_cycles_per_sample(const struct snd_codec *codec)
+{
+    uint32_t channels = codec->ch_in ? codec->ch_in : 1;
+    uint32_t cycles;
+
+    switch (codec->id) {
+    case SND_AUDIOCODEC_PCM:
+        cycles = SIM_CYCLES_PCM;
+        break;
+    case SND_AUDIOCODEC_MP3:
+        cycles = SIM_CYCLES_MP3;
+        break;
+    case SND_AUDIOCODEC_AAC:
+        if (codec->ch_mode != SND_AUDIOMODE_AAC_HE &&
+                codec->ch_mode != SND_AUDIOMODE_AAC_HE_PS) {
+            cycles = SIM_CYCLES_AAC;
+            break;
+        }
+        cycles = SIM_CYCLES_SBR;
+        if (codec->ch_mode == SND_AUDIOMODE_AAC_HE_PS)
+            cycles += SIM_CYCLES_PS;
+        if (offload_aac_downsampled_sbr(codec))
+            cycles /= 2;
+        cycles += SIM_CYCLES_AAC_CORE;
+        break;
+    default:
+        cycles = SIM_CYCLES_OTHER;
+        break;
+    }
+    return cycles * channels;
+}
+
+static void sim_timespec_after_us(struct timespec *ts, uint32_t us)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* The track starting now takes the codec set for it after next_track */
+static void sim_switch_codec(struct compress *compress)
+{
+    while (compress->num_codec_changes &&
+           compress->codec_changes[0].at <= compress->rendered) {
+        compress->base_ms += (compress->rendered - compress->base_rendered) *
+                             1000 / compress->byte_rate;
+        compress->base_rendered = compress->rendered;
+        compress->codec = compress->codec_changes[0].codec;
+        compress->byte_rate = sim_byte_rate(&compress->codec);
+        compress->sample_rate = compress->codec.sample_rate ?:
+                                                    compress->byte_rate;
+        compress->cycles_per_sample = sim_cycles_per_sample(&compress->codec);
+        compress->num_codec_changes--;
+        memmove(compress->codec_changes, compress->codec_changes + 1,
+                compress->num_codec_changes *
+                        sizeof(compress->codec_changes[0]));
+        sim_count(&sim_stats.codec_switches);
+    }
+}
+
+static void sim_track_begin(struct compress *compress)
+{
+    sim_switch_codec(compress);
+    pthread_mutex_lock(&sim_lock);
+    compress->track = sim_num_tracks < COMPRESS_SIM_MAX_TRACKS ?
+                            sim_num_tracks++ : -1;
+    if (compress->track >= 0) {
+        memset(&sim_tracks[compress->track], 0, sizeof(sim_tracks[0]));
+        sim_tracks[compress->track].sample_rate = compress->sample_rate;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    compress->in_track = true;
+    if (compress->track_end <= compress->rendered)
+        compress->track_end_known = false;      /* ended an earlier track */
+    compress->track_start = compress->rendered;
+    compress->track_samples = 0;
+    compress->track_played = 0;
+    compress->track_delay = compress->gapless.encoder_delay;
+    compress->track_padding = compress->gapless.encoder_padding;
+}
+
+static void sim_track_end(struct compress *compress)
+{
+    if (compress->track >= 0) {
+        uint64_t delay = compress->track_samples < compress->track_delay ?
+                            compress->track_samples : compress->track_delay;
+        pthread_mutex_lock(&sim_lock);
+        if (compress->track < sim_num_tracks) {
+            sim_tracks[compress->track].delay = delay;
+            sim_tracks[compress->track].padding = compress->track_samples -
+                                        delay - compress->track_played;
+        }
+        pthread_mutex_unlock(&sim_lock);
+    }
+    compress->in_track = false;
+    compress->track_end_known = false;
+}
+
+static void sim_queue_decoded(struct compress *compress, uint64_t samples)
+{
+    struct sim_segment *last = compress->num_segments ?
+            &compress->segments[compress->num_segments - 1] : NULL;
+
+    if (last && (last->track == compress->track ||
+                 compress->num_segments == SIM_MAX_SEGMENTS)) {
+        last->samples += samples;
+    } else {
+        compress->segments[compress->num_segments].track = compress->track;
+        compress->segments[compress->num_segments].samples = samples;
+        compress->num_segments++;
+    }
+    compress->decoded += samples;
+    compress->track_played += samples;
+}
+
+/* Decodes queued bytes worth up to 'want' samples, trimming the gapless
+ * delay and padding of the track they belong to.
+ */
+static void sim_decode(struct compress *compress, uint64_t want)
+{
+    while (want) {
+        if (compress->in_track && compress->track_end_known &&
+                compress->rendered >= compress->track_end)
+            sim_track_end(compress);    /* boundary set with nothing queued */
+        if (!compress->queued)
+            break;
+        if (!compress->in_track)
+            sim_track_begin(compress);
+        // A track may change the codec
+        uint32_t rate = compress->sample_rate;
+        uint32_t byte_rate = compress->byte_rate;
+        uint64_t offset = compress->rendered - compress->track_start;
+        uint64_t bytes = ((compress->track_samples + want) * byte_rate +
+                          rate - 1) / rate - offset;
+        if (bytes == 0)
+            bytes = 1;
+        if (bytes > compress->queued)
+            bytes = compress->queued;
+        if (compress->track_end_known &&
+                bytes > compress->track_end - compress->rendered)
+            bytes = compress->track_end - compress->rendered;
+        compress->queued -= bytes;
+        compress->rendered += bytes;
+        sim_add(&sim_stats.bytes_rendered, bytes);
+
+        uint64_t first = compress->track_samples;
+        uint64_t total = (offset + bytes) * rate / byte_rate;
+        pthread_mutex_lock(&sim_lock);
+        sim_stats.dsp_cycles += (total - first) * compress->cycles_per_sample;
+        sim_stats.decoded_us += (total - first) * 1000000 / rate;
+        pthread_mutex_unlock(&sim_lock);
+        uint64_t begin = first > compress->track_delay ? first :
+                                                         compress->track_delay;
+        uint64_t end = total;
+        compress->track_samples = total;
+        want -= total - first < want ? total - first : want;
+        if (compress->track_end_known) {
+            uint64_t length = (compress->track_end - compress->track_start) *
+                                    rate / byte_rate;
+            uint64_t content = length > compress->track_padding ?
+                                    length - compress->track_padding : 0;
+            if (end > content)
+                end = content;
+        }
+        if (end > begin)
+            sim_queue_decoded(compress, end - begin);
+        if (compress->track_end_known &&
+                compress->rendered >= compress->track_end)
+            sim_track_end(compress);
+    }
+}
+
+/* Plays 'samples' output samples, silence when nothing is decoded */
+static void sim_play(struct compress *compress, uint64_t samples)
+{
+    while (samples && compress->num_segments) {
+        struct sim_segment *segment = &compress->segments[0];
+        uint64_t count = samples < segment->samples ? samples :
+                                                      segment->samples;
+        pthread_mutex_lock(&sim_lock);
+        if (segment->track >= 0 && segment->track < sim_num_tracks) {
+            struct compress_sim_track *track = &sim_tracks[segment->track];
+            if (!track->samples)
+                track->first_sample = compress->out_samples;
+            track->samples += count;
+            track->last_sample = compress->out_samples + count - 1;
+        }
+        pthread_mutex_unlock(&sim_lock);
+        compress->out_samples += count;
+        compress->decoded -= count;
+        samples -= count;
+        segment->samples -= count;
+        if (!segment->samples) {
+            compress->num_segments--;
+            memmove(compress->segments, compress->segments + 1,
+                    compress->num_segments * sizeof(*segment));
+        }
+    }
+    compress->out_samples += samples;
+}
+
+/* Milliseconds actually played: the decoded samples are still to come */
+static uint64_t sim_played_ms(struct compress *compress)
+{
+    uint64_t ms = compress->base_ms +
+                  (compress->rendered - compress->base_rendered) * 1000 /
+                  compress->byte_rate;
+    uint64_t ahead = compress->decoded * 1000 / compress->sample_rate;
+    return ms > ahead ? ms - ahead : 0;
+}
+
+/* The simulated DSP: renders the queued bytes at the stream byte rate */
+static void *sim_dsp_loop(void *context)
+{
+    struct compress *compress = (struct compress *)context;
+
+    pthread_mutex_lock(&compress->lock);
+    while (!compress->exit) {
+        struct timespec ts;
+        uint32_t tick_us = sim_config.tick_us;
+
+        if (compress->capture && compress->running && !compress->paused) {
+            uint64_t chunk = (uint64_t)compress->byte_rate * tick_us *
+                                sim_config.time_scale / 1000000;
+            uint32_t pos;
+            if (chunk == 0)
+                chunk = 1;
+            if (chunk > compress->ring_size)
+                chunk = compress->ring_size;
+            if (compress->queued + chunk > compress->ring_size) {
+                // Nobody read in time: the DSP overwrites the oldest data
+                compress->queued = compress->ring_size - chunk;
+                sim_count(&sim_stats.overruns);
+            }
+            for (pos = 0; pos < chunk; pos++) {
+                compress->ring[compress->write_pos] =
+                        (uint8_t)(compress->rendered + pos);
+                compress->write_pos = (compress->write_pos + 1) %
+                                            compress->ring_size;
+            }
+            compress->queued += chunk;
+            compress->rendered += chunk;
+            sim_add(&sim_stats.bytes_rendered, chunk);
+            pthread_cond_broadcast(&compress->cond);
+        } else if (compress->stall && !compress->hung &&
+                   compress->rendered >= sim_config.stall_after_bytes) {
+            // Injected firmware hang: the hardware pointer freezes until
+            // the stream is closed
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            compress->hung = true;
+            pthread_mutex_lock(&sim_lock);
+            sim_stats.stalls++;
+            sim_stats.stall_ns = (uint64_t)now.tv_sec * 1000000000ull +
+                                 now.tv_nsec;
+            pthread_mutex_unlock(&sim_lock);
+        } else if (compress->running && !compress->paused && !compress->hung) {
+            // Keep the decoder pipeline_us ahead of the output, then play
+            // one tick; an empty pipeline plays silence
+            uint64_t tick = (uint64_t)compress->sample_rate * tick_us *
+                                sim_config.time_scale / 1000000;
+            uint64_t ahead = (uint64_t)compress->sample_rate *
+                                sim_config.pipeline_us / 1000000;
+            if (tick == 0)
+                tick = 1;
+            if (ahead + tick > compress->decoded)
+                sim_decode(compress, ahead + tick - compress->decoded);
+            sim_play(compress, tick);
+            pthread_cond_broadcast(&compress->cond);
+        }
+        sim_timespec_after_us(&ts, tick_us);
+        pthread_cond_timedwait(&compress->cond, &compress->lock, &ts);
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return NULL;
+}
+
+struct compress *compress_open(unsigned int card, unsigned int device,
+                               unsigned int flags, struct compr_config *config)
+{
+    struct compress *compress;
+
+    sim_count(&sim_stats.opens);
+    sim_delay(sim_config.open_delay_us);
+    compress = (struct compress *)calloc(1, sizeof(struct compress));
+    if (!compress)
+        return NULL;
+    pthread_mutex_init(&compress->lock, NULL);
+    pthread_cond_init(&compress->cond, NULL);
+    compress->flags = flags;
+    compress->capture = (flags & COMPRESS_OUT) != 0;
+    compress->config = *config;
+    if (config->codec)
+        compress->codec = *config->codec;
+    compress->config.codec = &compress->codec;
+    compress->byte_rate = sim_byte_rate(&compress->codec);
+    compress->sample_rate = compress->codec.sample_rate ?:
+                                                compress->byte_rate;
+    compress->track = -1;
+    compress->cycles_per_sample = sim_cycles_per_sample(&compress->codec);
+    pthread_mutex_lock(&sim_lock);
+    if (!compress->capture) {
+        sim_stats.output_rate = compress->sample_rate;
+        if (compress->codec.id == SND_AUDIOCODEC_AAC &&
+                offload_aac_downsampled_sbr(&compress->codec))
+            sim_stats.output_rate /= 2;
+    }
+    if (!compress->capture && sim_stalls_left) {
+        sim_stalls_left--;
+        compress->stall = true;
+    }
+    if (!compress->capture && sim_open_failures_left) {
+        sim_open_failures_left--;
+        pthread_mutex_unlock(&sim_lock);
+        sim_oops(compress, EBUSY, "DSP busy");
+        return compress;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    compress->ring_size = config->fragment_size * config->fragments;
+    compress->ring = (uint8_t *)malloc(compress->ring_size);
+    if (!compress->ring || !compress->ring_size) {
+        sim_oops(compress, ENOMEM, "cannot allocate ring");
+        return compress;
+    }
+    pthread_create(&compress->dsp_thread, NULL, sim_dsp_loop, compress);
+    compress->ready = true;
+    ALOGV("compress_open: card %u device %u ring %u byte rate %u",
+          card, device, compress->ring_size, compress->byte_rate);
+    return compress;
+}
+
+void compress_close(struct compress *compress)
+{
+    if (!compress)
+        return;
+    sim_count(&sim_stats.closes);
+    sim_delay(sim_config.close_delay_us);
+    if (compress->ready) {
+        pthread_mutex_lock(&compress->lock);
+        compress->exit = true;
+        pthread_cond_broadcast(&compress->cond);
+        pthread_mutex_unlock(&compress->lock);
+        pthread_join(compress->dsp_thread, NULL);
+    }
+    pthread_cond_destroy(&compress->cond);
+    pthread_mutex_destroy(&compress->lock);
+    free(compress->ring);
+    free(compress);
+}
+
+int is_compress_ready(struct compress *compress)
+{
+    return compress && compress->ready;
+}
+
+int is_compress_running(struct compress *compress)
+{
+    return compress && compress->running;
+}
+
+const char *compress_get_error(struct compress *compress)
+{
+    return compress ? compress->error : "no compress handle";
+}
+
+void compress_nonblock(struct compress *compress, int nonblock)
+{
+    compress->nonblock = nonblock != 0;
+}
+
+void compress_set_max_poll_wait(struct compress *compress, int milliseconds)
+{
+}
+
+bool is_codec_supported(unsigned int card, unsigned int device,
+                        unsigned int flags, struct snd_codec *codec)
+{
+    return codec->id == SND_AUDIOCODEC_MP3 || codec->id == SND_AUDIOCODEC_AAC ||
+           codec->id == SND_AUDIOCODEC_PCM || codec->id == SND_AUDIOCODEC_AMR ||
+           codec->id == SND_AUDIOCODEC_AMRWB;
+}
+
+int compress_get_hpointer(struct compress *compress, unsigned int *avail,
+                          struct timespec *tstamp)
+{
+    uint64_t ms;
+
+    pthread_mutex_lock(&compress->lock);
+    *avail = compress->capture ? compress->queued :
+                                 compress->ring_size - compress->queued;
+    ms = sim_played_ms(compress);
+    pthread_mutex_unlock(&compress->lock);
+    tstamp->tv_sec = ms / 1000;
+    tstamp->tv_nsec = (ms % 1000) * 1000000;
+    return 0;
+}
+
+int compress_get_tstamp(struct compress *compress, unsigned long *samples,
+                        unsigned int *sampling_rate)
+{
+    pthread_mutex_lock(&compress->lock);
+    *sampling_rate = compress->codec.sample_rate;
+    *samples = sim_played_ms(compress) * compress->codec.sample_rate / 1000;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_write(struct compress *compress, const void *buf,
+                   unsigned int size)
+{
+    const uint8_t *src = (const uint8_t *)buf;
+    unsigned int done = 0;
+
+    sim_count(&sim_stats.writes);
+    sim_delay(sim_config.write_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    while (done < size) {
+        uint32_t space = compress->ring_size - compress->queued;
+        if (space == 0) {
+            if (compress->nonblock)
+                break;
+            pthread_cond_wait(&compress->cond, &compress->lock);
+            continue;
+        }
+        uint32_t chunk = size - done;
+        if (chunk > space)
+            chunk = space;
+        if (chunk > compress->ring_size - compress->write_pos)
+            chunk = compress->ring_size - compress->write_pos;
+        memcpy(compress->ring + compress->write_pos, src + done, chunk);
+        compress->write_pos = (compress->write_pos + chunk) %
+                                    compress->ring_size;
+        compress->queued += chunk;
+        done += chunk;
+    }
+    pthread_mutex_unlock(&compress->lock);
+    if (done < size)
+        sim_count(&sim_stats.partial_writes);
+    sim_add(&sim_stats.bytes_written, done);
+    sim_add(&sim_stats.bytes_copied, done);
+    return done;
+}
+
+int compress_read(struct compress *compress, void *buf, unsigned int size)
+{
+    uint8_t *dst = (uint8_t *)buf;
+    unsigned int done = 0;
+
+    if (!compress->capture)
+        return sim_oops(compress, EPERM, "read on a playback stream");
+    sim_count(&sim_stats.reads);
+    pthread_mutex_lock(&compress->lock);
+    while (done < size) {
+        if (compress->queued == 0) {
+            if (compress->nonblock || !compress->running)
+                break;
+            pthread_cond_wait(&compress->cond, &compress->lock);
+            continue;
+        }
+        uint32_t read_pos = (compress->write_pos + compress->ring_size -
+                             compress->queued) % compress->ring_size;
+        uint32_t chunk = size - done;
+        if (chunk > compress->queued)
+            chunk = compress->queued;
+        if (chunk > compress->ring_size - read_pos)
+            chunk = compress->ring_size - read_pos;
+        memcpy(dst + done, compress->ring + read_pos, chunk);
+        compress->queued -= chunk;
+        done += chunk;
+    }
+    pthread_mutex_unlock(&compress->lock);
+    sim_add(&sim_stats.bytes_read, done);
+    return done;
+}
+
+int compress_start(struct compress *compress)
+{
+    sim_count(&sim_stats.starts);
+    sim_delay(sim_config.start_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    compress->running = true;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_stop(struct compress *compress)
+{
+    sim_count(&sim_stats.stops);
+    sim_delay(sim_config.stop_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    compress->running = false;
+    compress->paused = false;
+    compress->queued = 0;
+    compress->write_pos = 0;
+    compress->rendered = 0;
+    compress->next_track = false;
+    compress->num_codec_changes = 0;
+    compress->base_rendered = 0;
+    compress->base_ms = 0;
+    if (compress->in_track)
+        sim_track_end(compress);
+    compress->num_segments = 0;
+    compress->decoded = 0;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_pause(struct compress *compress)
+{
+    sim_count(&sim_stats.pauses);
+    sim_delay(sim_config.pause_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    if (!compress->running) {
+        pthread_mutex_unlock(&compress->lock);
+        return sim_oops(compress, EPERM, "pause while not running");
+    }
+    compress->paused = true;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_resume(struct compress *compress)
+{
+    sim_count(&sim_stats.resumes);
+    sim_delay(sim_config.resume_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    if (!compress->paused) {
+        pthread_mutex_unlock(&compress->lock);
+        return sim_oops(compress, EPERM, "resume while not paused");
+    }
+    compress->paused = false;
+    pthread_cond_broadcast(&compress->cond);
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_drain(struct compress *compress)
+{
+    sim_count(&sim_stats.drains);
+    sim_delay(sim_config.drain_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    // The end of the stream ends the track, padding included
+    compress->track_end = compress->rendered + compress->queued;
+    compress->track_end_known = true;
+    while (compress->running && (compress->queued || compress->decoded))
+        pthread_cond_wait(&compress->cond, &compress->lock);
+    compress->running = false;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_next_track(struct compress *compress)
+{
+    pthread_mutex_lock(&compress->lock);
+    compress->next_track = true;
+    compress->track_end = compress->rendered + compress->queued;
+    compress->track_end_known = true;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_partial_drain(struct compress *compress)
+{
+    sim_count(&sim_stats.partial_drains);
+    sim_delay(sim_config.drain_delay_us);
+    pthread_mutex_lock(&compress->lock);
+    if (!compress->next_track) {
+        pthread_mutex_unlock(&compress->lock);
+        return sim_oops(compress, EPERM, "partial drain without next track");
+    }
+    while (compress->running && compress->rendered < compress->track_end)
+        pthread_cond_wait(&compress->cond, &compress->lock);
+    compress->next_track = false;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_set_codec_params(struct compress *compress,
+                              struct snd_codec *codec)
+{
+    if (sim_config.codec_change_refused)
+        return sim_oops(compress, EPERM, "codec change while running");
+    pthread_mutex_lock(&compress->lock);
+    if (!compress->next_track) {
+        pthread_mutex_unlock(&compress->lock);
+        return sim_oops(compress, EPERM, "codec change without next track");
+    }
+    if (compress->num_codec_changes == SIM_MAX_CODEC_CHANGES) {
+        pthread_mutex_unlock(&compress->lock);
+        return sim_oops(compress, EBUSY, "too many codec changes queued");
+    }
+    compress->codec_changes[compress->num_codec_changes].codec = *codec;
+    compress->codec_changes[compress->num_codec_changes].at =
+                                                compress->track_end;
+    compress->num_codec_changes++;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_set_gapless_metadata(struct compress *compress,
+                                  struct compr_gapless_mdata *mdata)
+{
+    sim_count(&sim_stats.metadata_sets);
+    pthread_mutex_lock(&compress->lock);
+    compress->gapless = *mdata;
+    pthread_mutex_unlock(&compress->lock);
+    return 0;
+}
+
+int compress_wait(struct compress *compress, int timeout_ms)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    sim_count(&sim_stats.waits);
+    if (timeout_ms >= 0)
+        sim_timespec_after_us(&ts, timeout_ms * 1000);
+    pthread_mutex_lock(&compress->lock);
+    while (compress->ready &&
+            compress->ring_size - compress->queued <
+                compress->config.fragment_size) {
+        if (!compress->running && compress->queued)
+            break;              /* stopped with data: nothing will drain */
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&compress->cond, &compress->lock);
+        } else if (pthread_cond_timedwait(&compress->cond, &compress->lock,
+                                          &ts) == ETIMEDOUT) {
+            ret = sim_oops(compress, ETIME, "poll timed out");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&compress->lock);
+    return ret;
+}
+
+/* Minimal tinyalsa mixer: every control name resolves to an integer cell.
+ * Enum controls learn their item names as they are selected.
+ */
+struct mixer_ctl {
+    char name[PROPERTY_VALUE_MAX];
+    int  value;
+    char enums[SIM_MAX_MIXER_ENUMS][PROPERTY_VALUE_MAX];
+    unsigned int num_enums;
+};
+
+struct mixer {
+    unsigned int card;
+};
+
+static struct mixer_ctl sim_ctls[SIM_MAX_MIXER_CTLS];
+static unsigned int sim_num_ctls;
+
+struct mixer *mixer_open(unsigned int card)
+{
+    struct mixer *mixer = (struct mixer *)calloc(1, sizeof(struct mixer));
+    if (mixer)
+        mixer->card = card;
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    free(mixer);
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    struct mixer_ctl *ctl = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < sim_num_ctls; i++) {
+        if (!strcmp(sim_ctls[i].name, name)) {
+            ctl = &sim_ctls[i];
+            break;
+        }
+    }
+    if (!ctl && sim_num_ctls < SIM_MAX_MIXER_CTLS) {
+        ctl = &sim_ctls[sim_num_ctls++];
+        snprintf(ctl->name, sizeof(ctl->name), "%s", name);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return ctl;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    return ctl->value;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    sim_count(&sim_stats.mixer_writes);
+    ctl->value = value;
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < ctl->num_enums; i++) {
+        if (!strcmp(ctl->enums[i], string))
+            break;
+    }
+    if (i == ctl->num_enums) {
+        if (i == SIM_MAX_MIXER_ENUMS) {
+            pthread_mutex_unlock(&sim_lock);
+            return -EINVAL;
+        }
+        snprintf(ctl->enums[i], sizeof(ctl->enums[i]), "%s", string);
+        ctl->num_enums++;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return mixer_ctl_set_value(ctl, 0, i);
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl,
+                                      unsigned int enum_id)
+{
+    return enum_id < ctl->num_enums ? ctl->enums[enum_id] : NULL;
+}
+
+void compress_sim_get_default_config(struct compress_sim_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->time_scale = 1;
+    config->tick_us = 5000;
+}
+
+void compress_sim_configure(const struct compress_sim_config *config)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_config = *config;
+    if (!sim_config.time_scale)
+        sim_config.time_scale = 1;
+    if (!sim_config.tick_us)
+        sim_config.tick_us = 5000;
+    sim_stalls_left = sim_config.stall_streams;
+    sim_open_failures_left = sim_config.open_failures;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void compress_sim_get_stats(struct compress_sim_stats *stats)
+{
+    pthread_mutex_lock(&sim_lock);
+    *stats = sim_stats;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void compress_sim_reset_stats(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int compress_sim_get_timeline(struct compress_sim_track *tracks, int max)
+{
+    int count;
+
+    pthread_mutex_lock(&sim_lock);
+    count = sim_num_tracks;
+    memcpy(tracks, sim_tracks,
+           (count < max ? count : max) * sizeof(*tracks));
+    pthread_mutex_unlock(&sim_lock);
+    return count;
+}
+
+void compress_sim_reset_timeline(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_num_tracks = 0;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int compress_sim_setup_card(const char *proc_root)
+{
+    char name[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+    char partial[PATH_MAX];
+    const char *p;
+
+    // mkdir -p proc_root
+    for (p = proc_root; (p = strchr(p + 1, '/')) != NULL; ) {
+        snprintf(partial, sizeof(partial), "%.*s", (int)(p - proc_root),
+                 proc_root);
+        mkdir(partial, 0755);
+    }
+    mkdir(proc_root, 0755);
+
+    // The HAL resolves audio.device.name to "cardN" through a symlink
+    property_get("audio.device.name", name, "0");
+    snprintf(path, sizeof(path), "%s/%s", proc_root, name);
+    unlink(path);
+    if (symlink("card0", path) < 0) {
+        fprintf(stderr, "compress_sim: cannot create %s: %s\n", path,
+                strerror(errno));
+        return -errno;
+    }
+    if (compress_sim_add_endpoint(proc_root, 0, name, 0, false) < 0 ||
+            compress_sim_add_endpoint(proc_root, 0, name, 1, true) < 0)
+        return -EIO;
+    return 0;
+}
+
+static int sim_write_file(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "compress_sim: cannot create %s: %s\n", path,
+                strerror(errno));
+        return -errno;
+    }
+    fputs(text, file);
+    fclose(file);
+    return 0;
+}
+
+int compress_sim_add_endpoint(const char *proc_root, int card,
+                              const char *card_id, int device, bool capture)
+{
+    char path[PATH_MAX];
+    char text[128];
+
+    snprintf(path, sizeof(path), "%s/card%d", proc_root, card);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/card%d/id", proc_root, card);
+    snprintf(text, sizeof(text), "%s\n", card_id);
+    if (sim_write_file(path, text) < 0)
+        return -EIO;
+    snprintf(path, sizeof(path), "%s/card%d/compr%d", proc_root, card, device);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/card%d/compr%d/info", proc_root, card,
+             device);
+    snprintf(text, sizeof(text), "card: %d\ndevice: %d\nstream: %s\n"
+             "id: %s compress %d\n", card, device,
+             capture ? "CAPTURE" : "PLAYBACK", card_id, device);
+    return sim_write_file(path, text);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef COMPRESS_SIM_H
+#define COMPRESS_SIM_H
+
+#include <stdint.h>
+
+/* Simulated compress offload backend.
+ *
+ * compress_sim.cpp implements the tinycompress (and tinyalsa mixer) entry
+ * points used by the HAL, so linking it in place of libtinycompress runs the
+ * unmodified HAL against a software DSP that consumes the ring buffer at the
+ * stream bit rate (or, for COMPRESS_OUT capture, produces encoded bytes at
+ * that rate). The tools in this directory drive the HAL through its
+ * public audio_hw_device interface on top of it.
+ */
+
+/* Root of the fake card tree; the tools build the HAL with FILE_PATH set to
+ * this directory.
+ */
+#define COMPRESS_SIM_PROC_ROOT "/data/local/tmp/offload_sim/asound"
+
+struct compress_sim_config {
+    uint32_t time_scale;        /* DSP consumption speed-up, 1 = real time */
+    uint32_t tick_us;           /* DSP consumption period */
+    /* Extra latency of each driver call, in microseconds */
+    uint32_t open_delay_us;
+    uint32_t close_delay_us;
+    uint32_t write_delay_us;
+    uint32_t start_delay_us;
+    uint32_t stop_delay_us;
+    uint32_t pause_delay_us;
+    uint32_t resume_delay_us;
+    uint32_t drain_delay_us;
+    /* Fault injection: the next stall_streams playback streams opened stop
+     * consuming, with data queued, once they rendered stall_after_bytes.
+     */
+    uint32_t stall_after_bytes;
+    uint32_t stall_streams;
+    /* The next open_failures playback opens fail, as with a busy DSP */
+    uint32_t open_failures;
+    /* Decoded audio the DSP keeps ahead of its output; the partial drain
+     * returns once a track is decoded, this much before it finished playing.
+     */
+    uint32_t pipeline_us;
+    /* The driver refuses a codec change after next_track, as before
+     * Linux 5.7, see compress_set_codec_params()
+     */
+    bool codec_change_refused;
+};
+
+struct compress_sim_stats {
+    uint32_t opens;
+    uint32_t closes;
+    uint32_t writes;
+    uint32_t partial_writes;
+    uint32_t waits;
+    uint32_t starts;
+    uint32_t stops;
+    uint32_t pauses;
+    uint32_t resumes;
+    uint32_t drains;
+    uint32_t partial_drains;
+    uint32_t mixer_writes;
+    uint32_t reads;
+    uint32_t overruns;          /* capture data overwritten before a read */
+    uint32_t stalls;            /* injected DSP hangs that occurred */
+    uint32_t metadata_sets;     /* compress_set_gapless_metadata calls */
+    uint64_t bytes_written;     /* accepted by compress_write */
+    uint64_t bytes_copied;      /* copied by the simulated kernel */
+    uint64_t bytes_rendered;    /* consumed (or encoded) by the DSP */
+    uint64_t bytes_read;        /* returned by compress_read */
+    uint64_t stall_ns;          /* CLOCK_MONOTONIC time of the last hang */
+    /* DSP load model: decoder cycles, see sim_cycles_per_sample() */
+    uint64_t dsp_cycles;
+    uint64_t decoded_us;        /* audio decoded, in stream time */
+    uint32_t output_rate;       /* DSP output of the last playback opened */
+    uint32_t codec_switches;    /* codec changed at a track boundary */
+};
+
+/* Sample timeline of the playback streams. Every track the DSP decodes, up
+ * to a next_track boundary or a stop, gets an entry; positions count the
+ * output samples since the stream opened, silence included, so the distance
+ * between two tracks is the gap the listener hears. Delay and padding are
+ * the samples trimmed following the gapless metadata of the track.
+ */
+#define COMPRESS_SIM_MAX_TRACKS 64
+
+struct compress_sim_track {
+    uint32_t sample_rate;
+    uint32_t delay;             /* trimmed at the track start */
+    uint32_t padding;           /* trimmed at the track end */
+    uint64_t samples;           /* played, trimming excluded */
+    uint64_t first_sample;      /* output position of the first played one */
+    uint64_t last_sample;       /* output position of the last played one */
+};
+
+/* Upstream tinycompress call, newer than the KitKat library: the codec of
+ * the next track, between compress_next_track and its first byte. The HAL
+ * references it weakly.
+ */
+extern "C" int compress_set_codec_params(struct compress *compress,
+                                         struct snd_codec *codec);
+
+void compress_sim_get_default_config(struct compress_sim_config *config);
+void compress_sim_configure(const struct compress_sim_config *config);
+void compress_sim_get_stats(struct compress_sim_stats *stats);
+void compress_sim_reset_stats(void);
+/* Copies up to 'max' timeline entries, returns how many there are */
+int compress_sim_get_timeline(struct compress_sim_track *tracks, int max);
+void compress_sim_reset_timeline(void);
+
+/* Creates the fake card entry the HAL resolves through audio.device.name,
+ * card0 with a playback endpoint compr0 and a capture one compr1
+ */
+int compress_sim_setup_card(const char *proc_root);
+/* Adds cardN/id and cardN/comprM/info under proc_root, as the kernel
+ * exports a compress device
+ */
+int compress_sim_add_endpoint(const char *proc_root, int card,
+                              const char *card_id, int device, bool capture);
+
+#endif /* COMPRESS_SIM_H */
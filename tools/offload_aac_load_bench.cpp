@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* DSP load of the AAC decode modes on the simulated backend: plays the same
+ * AAC stream with each object type and downsampled SBR setting passed to the
+ * HAL through AUDIO_OFFLOAD_CODEC_ID and AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING,
+ * and reports the rate the DSP outputs and the decoder cost of the load
+ * model of compress_sim, in DSP MHz.
+ *
+ *   offload_aac_load_bench [-r sample_rate] [-b bit_rate] [-l ms]
+ *                          [-s time_scale]
+ *
+ * Output is CSV, one row per mode:
+ *   mode,object_type,down_sampling,output_rate,decoded_ms,dsp_mhz
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec_offload_aac.h"
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define BENCH_CHANNELS          2
+#define BENCH_CALLBACK_TIMEOUT  2000    /* ms */
+
+struct bench_mode {
+    const char *name;
+    int object_type;
+    int down_sampling;
+};
+
+static const struct bench_mode bench_modes[] = {
+    { "aac-lc",             OFFLOAD_AAC_AOT_LC,  0 },
+    { "he-aac",             OFFLOAD_AAC_AOT_SBR, 0 },
+    { "he-aac-dsbr",        OFFLOAD_AAC_AOT_SBR, 1 },
+    { "he-aac-v2",          OFFLOAD_AAC_AOT_PS,  0 },
+    { "he-aac-v2-dsbr",     OFFLOAD_AAC_AOT_PS,  1 },
+};
+
+static int bench_play(struct offload_harness *h, const struct bench_mode *mode,
+                      const uint8_t *buffer, uint32_t bytes)
+{
+    char kvpairs[128];
+
+    // The codec configuration is taken when the stream opens the device
+    offload_harness_close_stream(h);
+    snprintf(kvpairs, sizeof(kvpairs), "%s=%d;%s=%d", AUDIO_OFFLOAD_CODEC_ID,
+             mode->object_type, AUDIO_OFFLOAD_CODEC_DOWN_SAMPLING,
+             mode->down_sampling);
+    h->dev->set_parameters(h->dev, kvpairs);
+    compress_sim_reset_stats();
+    int ret = offload_harness_open_stream(h);
+    if (ret < 0)
+        return ret;
+    if (offload_harness_write_all(h, buffer, bytes,
+                                  BENCH_CALLBACK_TIMEOUT) < 0)
+        return -ETIMEDOUT;
+    uint32_t drained = offload_harness_events(h, STREAM_CBK_EVENT_DRAIN_READY);
+    h->out->drain(h->out, AUDIO_DRAIN_ALL);
+    if (!offload_harness_wait_event(h, STREAM_CBK_EVENT_DRAIN_READY,
+                                    drained + 1, BENCH_CALLBACK_TIMEOUT))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct compress_sim_config sim;
+    struct compress_sim_stats stats;
+    struct offload_harness harness;
+    unsigned int sample_rate = 44100;
+    unsigned int bit_rate = 48000;
+    unsigned int length_ms = 2000;
+    size_t m;
+    int opt;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 50;
+    sim.tick_us = 1000;
+    while ((opt = getopt(argc, argv, "r:b:l:s:")) != -1) {
+        switch (opt) {
+        case 'r':
+            sample_rate = atoi(optarg);
+            break;
+        case 'b':
+            bit_rate = atoi(optarg);
+            break;
+        case 'l':
+            length_ms = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r sample_rate] [-b bit_rate] "
+                    "[-l ms] [-s time_scale]\n", argv[0]);
+            return 1;
+        }
+    }
+    compress_sim_configure(&sim);
+
+    uint32_t bytes = (uint64_t)length_ms * bit_rate / 8000;
+    uint8_t *buffer = (uint8_t *)calloc(1, bytes);
+    if (!buffer)
+        return 1;
+    if (offload_harness_open(&harness, AUDIO_FORMAT_AAC, sample_rate,
+                             AUDIO_CHANNEL_OUT_STEREO, bit_rate))
+        return 1;
+
+    printf("mode,object_type,down_sampling,output_rate,decoded_ms,dsp_mhz\n");
+    for (m = 0; m < sizeof(bench_modes) / sizeof(bench_modes[0]); m++) {
+        const struct bench_mode *mode = &bench_modes[m];
+        int ret = bench_play(&harness, mode, buffer, bytes);
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", mode->name, strerror(-ret));
+            break;
+        }
+        compress_sim_get_stats(&stats);
+        printf("%s,%d,%d,%u,%llu,%.1f\n", mode->name, mode->object_type,
+               mode->down_sampling, stats.output_rate,
+               (unsigned long long)(stats.decoded_us / 1000),
+               stats.decoded_us ? (double)stats.dsp_cycles / stats.decoded_us :
+                                  0);
+    }
+    offload_harness_close(&harness);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks the compress endpoint discovery against a fake /proc/asound tree:
+ * two cards with playback and capture endpoints, an endpoint without info,
+ * the card id symlink and a card without compress devices. Then places
+ * streams and checks that every one lands on the least loaded endpoint of
+ * its direction. Last, opens the HAL on the simulated card with a second
+ * playback endpoint and a busy first one, and checks that the stream plays
+ * on the second.
+ *
+ *   offload_endpoint_check [-r fake_root] [-n streams]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <compress_params.h>
+
+#include "codec_offload_endpoint.h"
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define CHECK_CALLBACK_TIMEOUT  2000    /* ms */
+
+static bool check(bool ok, const char *what)
+{
+    printf("%-52s %s\n", what, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int check_build_tree(const char *root)
+{
+    char path[256];
+
+    mkdir(root, 0755);
+    if (compress_sim_add_endpoint(root, 1, "LPE2", 2, false) < 0 ||
+            compress_sim_add_endpoint(root, 1, "LPE2", 0, false) < 0 ||
+            compress_sim_add_endpoint(root, 0, "Intel", 1, true) < 0 ||
+            compress_sim_add_endpoint(root, 0, "Intel", 0, false) < 0)
+        return -EIO;
+    // An endpoint the kernel exports without info is skipped
+    snprintf(path, sizeof(path), "%s/card1/compr3", root);
+    mkdir(path, 0755);
+    // PCM only card, and the id symlink of card0
+    snprintf(path, sizeof(path), "%s/card2", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/card2/pcm0p", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/Intel", root);
+    unlink(path);
+    symlink("card0", path);
+    return 0;
+}
+
+static bool check_discovery(struct offload_endpoints *endpoints,
+                            const char *root)
+{
+    static const struct { int card, device; uint32_t direction; } expected[] = {
+        { 0, 0, OFFLOAD_ENDPOINT_PLAYBACK },
+        { 0, 1, OFFLOAD_ENDPOINT_CAPTURE },
+        { 1, 0, OFFLOAD_ENDPOINT_PLAYBACK },
+        { 1, 2, OFFLOAD_ENDPOINT_PLAYBACK },
+    };
+    int count = offload_endpoints_scan(endpoints, root);
+    bool ok = check(count == 4, "four endpoints found");
+    int i;
+
+    for (i = 0; ok && i < count; i++) {
+        const struct offload_endpoint *ep = &endpoints->endpoint[i];
+        ok = ep->card == expected[i].card && ep->device == expected[i].device &&
+             ep->direction == expected[i].direction &&
+             (ep->codecs & (1u << SND_AUDIOCODEC_MP3));
+    }
+    check(ok, "sorted, with direction and codecs");
+    ok = ok && check(!strcmp(endpoints->endpoint[2].card_id, "LPE2"),
+                     "card id read");
+    return ok;
+}
+
+static bool check_placement(struct offload_endpoints *endpoints,
+                            unsigned int streams)
+{
+    int placed[64];
+    int preferred = offload_endpoints_find(endpoints, 1, 0);
+    bool ok = true;
+    unsigned int i;
+    int card, device;
+
+    if (streams > 64)
+        streams = 64;
+    for (i = 0; ok && i < streams; i++) {
+        uint32_t tried = 0;
+        uint32_t least = ~0u;
+        int e;
+        for (e = 0; e < endpoints->count; e++) {
+            if (endpoints->endpoint[e].direction == OFFLOAD_ENDPOINT_PLAYBACK &&
+                    endpoints->endpoint[e].streams < least)
+                least = endpoints->endpoint[e].streams;
+        }
+        placed[i] = offload_endpoints_acquire(endpoints,
+                                              OFFLOAD_ENDPOINT_PLAYBACK,
+                                              SND_AUDIOCODEC_MP3, preferred,
+                                              &tried, &card, &device);
+        ok = placed[i] >= 0 && endpoints->endpoint[placed[i]].streams ==
+                                       least + 1;
+    }
+    check(ok, "each stream on a least loaded playback endpoint");
+    ok = ok && check(placed[0] == preferred, "ties go to the configured one");
+
+    // A stream whose first choice is busy moves on, then runs out
+    uint32_t tried = 0;
+    int taken = 0;
+    while (offload_endpoints_acquire(endpoints, OFFLOAD_ENDPOINT_PLAYBACK,
+                                     SND_AUDIOCODEC_MP3, -1, &tried, &card,
+                                     &device) >= 0)
+        taken++;
+    ok = check(taken == 3, "failover visits every playback endpoint") && ok;
+    for (i = 0; i < streams; i++)
+        offload_endpoints_release(endpoints, placed[i]);
+    int e;
+    for (e = 0; e < endpoints->count; e++)
+        if (endpoints->endpoint[e].direction == OFFLOAD_ENDPOINT_PLAYBACK)
+            offload_endpoints_release(endpoints, e);
+
+    tried = 0;
+    int capture = offload_endpoints_acquire(endpoints, OFFLOAD_ENDPOINT_CAPTURE,
+                                            SND_AUDIOCODEC_AMR, -1, &tried,
+                                            &card, &device);
+    ok = check(capture >= 0 && card == 0 && device == 1,
+               "capture placed on the capture endpoint") && ok;
+    offload_endpoints_release(endpoints, capture);
+    for (e = 0; e < endpoints->count; e++)
+        ok = ok && endpoints->endpoint[e].streams == 0;
+    return check(ok, "all released");
+}
+
+static bool check_hal_failover(void)
+{
+    struct compress_sim_config sim;
+    struct offload_harness harness;
+    static uint8_t buffer[4096];
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 20;
+    sim.open_failures = 1;
+    compress_sim_configure(&sim);
+    if (compress_sim_setup_card(COMPRESS_SIM_PROC_ROOT) < 0 ||
+            compress_sim_add_endpoint(COMPRESS_SIM_PROC_ROOT, 1, "LPE2", 0,
+                                      false) < 0)
+        return check(false, "simulated card set up");
+    if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, 44100,
+                             AUDIO_CHANNEL_OUT_STEREO, 128000))
+        return check(false, "HAL opened");
+    ssize_t ret = offload_harness_write_all(&harness, buffer, sizeof(buffer),
+                                            CHECK_CALLBACK_TIMEOUT);
+    harness.dev->dump(harness.dev, STDOUT_FILENO);
+    offload_harness_close(&harness);
+    // The other tools expect the simulated card alone
+    char path[256];
+    static const char * const entries[] = {
+        "card1/compr0/info", "card1/compr0", "card1/id", "card1",
+    };
+    for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", COMPRESS_SIM_PROC_ROOT,
+                 entries[i]);
+        remove(path);
+    }
+    return check(ret == (ssize_t)sizeof(buffer),
+                 "busy endpoint skipped by the HAL");
+}
+
+int main(int argc, char **argv)
+{
+    struct offload_endpoints endpoints;
+    const char *root = COMPRESS_SIM_PROC_ROOT "_endpoints";
+    unsigned int streams = 7;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:")) != -1) {
+        switch (opt) {
+        case 'r':
+            root = optarg;
+            break;
+        case 'n':
+            streams = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r fake_root] [-n streams]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (check_build_tree(root) < 0)
+        return 1;
+    offload_endpoints_init(&endpoints);
+    bool ok = check_discovery(&endpoints, root);
+    ok = ok && check_placement(&endpoints, streams);
+    offload_endpoints_destroy(&endpoints);
+    ok = check_hal_failover() && ok;
+    printf("result: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Plays a sequence of MP3 tracks the way AudioFlinger does for gapless
+ * playback: delay and padding through set_parameters, the track through
+ * non-blocking writes, drain(AUDIO_DRAIN_EARLY_NOTIFY) and the next track
+ * on DRAIN_READY; drain(AUDIO_DRAIN_ALL) after the last one. The simulated
+ * DSP records where each track played, so the silence inserted (positive)
+ * or the content lost (negative) at every boundary is measured in samples,
+ * together with the time from DRAIN_READY to the first write of the next
+ * track. With -F the tracks alternate between MP3 and HE-AAC, announced
+ * with offload_next_format, and every change must be made in place.
+ *
+ *   offload_gapless_check [-t tracks] [-l track_ms] [-s time_scale]
+ *                         [-p pipeline_ms] [-c client_delay_us]
+ *                         [-g max_gap_samples] [-M] [-F]
+ *     -p  decoded audio the DSP holds ahead of its output
+ *     -c  extra time the client takes between DRAIN_READY and the write
+ *     -M  no gapless metadata
+ *     -F  alternate MP3 and HE-AAC tracks, with downsampled SBR
+ *
+ * Output is CSV, one row per boundary:
+ *   boundary,gap_samples,gap_us,callback_to_write_us
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec_offload_aac.h"
+#include "codec_offload_next_format.h"
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define CHECK_SAMPLE_RATE       44100
+#define CHECK_BIT_RATE          128000
+#define CHECK_BLOCK             640     /* bytes of a whole number of samples */
+#define CHECK_CALLBACK_TIMEOUT  2000    /* ms */
+#define CHECK_MAX_TRACKS        32
+
+struct check_track {
+    audio_format_t format;
+    uint32_t bytes;
+    uint32_t delay;             /* true encoder delay and padding */
+    uint32_t padding;
+    uint32_t callback_to_write_us;
+};
+
+int main(int argc, char **argv)
+{
+    struct compress_sim_config sim;
+    struct compress_sim_stats stats;
+    struct compress_sim_track timeline[COMPRESS_SIM_MAX_TRACKS];
+    struct check_track tracks[CHECK_MAX_TRACKS];
+    struct offload_harness harness;
+    unsigned int num_tracks = 6;
+    unsigned int track_ms = 3000;
+    unsigned int pipeline_ms = 500;
+    unsigned int client_delay_us = 0;
+    unsigned int max_gap = 0;
+    bool metadata = true;
+    bool formats = false;
+    uint8_t *buffer;
+    unsigned int i;
+    int opt;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 20;
+    sim.tick_us = 1000;
+    while ((opt = getopt(argc, argv, "t:l:s:p:c:g:MF")) != -1) {
+        switch (opt) {
+        case 't':
+            num_tracks = atoi(optarg);
+            break;
+        case 'l':
+            track_ms = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        case 'p':
+            pipeline_ms = atoi(optarg);
+            break;
+        case 'c':
+            client_delay_us = atoi(optarg);
+            break;
+        case 'g':
+            max_gap = atoi(optarg);
+            break;
+        case 'M':
+            metadata = false;
+            break;
+        case 'F':
+            formats = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t tracks] [-l track_ms] "
+                    "[-s time_scale] [-p pipeline_ms] [-c client_delay_us] "
+                    "[-g max_gap_samples] [-M] [-F]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (num_tracks < 2 || num_tracks > CHECK_MAX_TRACKS)
+        num_tracks = num_tracks < 2 ? 2 : CHECK_MAX_TRACKS;
+    sim.pipeline_us = pipeline_ms * 1000;
+    compress_sim_configure(&sim);
+
+    uint32_t track_bytes = (uint64_t)track_ms * CHECK_BIT_RATE / 8000 /
+                                CHECK_BLOCK * CHECK_BLOCK;
+    if (track_bytes < CHECK_BLOCK)
+        track_bytes = CHECK_BLOCK;
+    buffer = (uint8_t *)calloc(1, track_bytes + CHECK_BLOCK);
+    if (!buffer)
+        return 1;
+    memset(tracks, 0, sizeof(tracks));
+    for (i = 0; i < num_tracks; i++) {
+        // Uneven lengths and trimming, the way real albums come
+        tracks[i].format = formats && i % 2 ? AUDIO_FORMAT_AAC :
+                                             AUDIO_FORMAT_MP3;
+        tracks[i].bytes = track_bytes + (i % 2) * CHECK_BLOCK;
+        tracks[i].delay = 529 + (i % 2) * 576;
+        tracks[i].padding = 288 + (i * 317) % 1152;
+    }
+
+    if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, CHECK_SAMPLE_RATE,
+                             AUDIO_CHANNEL_OUT_STEREO, CHECK_BIT_RATE))
+        return 1;
+    struct audio_stream_out *out = harness.out;
+    compress_sim_reset_timeline();
+    compress_sim_reset_stats();
+
+    uint64_t callback_ns = 0;
+    for (i = 0; i < num_tracks; i++) {
+        char kvpairs[128];
+        if (callback_ns) {
+            if (client_delay_us)
+                usleep(client_delay_us);
+            tracks[i].callback_to_write_us =
+                    (offload_harness_now_ns() - callback_ns) / 1000;
+        }
+        if (metadata) {
+            snprintf(kvpairs, sizeof(kvpairs), "%s=%u;%s=%u",
+                     AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, tracks[i].delay,
+                     AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES, tracks[i].padding);
+            out->common.set_parameters(&out->common, kvpairs);
+        }
+        if (offload_harness_write_all(&harness, buffer, tracks[i].bytes,
+                                      CHECK_CALLBACK_TIMEOUT) < 0) {
+            fprintf(stderr, "track %u: write timed out\n", i);
+            break;
+        }
+        if (i + 1 < num_tracks && tracks[i + 1].format != tracks[i].format) {
+            bool aac = tracks[i + 1].format == AUDIO_FORMAT_AAC;
+            snprintf(kvpairs, sizeof(kvpairs), "%s=%#x,%u,%#x,%u,%d,%d",
+                     OFFLOAD_NEXT_FORMAT_KEY, tracks[i + 1].format,
+                     CHECK_SAMPLE_RATE, AUDIO_CHANNEL_OUT_STEREO,
+                     CHECK_BIT_RATE, aac ? OFFLOAD_AAC_AOT_SBR : 0, aac);
+            out->common.set_parameters(&out->common, kvpairs);
+        }
+        uint32_t drained = offload_harness_events(&harness,
+                                                  STREAM_CBK_EVENT_DRAIN_READY);
+        out->drain(out, i + 1 < num_tracks ? AUDIO_DRAIN_EARLY_NOTIFY :
+                                             AUDIO_DRAIN_ALL);
+        callback_ns = offload_harness_wait_event(&harness,
+                            STREAM_CBK_EVENT_DRAIN_READY, drained + 1,
+                            CHECK_CALLBACK_TIMEOUT);
+        if (!callback_ns) {
+            fprintf(stderr, "track %u: no DRAIN_READY\n", i);
+            break;
+        }
+    }
+
+    int played = compress_sim_get_timeline(timeline, COMPRESS_SIM_MAX_TRACKS);
+    bool ok = played == (int)num_tracks;
+    int64_t worst = 0;
+    if (!ok)
+        fprintf(stderr, "%d tracks played, %u written\n", played, num_tracks);
+    compress_sim_get_stats(&stats);
+    // Every change in place, none through a device reopen
+    if (formats && (stats.closes ||
+                    stats.codec_switches != num_tracks - 1)) {
+        fprintf(stderr, "%u codec changes in place, %u device closes\n",
+                stats.codec_switches, stats.closes);
+        ok = false;
+    }
+    printf("boundary,gap_samples,gap_us,callback_to_write_us\n");
+    for (i = 1; ok && i < num_tracks; i++) {
+        const struct compress_sim_track *prev = &timeline[i - 1];
+        const struct compress_sim_track *next = &timeline[i];
+        // Delay or padding left untrimmed plays as silence inside the track,
+        // trimming more than the encoder added cuts the content
+        int64_t end = (int64_t)prev->last_sample -
+                      ((int64_t)tracks[i - 1].padding - prev->padding);
+        int64_t start = (int64_t)next->first_sample +
+                        ((int64_t)tracks[i].delay - next->delay);
+        int64_t gap = start - end - 1;
+        printf("%u->%u,%lld,%lld,%u\n", i - 1, i, (long long)gap,
+               (long long)(gap * 1000000 / CHECK_SAMPLE_RATE),
+               tracks[i].callback_to_write_us);
+        if ((gap < 0 ? -gap : gap) > (worst < 0 ? -worst : worst))
+            worst = gap;
+    }
+    offload_harness_close(&harness);
+    free(buffer);
+    ok = ok && (worst < 0 ? -worst : worst) <= (int64_t)max_gap;
+    printf("result: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 2;
+}
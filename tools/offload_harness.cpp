@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/properties.h>
+
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+uint64_t offload_harness_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int offload_harness_callback(stream_callback_event_t event, void *param,
+                             void *cookie)
+{
+    struct offload_harness *h = (struct offload_harness *)cookie;
+    uint64_t now = offload_harness_now_ns();
+
+    pthread_mutex_lock(&h->lock);
+    if (event == STREAM_CBK_EVENT_WRITE_READY) {
+        h->write_ready++;
+        h->write_ready_ns = now;
+    } else if (event == STREAM_CBK_EVENT_DRAIN_READY) {
+        h->drain_ready++;
+        h->drain_ready_ns = now;
+    }
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    if (h->callback_work_us)
+        usleep(h->callback_work_us);
+    return 0;
+}
+
+int offload_harness_open(struct offload_harness *h, audio_format_t format,
+                         uint32_t sample_rate, uint32_t channel_mask,
+                         uint32_t bit_rate)
+{
+    struct audio_config *config;
+    int ret;
+
+    memset(h, 0, sizeof(*h));
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+
+    ret = compress_sim_setup_card(COMPRESS_SIM_PROC_ROOT);
+    if (ret)
+        return ret;
+    // The simulation only models the mixer controls: keep the HAL off a
+    // real intel_sst_ctrl unless a backend was asked for.
+    char value[PROPERTY_VALUE_MAX];
+    if (!property_get("offload.backend", value, NULL) &&
+            !(property_get("audio.offload.scalability", value, "0") &&
+              atoi(value) == 1))
+        property_set("offload.backend", "mixer");
+    ret = audio_hw_device_open(&HAL_MODULE_INFO_SYM.common, &h->dev);
+    if (ret) {
+        fprintf(stderr, "cannot open the offload HAL: %d\n", ret);
+        return ret;
+    }
+    h->dev->init_check(h->dev);
+
+    config = &h->config;
+    config->format = format;
+    config->sample_rate = sample_rate;
+    config->channel_mask = channel_mask;
+    config->offload_info.format = format;
+    config->offload_info.sample_rate = sample_rate;
+    config->offload_info.channel_mask = channel_mask;
+    config->offload_info.bit_rate = bit_rate;
+    ret = offload_harness_open_stream(h);
+    if (ret) {
+        audio_hw_device_close(h->dev);
+        h->dev = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+int offload_harness_open_stream(struct offload_harness *h)
+{
+    struct audio_config config = h->config;
+    int ret;
+
+    ret = h->dev->open_output_stream(h->dev, 0, AUDIO_DEVICE_OUT_SPEAKER,
+                (audio_output_flags_t)(AUDIO_OUTPUT_FLAG_DIRECT |
+                                       AUDIO_OUTPUT_FLAG_COMPRESS_OFFLOAD |
+                                       AUDIO_OUTPUT_FLAG_NON_BLOCKING),
+                &config, &h->out);
+    if (ret) {
+        fprintf(stderr, "cannot open the offload stream: %d\n", ret);
+        h->out = NULL;
+        return ret;
+    }
+    h->out->set_callback(h->out, offload_harness_callback, h);
+    return 0;
+}
+
+void offload_harness_close_stream(struct offload_harness *h)
+{
+    if (h->out)
+        h->dev->close_output_stream(h->dev, h->out);
+    h->out = NULL;
+}
+
+void offload_harness_close(struct offload_harness *h)
+{
+    if (h->out)
+        h->dev->close_output_stream(h->dev, h->out);
+    if (h->dev)
+        audio_hw_device_close(h->dev);
+    h->out = NULL;
+    h->dev = NULL;
+    pthread_cond_destroy(&h->cond);
+    pthread_mutex_destroy(&h->lock);
+}
+
+uint64_t offload_harness_wait_event(struct offload_harness *h,
+                                    stream_callback_event_t event,
+                                    uint32_t count, int timeout_ms)
+{
+    struct timespec ts;
+    uint32_t *counter = event == STREAM_CBK_EVENT_WRITE_READY ?
+                            &h->write_ready : &h->drain_ready;
+    uint64_t when = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&h->lock);
+    while (*counter < count) {
+        if (pthread_cond_timedwait(&h->cond, &h->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    if (*counter >= count) {
+        when = event == STREAM_CBK_EVENT_WRITE_READY ? h->write_ready_ns :
+                                                       h->drain_ready_ns;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return when;
+}
+
+uint32_t offload_harness_events(struct offload_harness *h,
+                                stream_callback_event_t event)
+{
+    uint32_t count;
+
+    pthread_mutex_lock(&h->lock);
+    count = event == STREAM_CBK_EVENT_WRITE_READY ? h->write_ready :
+                                                    h->drain_ready;
+    pthread_mutex_unlock(&h->lock);
+    return count;
+}
+
+ssize_t offload_harness_write_all(struct offload_harness *h,
+                                  const void *buffer, size_t bytes,
+                                  int timeout_ms)
+{
+    const uint8_t *src = (const uint8_t *)buffer;
+    size_t done = 0;
+
+    while (done < bytes) {
+        uint32_t ready = offload_harness_events(h,
+                                                STREAM_CBK_EVENT_WRITE_READY);
+        ssize_t sent = h->out->write(h->out, src + done, bytes - done);
+        if (sent < 0)
+            return sent;
+        done += sent;
+        if (done < bytes &&
+                !offload_harness_wait_event(h, STREAM_CBK_EVENT_WRITE_READY,
+                                            ready + 1, timeout_ms))
+            return -ETIMEDOUT;
+    }
+    return done;
+}
+
+int offload_latency_init(struct offload_latency *l, uint32_t capacity)
+{
+    memset(l, 0, sizeof(*l));
+    l->samples = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    if (!l->samples)
+        return -ENOMEM;
+    l->capacity = capacity;
+    return 0;
+}
+
+void offload_latency_add(struct offload_latency *l, uint32_t us)
+{
+    if (l->count < l->capacity)
+        l->samples[l->count] = us;
+    l->count++;
+    l->total += us;
+    if (us > l->max)
+        l->max = us;
+}
+
+static int offload_latency_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint32_t offload_latency_percentile(struct offload_latency *l, unsigned int p)
+{
+    uint32_t n = l->count < l->capacity ? l->count : l->capacity;
+    if (!n)
+        return 0;
+    qsort(l->samples, n, sizeof(uint32_t), offload_latency_compare);
+    return l->samples[(uint64_t)(n - 1) * p / 100];
+}
+
+void offload_latency_free(struct offload_latency *l)
+{
+    free(l->samples);
+    memset(l, 0, sizeof(*l));
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OFFLOAD_HARNESS_H
+#define OFFLOAD_HARNESS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <hardware/audio.h>
+
+/* Opens the offload HAL linked into the tool and plays the AudioFlinger side
+ * of one offloaded output: callback bookkeeping and non-blocking writes.
+ */
+struct offload_harness {
+    struct audio_hw_device *dev;
+    struct audio_stream_out *out;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t write_ready;         /* STREAM_CBK_EVENT_WRITE_READY count */
+    uint32_t drain_ready;         /* STREAM_CBK_EVENT_DRAIN_READY count */
+    uint64_t write_ready_ns;      /* arrival of the last WRITE_READY */
+    uint64_t drain_ready_ns;      /* arrival of the last DRAIN_READY */
+    uint32_t callback_work_us;    /* time spent in the callback after
+                                     signalling, like AudioFlinger's */
+    struct audio_config config;   /* of the offloaded stream */
+};
+
+uint64_t offload_harness_now_ns(void);
+
+int offload_harness_open(struct offload_harness *h, audio_format_t format,
+                         uint32_t sample_rate, uint32_t channel_mask,
+                         uint32_t bit_rate);
+void offload_harness_close(struct offload_harness *h);
+
+/* Closes and reopens the stream alone, keeping the device open */
+void offload_harness_close_stream(struct offload_harness *h);
+int offload_harness_open_stream(struct offload_harness *h);
+
+/* The stream_callback_t the harness installs, cookie is the harness */
+int offload_harness_callback(stream_callback_event_t event, void *param,
+                             void *cookie);
+
+/* Waits until at least 'count' events of the given type have arrived.
+ * Returns the arrival time of the last one, 0 on timeout.
+ */
+uint64_t offload_harness_wait_event(struct offload_harness *h,
+                                    stream_callback_event_t event,
+                                    uint32_t count, int timeout_ms);
+uint32_t offload_harness_events(struct offload_harness *h,
+                                stream_callback_event_t event);
+
+/* Writes the whole buffer, waiting for WRITE_READY after a partial write.
+ * Returns the bytes written, -ETIMEDOUT if no callback came in time.
+ */
+ssize_t offload_harness_write_all(struct offload_harness *h,
+                                  const void *buffer, size_t bytes,
+                                  int timeout_ms);
+
+/* Latency samples in microseconds */
+struct offload_latency {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *samples;
+    uint64_t total;
+    uint32_t max;
+};
+
+int offload_latency_init(struct offload_latency *l, uint32_t capacity);
+void offload_latency_add(struct offload_latency *l, uint32_t us);
+/* p in [0, 100], sorts the samples */
+uint32_t offload_latency_percentile(struct offload_latency *l, unsigned int p);
+void offload_latency_free(struct offload_latency *l);
+
+#endif /* OFFLOAD_HARNESS_H */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Microbenchmark of the set_parameters kvpair parsing: the str_parms based
+ * path the HAL used to run against offload_kv_parse. The precomputed hash
+ * table of the parser is checked first.
+ *
+ *   offload_kvparse_bench [iterations]
+ *   offload_kvparse_bench -g
+ *     -g  prints the seed and slot table for codec_offload_kvparser.cpp
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <system/audio.h>
+#include <hardware/audio.h>
+extern "C" {
+#include <cutils/str_parms.h>
+}
+
+#include "codec_offload_kvparser.h"
+
+struct bench_fields {
+    int bitsPerSample;
+    int avgBitRate;
+    int numChannels;
+    int codecID;
+    int blockAlign;
+    int sampleRate;
+    int encodeOption;
+    int delay;
+    int padding;
+};
+
+static const char * const bench_inputs[] = {
+    /* per track codec parameters */
+    AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE "=128000;"
+    AUDIO_OFFLOAD_CODEC_SAMPLE_RATE "=44100;"
+    AUDIO_OFFLOAD_CODEC_NUM_CHANNEL "=2;"
+    AUDIO_OFFLOAD_CODEC_ID "=2",
+    /* gapless transition */
+    AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES "=576;"
+    AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES "=1152",
+    /* unrelated key */
+    "routing=2",
+};
+
+#define BENCH_NUM_INPUTS (sizeof(bench_inputs) / sizeof(bench_inputs[0]))
+
+/* The lookups out_set_parameters used to do */
+static void bench_str_parms(const char *kvpairs, struct bench_fields *f)
+{
+    struct str_parms *param;
+    int value = 0;
+
+    param = str_parms_create_str(kvpairs);
+    if (param == NULL)
+        return;
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_BIT_PER_SAMPLE, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_BIT_PER_SAMPLE);
+        f->bitsPerSample = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_AVG_BIT_RATE);
+        f->avgBitRate = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_NUM_CHANNEL);
+        f->numChannels = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_ID, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_ID);
+        f->codecID = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_BLOCK_ALIGN, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_BLOCK_ALIGN);
+        f->blockAlign = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_SAMPLE_RATE);
+        f->sampleRate = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_ENCODE_OPTION, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_ENCODE_OPTION);
+        f->encodeOption = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES);
+        f->delay = value;
+    }
+    if (str_parms_get_int(param, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES, &value) >= 0) {
+        str_parms_del(param, AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES);
+        f->padding = value;
+    }
+    str_parms_destroy(param);
+}
+
+static void bench_kv_field(void *context, offload_kv_key_t key,
+                           const char *value, size_t len)
+{
+    struct bench_fields *f = (struct bench_fields *)context;
+    int ivalue;
+
+    if (offload_kv_to_int(value, len, &ivalue) < 0)
+        return;
+    switch (key) {
+        case OFFLOAD_KV_BIT_PER_SAMPLE:  f->bitsPerSample = ivalue; break;
+        case OFFLOAD_KV_AVG_BIT_RATE:    f->avgBitRate = ivalue; break;
+        case OFFLOAD_KV_NUM_CHANNEL:     f->numChannels = ivalue; break;
+        case OFFLOAD_KV_CODEC_ID:        f->codecID = ivalue; break;
+        case OFFLOAD_KV_BLOCK_ALIGN:     f->blockAlign = ivalue; break;
+        case OFFLOAD_KV_SAMPLE_RATE:     f->sampleRate = ivalue; break;
+        case OFFLOAD_KV_ENCODE_OPTION:   f->encodeOption = ivalue; break;
+        case OFFLOAD_KV_DELAY_SAMPLES:   f->delay = ivalue; break;
+        case OFFLOAD_KV_PADDING_SAMPLES: f->padding = ivalue; break;
+        default: break;
+    }
+}
+
+static void bench_kv_parse(const char *kvpairs, struct bench_fields *f)
+{
+    offload_kv_parse(kvpairs, bench_kv_field, f);
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double bench_run(void (*parse)(const char *, struct bench_fields *),
+                        const char *kvpairs, unsigned int iterations)
+{
+    struct bench_fields f;
+    uint64_t start;
+    unsigned int i;
+
+    memset(&f, 0, sizeof(f));
+    start = bench_now_ns();
+    for (i = 0; i < iterations; i++)
+        parse(kvpairs, &f);
+    return (double)(bench_now_ns() - start) / iterations;
+}
+
+#define BENCH_MAX_SEED  10000000
+
+static int bench_generate_table(void)
+{
+    uint8_t slots[OFFLOAD_KV_HASH_SLOTS];
+    uint32_t seed;
+    int i;
+
+    for (seed = 1; seed < BENCH_MAX_SEED; seed++) {
+        memset(slots, 0xff, sizeof(slots));
+        for (i = 0; i < OFFLOAD_KV_NUM_KEYS; i++) {
+            const char *name = offload_kv_key_name((offload_kv_key_t)i);
+            uint32_t slot = offload_kv_hash(seed, name, strlen(name));
+            if (slots[slot] != 0xff)
+                break;
+            slots[slot] = i;
+        }
+        if (i == OFFLOAD_KV_NUM_KEYS)
+            break;
+    }
+    if (seed == BENCH_MAX_SEED) {
+        fprintf(stderr, "no seed below %u puts every key in its own slot\n",
+                BENCH_MAX_SEED);
+        return 1;
+    }
+    printf("#define KV_HASH_SEED    %u\n", seed);
+    printf("static const uint8_t kv_slots[OFFLOAD_KV_HASH_SLOTS] = {\n");
+    for (i = 0; i < OFFLOAD_KV_HASH_SLOTS; i++) {
+        if (slots[i] == 0xff)
+            printf("%s0xff,", i % 8 ? " " : "    ");
+        else
+            printf("%s%4u,", i % 8 ? " " : "    ", slots[i]);
+        if (i % 8 == 7)
+            printf("\n");
+    }
+    printf("};\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iterations = 200000;
+    unsigned int i;
+    int mismatches = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-g"))
+        return bench_generate_table();
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (offload_kv_check_table() < 0) {
+        fprintf(stderr, "stale kvparser hash table, regenerate it with -g\n");
+        return 1;
+    }
+
+    printf("%-8s %14s %14s %8s\n", "input", "str_parms_ns", "kv_parse_ns",
+           "speedup");
+    for (i = 0; i < BENCH_NUM_INPUTS; i++) {
+        struct bench_fields a, b;
+
+        // Both paths must agree before their timings mean anything
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        bench_str_parms(bench_inputs[i], &a);
+        bench_kv_parse(bench_inputs[i], &b);
+        if (memcmp(&a, &b, sizeof(a))) {
+            fprintf(stderr, "result mismatch for \"%s\"\n", bench_inputs[i]);
+            mismatches++;
+        }
+
+        double legacy = bench_run(bench_str_parms, bench_inputs[i], iterations);
+        double single = bench_run(bench_kv_parse, bench_inputs[i], iterations);
+        printf("%-8u %14.1f %14.1f %7.1fx\n", i, legacy, single,
+               single > 0 ? legacy / single : 0.0);
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Concurrent stress of the stream entry points sharing out->lock: one
+ * AudioFlinger-like writer, a render position poller, a volume changer and a
+ * set_callback caller run against the simulated backend together with the
+ * HAL offload thread. Reports per caller latencies, the out->lock statistics
+ * of the HAL (offload.lock.stats) and any caller that stops making progress.
+ *
+ *   offload_lock_bench [-d seconds] [-s time_scale] [-t stall_timeout_ms]
+ *                      [-c callback_work_us]
+ *
+ * The HAL dump includes the WRITE_READY dispatch to next write round trip.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/properties.h>
+
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define BENCH_WRITE_SIZE        (16*1024)
+#define BENCH_CALLBACK_TIMEOUT  2000    /* ms */
+
+enum {
+    BENCH_WRITER,
+    BENCH_POSITION,
+    BENCH_VOLUME,
+    BENCH_CALLBACK,
+    BENCH_NUM_WORKERS
+};
+
+static const char * const bench_names[BENCH_NUM_WORKERS] = {
+    "write", "render_position", "set_volume", "set_callback",
+};
+
+struct bench_worker {
+    pthread_t thread;
+    struct offload_harness *harness;
+    int id;
+    volatile uint32_t progress;     /* calls completed */
+    volatile bool busy;             /* inside a HAL call */
+    struct offload_latency latency;
+    uint32_t timeouts;
+    uint32_t errors;
+};
+
+static volatile bool bench_stop;
+
+static void *bench_worker_loop(void *context)
+{
+    struct bench_worker *w = (struct bench_worker *)context;
+    struct audio_stream_out *out = w->harness->out;
+    static uint8_t buffer[BENCH_WRITE_SIZE];
+    float volume = 1.0f;
+
+    while (!bench_stop) {
+        uint64_t start = offload_harness_now_ns();
+        uint32_t ready = 0;
+        ssize_t sent = 0;
+        int ret = 0;
+
+        w->busy = true;
+        switch (w->id) {
+        case BENCH_WRITER:
+            ready = offload_harness_events(w->harness,
+                                           STREAM_CBK_EVENT_WRITE_READY);
+            sent = out->write(out, buffer, sizeof(buffer));
+            ret = sent < 0 ? (int)sent : 0;
+            break;
+        case BENCH_POSITION: {
+            uint32_t frames;
+            out->get_render_position(out, &frames);
+            break;
+        }
+        case BENCH_VOLUME:
+            volume = volume > 0.5f ? 0.25f : 1.0f;
+            ret = out->set_volume(out, volume, volume);
+            break;
+        case BENCH_CALLBACK:
+            ret = out->set_callback(out, offload_harness_callback, w->harness);
+            break;
+        }
+        w->busy = false;
+        offload_latency_add(&w->latency,
+                            (offload_harness_now_ns() - start) / 1000);
+        if (ret < 0)
+            w->errors++;
+        w->progress++;
+
+        switch (w->id) {
+        case BENCH_WRITER:
+            // Behave like AudioFlinger: after a short write wait for the
+            // HAL to report room in the DSP ring.
+            if (sent >= 0 && sent < (ssize_t)sizeof(buffer) &&
+                    !offload_harness_wait_event(w->harness,
+                                                STREAM_CBK_EVENT_WRITE_READY,
+                                                ready + 1,
+                                                BENCH_CALLBACK_TIMEOUT))
+                w->timeouts++;
+            break;
+        case BENCH_POSITION:
+            usleep(1000);
+            break;
+        case BENCH_VOLUME:
+            usleep(2000);
+            break;
+        case BENCH_CALLBACK:
+            usleep(10000);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct offload_harness harness;
+    struct bench_worker workers[BENCH_NUM_WORKERS];
+    struct compress_sim_config sim;
+    uint32_t last[BENCH_NUM_WORKERS];
+    uint64_t last_change[BENCH_NUM_WORKERS];
+    unsigned int duration = 10;
+    unsigned int stall_ms = 3000;
+    unsigned int callback_work_us = 0;
+    bool stalled = false;
+    int opt, i;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 4;
+    while ((opt = getopt(argc, argv, "d:s:t:c:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        case 't':
+            stall_ms = atoi(optarg);
+            break;
+        case 'c':
+            callback_work_us = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d seconds] [-s time_scale] "
+                    "[-t stall_timeout_ms] [-c callback_work_us]\n", argv[0]);
+            return 1;
+        }
+    }
+    compress_sim_configure(&sim);
+    property_set("offload.lock.stats", "1");
+    if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, 44100,
+                             AUDIO_CHANNEL_OUT_STEREO, 128000))
+        return 1;
+    harness.callback_work_us = callback_work_us;
+
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < BENCH_NUM_WORKERS; i++) {
+        workers[i].harness = &harness;
+        workers[i].id = i;
+        offload_latency_init(&workers[i].latency, 1 << 20);
+    }
+    for (i = 0; i < BENCH_NUM_WORKERS; i++) {
+        pthread_create(&workers[i].thread, NULL, bench_worker_loop,
+                       &workers[i]);
+        last[i] = 0;
+        last_change[i] = offload_harness_now_ns();
+    }
+
+    // Watch for callers stuck inside the HAL
+    uint64_t end = offload_harness_now_ns() + duration * 1000000000ull;
+    while (offload_harness_now_ns() < end && !stalled) {
+        usleep(100000);
+        uint64_t now = offload_harness_now_ns();
+        for (i = 0; i < BENCH_NUM_WORKERS; i++) {
+            if (workers[i].progress != last[i] || !workers[i].busy) {
+                last[i] = workers[i].progress;
+                last_change[i] = now;
+            } else if (now - last_change[i] > stall_ms * 1000000ull) {
+                printf("STALL: %s blocked in the HAL for more than %u ms\n",
+                       bench_names[i], stall_ms);
+                stalled = true;
+            }
+        }
+    }
+
+    if (!stalled) {
+        bench_stop = true;
+        for (i = 0; i < BENCH_NUM_WORKERS; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    printf("%-16s %10s %10s %10s %10s %10s %8s %8s\n", "caller", "calls",
+           "avg_us", "p50_us", "p99_us", "max_us", "errors", "timeouts");
+    for (i = 0; i < BENCH_NUM_WORKERS; i++) {
+        struct bench_worker *w = &workers[i];
+        uint32_t count = w->latency.count;
+        printf("%-16s %10u %10llu %10u %10u %10u %8u %8u\n", bench_names[i],
+               count,
+               (unsigned long long)(count ? w->latency.total / count : 0),
+               offload_latency_percentile(&w->latency, 50),
+               offload_latency_percentile(&w->latency, 99),
+               w->latency.max, w->errors, w->timeouts);
+    }
+    printf("worst-case out_write latency: %u us\n",
+           workers[BENCH_WRITER].latency.max);
+    harness.out->common.dump(&harness.out->common, STDOUT_FILENO);
+
+    if (stalled) {
+        // A deadlocked caller cannot be joined, leave without teardown
+        printf("result: DEADLOCK or stall detected\n");
+        fflush(stdout);
+        _exit(2);
+    }
+
+    for (i = 0; i < BENCH_NUM_WORKERS; i++)
+        offload_latency_free(&workers[i].latency);
+    offload_harness_close(&harness);
+    printf("result: ok\n");
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Replays a trace recorded by the HAL (offload.trace.enable=1) against the
+ * simulated compress backend and reports how the timing of every entry
+ * point compares with the recording.
+ *
+ *   offload_replay [-u] [-s time_scale] <trace>
+ *     -u  unpaced: issue the calls back to back instead of at the recorded
+ *         offsets
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/audio.h>
+
+#include "codec_offload_trace.h"
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define REPLAY_CALLBACK_TIMEOUT_MS  5000
+
+struct replay_op_stats {
+    uint32_t count;
+    uint64_t recorded_us;
+    uint64_t replayed_us;
+    uint32_t recorded_max_us;
+    uint32_t replayed_max_us;
+    uint64_t abs_delta_us;
+    uint32_t ret_mismatch;
+};
+
+static void replay_sleep_until(uint64_t target_ns)
+{
+    uint64_t now = offload_trace_now_ns();
+    if (target_ns > now)
+        usleep((target_ns - now) / 1000);
+}
+
+static float replay_float(int32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void replay_report(const struct replay_op_stats *stats,
+                          uint64_t recorded_total_us,
+                          uint64_t replayed_total_us)
+{
+    int op;
+
+    printf("%-16s %6s %12s %12s %12s %12s %12s %8s\n", "op", "count",
+           "rec_avg_us", "rep_avg_us", "rec_max_us", "rep_max_us",
+           "avg_dlt_us", "ret_mis");
+    for (op = 1; op < OFFLOAD_TRACE_OP_MAX; op++) {
+        const struct replay_op_stats *s = &stats[op];
+        if (!s->count)
+            continue;
+        printf("%-16s %6u %12llu %12llu %12u %12u %12llu %8u\n",
+               offload_trace_op_name(op), s->count,
+               (unsigned long long)(s->recorded_us / s->count),
+               (unsigned long long)(s->replayed_us / s->count),
+               s->recorded_max_us, s->replayed_max_us,
+               (unsigned long long)(s->abs_delta_us / s->count),
+               s->ret_mismatch);
+    }
+    printf("timeline: recorded %llu us, replayed %llu us, drift %lld us\n",
+           (unsigned long long)recorded_total_us,
+           (unsigned long long)replayed_total_us,
+           (long long)replayed_total_us - (long long)recorded_total_us);
+}
+
+int main(int argc, char **argv)
+{
+    struct offload_trace_reader *reader;
+    struct offload_trace_record record;
+    struct replay_op_stats stats[OFFLOAD_TRACE_OP_MAX];
+    struct compress_sim_config sim;
+    struct offload_harness harness;
+    struct audio_stream_out *out;
+    uint8_t *zeros = NULL;
+    size_t zeros_size = 0;
+    bool paced = true;
+    uint64_t recorded_us = 0;
+    uint64_t start_ns;
+    uint32_t write_ready = 0;
+    uint32_t drain_ready = 0;
+    int opt, ret;
+
+    compress_sim_get_default_config(&sim);
+    while ((opt = getopt(argc, argv, "us:")) != -1) {
+        switch (opt) {
+        case 'u':
+            paced = false;
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-u] [-s time_scale] <trace>\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-u] [-s time_scale] <trace>\n", argv[0]);
+        return 1;
+    }
+
+    reader = (struct offload_trace_reader *)calloc(1, sizeof(*reader));
+    if (!reader || offload_trace_reader_open(reader, argv[optind]) < 0)
+        return 1;
+    if (offload_trace_reader_next(reader, &record) != 1 ||
+            record.op != OFFLOAD_TRACE_OPEN) {
+        fprintf(stderr, "trace does not start with a stream open\n");
+        return 1;
+    }
+
+    compress_sim_configure(&sim);
+    if (offload_harness_open(&harness, (audio_format_t)record.arg0,
+                             record.arg1, record.arg2, record.ret))
+        return 1;
+    out = harness.out;
+
+    memset(stats, 0, sizeof(stats));
+    start_ns = offload_trace_now_ns();
+    while ((ret = offload_trace_reader_next(reader, &record)) == 1) {
+        uint64_t call_ns;
+        uint32_t replayed;
+        int32_t result = 0;
+
+        recorded_us += record.delta_us;
+        if (paced)
+            replay_sleep_until(start_ns + recorded_us * 1000);
+
+        call_ns = offload_trace_now_ns();
+        switch (record.op) {
+        case OFFLOAD_TRACE_SET_PARAMETERS:
+            result = out->common.set_parameters(&out->common,
+                                                (const char *)reader->data);
+            break;
+        case OFFLOAD_TRACE_WRITE: {
+            const void *buffer = reader->data;
+            if (record.len != (uint32_t)record.arg0) {
+                if (zeros_size < (size_t)record.arg0) {
+                    free(zeros);
+                    zeros_size = record.arg0;
+                    zeros = (uint8_t *)calloc(1, zeros_size);
+                }
+                buffer = zeros;
+            }
+            result = out->write(out, buffer, record.arg0);
+            break;
+        }
+        case OFFLOAD_TRACE_PAUSE:
+            result = out->pause(out);
+            break;
+        case OFFLOAD_TRACE_RESUME:
+            result = out->resume(out);
+            break;
+        case OFFLOAD_TRACE_DRAIN:
+            result = out->drain(out, (audio_drain_type_t)record.arg0);
+            break;
+        case OFFLOAD_TRACE_FLUSH:
+            result = out->flush(out);
+            break;
+        case OFFLOAD_TRACE_STANDBY:
+            result = out->common.standby(&out->common);
+            break;
+        case OFFLOAD_TRACE_SET_VOLUME:
+            result = out->set_volume(out, replay_float(record.arg0),
+                                     replay_float(record.arg1));
+            break;
+        case OFFLOAD_TRACE_RENDER_POSITION: {
+            uint32_t frames;
+            result = out->get_render_position(out, &frames);
+            break;
+        }
+        case OFFLOAD_TRACE_CALLBACK: {
+            // The recorded callback delivery is an output of the HAL: compare
+            // when the replayed one arrives with the recorded offset.
+            stream_callback_event_t event = (stream_callback_event_t)record.arg0;
+            uint32_t *count = event == STREAM_CBK_EVENT_WRITE_READY ?
+                                  &write_ready : &drain_ready;
+            uint64_t when = offload_harness_wait_event(&harness, event,
+                                    ++*count, REPLAY_CALLBACK_TIMEOUT_MS);
+            uint64_t expected = start_ns + recorded_us * 1000;
+            struct replay_op_stats *s = &stats[record.op];
+            if (!when) {
+                fprintf(stderr, "callback event %d #%u never arrived\n",
+                        event, *count);
+                s->ret_mismatch++;
+                continue;
+            }
+            uint64_t late = when > expected ? when - expected :
+                                              expected - when;
+            s->count++;
+            s->abs_delta_us += late / 1000;
+            continue;
+        }
+        case OFFLOAD_TRACE_CLOSE:
+        default:
+            continue;
+        }
+
+        replayed = (uint32_t)((offload_trace_now_ns() - call_ns) / 1000);
+        struct replay_op_stats *s = &stats[record.op];
+        s->count++;
+        s->recorded_us += record.duration_us;
+        s->replayed_us += replayed;
+        if (record.duration_us > s->recorded_max_us)
+            s->recorded_max_us = record.duration_us;
+        if (replayed > s->replayed_max_us)
+            s->replayed_max_us = replayed;
+        s->abs_delta_us += replayed > record.duration_us ?
+                               replayed - record.duration_us :
+                               record.duration_us - replayed;
+        if (result != record.ret)
+            s->ret_mismatch++;
+    }
+
+    replay_report(stats, recorded_us,
+                  (offload_trace_now_ns() - start_ns) / 1000);
+    offload_harness_close(&harness);
+    offload_trace_reader_close(reader);
+    free(reader);
+    free(zeros);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Pushes the same amount of data through the offload HAL twice, against a
+ * fast simulated DSP: once the AudioFlinger way (the track is produced into
+ * its own buffer, copied into the sink buffer and passed to out_write) and
+ * once through the offload_shm ring the track is produced into in place.
+ * Reports the byte copies per delivered byte, counting the client copies
+ * and the ones of the simulated kernel, and the throughput.
+ *
+ *   offload_shm_bench [-m megabytes] [-s time_scale] [-b bit_rate]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec_offload_shm.h"
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define BENCH_CALLBACK_TIMEOUT  2000    /* ms */
+
+enum {
+    BENCH_COPY,
+    BENCH_SHM,
+    BENCH_NUM_MODES
+};
+
+static const char * const bench_modes[BENCH_NUM_MODES] = {
+    "copy", "shm",
+};
+
+struct bench_result {
+    uint64_t delivered;
+    uint64_t client_copied;
+    uint64_t kernel_copied;
+    uint64_t wall_ns;
+    uint32_t out_writes;
+    uint32_t driver_writes;
+    uint32_t timeouts;
+};
+
+/* Stands for the decoder or app filling the track buffer */
+static void bench_produce(uint8_t *dst, uint32_t bytes, uint64_t offset)
+{
+    memset(dst, (int)(offset >> 10), bytes);
+}
+
+/* Waits for WRITE_READY when the HAL did not take everything */
+static bool bench_wait(struct offload_harness *h, uint32_t ready,
+                       ssize_t sent, size_t asked)
+{
+    if (sent >= 0 && (size_t)sent >= asked)
+        return true;
+    return offload_harness_wait_event(h, STREAM_CBK_EVENT_WRITE_READY,
+                                      ready + 1, BENCH_CALLBACK_TIMEOUT) != 0;
+}
+
+static int bench_copy(struct offload_harness *h, uint64_t total,
+                      struct bench_result *r)
+{
+    struct audio_stream_out *out = h->out;
+    size_t chunk = out->common.get_buffer_size(&out->common);
+    uint8_t *track = (uint8_t *)malloc(chunk);
+    uint8_t *sink = (uint8_t *)malloc(chunk);
+
+    if (!track || !sink) {
+        free(track);
+        free(sink);
+        return -ENOMEM;
+    }
+    while (r->delivered < total) {
+        size_t pending = chunk;
+        size_t done = 0;
+        bench_produce(track, chunk, r->delivered);
+        memcpy(sink, track, chunk);
+        r->client_copied += chunk;
+        while (done < pending) {
+            uint32_t ready = offload_harness_events(h,
+                                        STREAM_CBK_EVENT_WRITE_READY);
+            ssize_t sent = out->write(out, sink + done, pending - done);
+            r->out_writes++;
+            if (sent < 0)
+                return (int)sent;
+            done += sent;
+            if (!bench_wait(h, ready, done, pending))
+                r->timeouts++;
+        }
+        r->delivered += chunk;
+    }
+    free(track);
+    free(sink);
+    return 0;
+}
+
+static int bench_shm(struct offload_harness *h, uint64_t total,
+                     struct bench_result *r)
+{
+    struct audio_stream_out *out = h->out;
+    struct offload_shm shm;
+    int fd;
+    unsigned int size;
+    int ret;
+
+    char *reply = out->common.get_parameters(&out->common, OFFLOAD_SHM_KEY);
+    if (!reply || sscanf(reply, OFFLOAD_SHM_KEY "=%d:%u", &fd, &size) != 2) {
+        fprintf(stderr, "no shared ring: %s\n", reply ? reply : "(null)");
+        free(reply);
+        return -ENOSYS;
+    }
+    free(reply);
+    ret = offload_shm_map(&shm, fd);
+    if (ret < 0)
+        return ret;
+
+    uint64_t produced = 0;
+    while (r->delivered < total) {
+        uint8_t *dst;
+        uint32_t space;
+        // Produce straight into the ring, then hand what is pending over
+        while (produced < total &&
+               (space = offload_shm_write_space(&shm, &dst)) != 0) {
+            if (space > total - produced)
+                space = total - produced;
+            bench_produce(dst, space, produced);
+            offload_shm_write_commit(&shm, space);
+            produced += space;
+        }
+        uint32_t pending = offload_shm_pending(&shm);
+        uint32_t ready = offload_harness_events(h,
+                                    STREAM_CBK_EVENT_WRITE_READY);
+        ssize_t sent = out->write(out, NULL, pending);
+        r->out_writes++;
+        if (sent < 0) {
+            ret = (int)sent;
+            break;
+        }
+        r->delivered += sent;
+        if (!bench_wait(h, ready, sent, pending))
+            r->timeouts++;
+    }
+    offload_shm_release(&shm);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct compress_sim_config sim;
+    struct compress_sim_stats stats;
+    struct bench_result results[BENCH_NUM_MODES];
+    unsigned int megabytes = 64;
+    unsigned int bit_rate = 320000;
+    int opt, mode;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 2000;
+    sim.tick_us = 1000;
+    while ((opt = getopt(argc, argv, "m:s:b:")) != -1) {
+        switch (opt) {
+        case 'm':
+            megabytes = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        case 'b':
+            bit_rate = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m megabytes] [-s time_scale] "
+                    "[-b bit_rate]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(results, 0, sizeof(results));
+    for (mode = 0; mode < BENCH_NUM_MODES; mode++) {
+        struct offload_harness harness;
+        struct bench_result *r = &results[mode];
+        int ret;
+
+        compress_sim_configure(&sim);
+        if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, 44100,
+                                 AUDIO_CHANNEL_OUT_STEREO, bit_rate))
+            return 1;
+        compress_sim_reset_stats();
+        uint64_t start = offload_harness_now_ns();
+        if (mode == BENCH_COPY)
+            ret = bench_copy(&harness, (uint64_t)megabytes << 20, r);
+        else
+            ret = bench_shm(&harness, (uint64_t)megabytes << 20, r);
+        r->wall_ns = offload_harness_now_ns() - start;
+        compress_sim_get_stats(&stats);
+        r->kernel_copied = stats.bytes_copied;
+        r->driver_writes = stats.writes;
+        if (mode == BENCH_SHM)
+            harness.out->common.dump(&harness.out->common, STDOUT_FILENO);
+        offload_harness_close(&harness);
+        if (ret < 0) {
+            fprintf(stderr, "%s mode failed: %d\n", bench_modes[mode], ret);
+            return 1;
+        }
+    }
+
+    printf("%-6s %10s %12s %12s %10s %10s %10s %8s\n", "mode", "MB",
+           "copies/byte", "MB/s", "out_write", "drv_write", "wall_ms",
+           "timeouts");
+    for (mode = 0; mode < BENCH_NUM_MODES; mode++) {
+        struct bench_result *r = &results[mode];
+        double copies = r->delivered ?
+                (double)(r->client_copied + r->kernel_copied) / r->delivered :
+                0;
+        double mbps = r->wall_ns ?
+                (double)r->delivered / (1 << 20) * 1e9 / r->wall_ns : 0;
+        printf("%-6s %10llu %12.2f %12.1f %10u %10u %10llu %8u\n",
+               bench_modes[mode], (unsigned long long)(r->delivered >> 20),
+               copies, mbps, r->out_writes, r->driver_writes,
+               (unsigned long long)(r->wall_ns / 1000000), r->timeouts);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Hangs the simulated DSP in the middle of a stream and checks that the HAL
+ * watchdog (offload.watchdog.ms) recovers it: the blocked callback arrives
+ * within two watchdog periods, since the DSP position is checked once per
+ * period, plus the recovery bound after the hang, the
+ * render position does not go back and the gapless metadata is sent to the
+ * new stream. With -D, DRAIN_READY must only come once the bytes the hung
+ * DSP had not played were played by the new stream (offload.watchdog.replay).
+ *
+ *   offload_stall_check [-w watchdog_ms] [-a stall_after_ms] [-s time_scale]
+ *                       [-D] [-S]
+ *     -D  hang the DSP during a full drain instead of a buffer wait
+ *     -S  no replay: the unplayed bytes are skipped, not played again
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <cutils/properties.h>
+
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define CHECK_BIT_RATE          128000
+#define CHECK_WRITE_SIZE        (8*1024)
+#define CHECK_RECOVERY_MS       500     /* allowed beyond the watchdog */
+
+int main(int argc, char **argv)
+{
+    struct compress_sim_config sim;
+    struct compress_sim_stats stats;
+    struct offload_harness harness;
+    static uint8_t buffer[CHECK_WRITE_SIZE];
+    unsigned int watchdog_ms = 1000;
+    unsigned int stall_after_ms = 2000;
+    bool drain = false;
+    bool replay = true;
+    uint32_t last_position = 0;
+    uint32_t position_drops = 0;
+    uint64_t recovery_ns = 0;
+    uint64_t accepted = 0;              /* bytes out_write took */
+    uint32_t tail_ms = 0;               /* unplayed at the hang, scaled */
+    bool tail_played = true;
+    int opt, i;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 4;
+    while ((opt = getopt(argc, argv, "w:a:s:DS")) != -1) {
+        switch (opt) {
+        case 'w':
+            watchdog_ms = atoi(optarg);
+            break;
+        case 'a':
+            stall_after_ms = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        case 'D':
+            drain = true;
+            break;
+        case 'S':
+            replay = false;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w watchdog_ms] [-a stall_after_ms] "
+                    "[-s time_scale] [-D] [-S]\n", argv[0]);
+            return 1;
+        }
+    }
+    sim.stall_after_bytes = (uint64_t)stall_after_ms * CHECK_BIT_RATE / 8000;
+    sim.stall_streams = 1;
+    compress_sim_configure(&sim);
+    char value[PROPERTY_VALUE_MAX];
+    snprintf(value, sizeof(value), "%u", watchdog_ms);
+    property_set("offload.watchdog.ms", value);
+    property_set("offload.watchdog.replay", replay ? "1" : "0");
+    if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, 44100,
+                             AUDIO_CHANNEL_OUT_STEREO, CHECK_BIT_RATE))
+        return 1;
+    struct audio_stream_out *out = harness.out;
+    out->common.set_parameters(&out->common,
+                               AUDIO_OFFLOAD_CODEC_DELAY_SAMPLES "=529;"
+                               AUDIO_OFFLOAD_CODEC_PADDING_SAMPLES "=1152");
+
+    // Stream until the injected hang happened and the stream came back
+    uint64_t deadline = offload_harness_now_ns() +
+                        (uint64_t)(stall_after_ms / sim.time_scale +
+                                   4 * watchdog_ms + 2000) * 1000000;
+    bool recovered = false;
+    while (!recovered && offload_harness_now_ns() < deadline) {
+        uint32_t position;
+        ssize_t sent;
+
+        compress_sim_get_stats(&stats);
+        if (drain && stats.stalls == 0 &&
+                stats.bytes_written >= sim.stall_after_bytes) {
+            // Everything the DSP will play is queued: drain into the hang
+            uint32_t drained = offload_harness_events(&harness,
+                                                STREAM_CBK_EVENT_DRAIN_READY);
+            tail_ms = (uint32_t)((accepted - sim.stall_after_bytes) * 8000 /
+                                 CHECK_BIT_RATE / sim.time_scale);
+            out->drain(out, AUDIO_DRAIN_ALL);
+            uint64_t when = offload_harness_wait_event(&harness,
+                                STREAM_CBK_EVENT_DRAIN_READY, drained + 1,
+                                4 * watchdog_ms + CHECK_RECOVERY_MS + tail_ms);
+            compress_sim_get_stats(&stats);
+            if (when && stats.stalls)
+                recovery_ns = when - stats.stall_ns;
+            tail_played = !replay || stats.bytes_rendered >= accepted;
+            recovered = when != 0 && stats.opens > 1;
+            break;
+        }
+        uint32_t ready = offload_harness_events(&harness,
+                                                STREAM_CBK_EVENT_WRITE_READY);
+        sent = out->write(out, buffer, sizeof(buffer));
+        if (sent < 0) {
+            fprintf(stderr, "write failed: %d\n", (int)sent);
+            break;
+        }
+        accepted += sent;
+        if (sent < (ssize_t)sizeof(buffer)) {
+            uint64_t when = offload_harness_wait_event(&harness,
+                                STREAM_CBK_EVENT_WRITE_READY, ready + 1,
+                                4 * watchdog_ms + CHECK_RECOVERY_MS);
+            if (!when) {
+                fprintf(stderr, "no WRITE_READY after the hang\n");
+                break;
+            }
+            compress_sim_get_stats(&stats);
+            if (stats.stalls && !recovery_ns)
+                recovery_ns = when - stats.stall_ns;
+        }
+        if (out->get_render_position(out, &position) == 0) {
+            if (position < last_position)
+                position_drops++;
+            last_position = position;
+        }
+        compress_sim_get_stats(&stats);
+        recovered = stats.stalls && stats.starts > 1;
+    }
+    // A few more writes on the new stream to see the position move on
+    for (i = 0; recovered && !drain && i < 8; i++) {
+        uint32_t position;
+        offload_harness_write_all(&harness, buffer, sizeof(buffer),
+                                  4 * watchdog_ms);
+        if (out->get_render_position(out, &position) == 0) {
+            if (position < last_position)
+                position_drops++;
+            last_position = position;
+        }
+    }
+
+    compress_sim_get_stats(&stats);
+    printf("stalls %u opens %u closes %u metadata_sets %u\n", stats.stalls,
+           stats.opens, stats.closes, stats.metadata_sets);
+    printf("hang to callback: %llu ms (watchdog %u ms)\n",
+           (unsigned long long)(recovery_ns / 1000000), watchdog_ms);
+    printf("final position %u ms, position went back %u times\n",
+           last_position, position_drops);
+    if (drain)
+        printf("drained %llu of %llu bytes written\n",
+               (unsigned long long)stats.bytes_rendered,
+               (unsigned long long)accepted);
+    out->common.dump(&out->common, STDOUT_FILENO);
+
+    bool ok = recovered && stats.stalls == 1 && stats.opens == 2 &&
+              stats.metadata_sets >= 2 && !position_drops &&
+              tail_played && recovery_ns &&
+              recovery_ns <= (uint64_t)(2 * watchdog_ms + CHECK_RECOVERY_MS +
+                                        tail_ms) * 1000000;
+    offload_harness_close(&harness);
+    printf("result: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Latency of the stream control transitions against the simulated compress
+ * backend: every transition runs 'iterations' times from a playing stream
+ * and its latency is taken end to end, i.e. up to the DRAIN_READY callback
+ * for the drains. The driver delays of the simulation are configurable.
+ *
+ *   offload_transition_bench [-n iterations] [-s time_scale]
+ *                            [-d call=us[,call=us...]]
+ *     calls: open close write start stop pause resume drain
+ *
+ * Output is CSV, one row per transition:
+ *   transition,count,errors,p50_us,p99_us,max_us
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress_sim.h"
+#include "offload_harness.h"
+
+#define BENCH_CHUNK             4096    /* bytes written before a transition */
+#define BENCH_CALLBACK_TIMEOUT  2000    /* ms */
+
+enum {
+    BENCH_OPEN,
+    BENCH_CLOSE,
+    BENCH_PAUSE,
+    BENCH_RESUME,
+    BENCH_FLUSH,
+    BENCH_STANDBY,
+    BENCH_DRAIN_ALL,
+    BENCH_DRAIN_EARLY,
+    BENCH_NUM_TRANSITIONS
+};
+
+static const char * const bench_names[BENCH_NUM_TRANSITIONS] = {
+    "open_output_stream", "close_output_stream", "pause", "resume", "flush",
+    "standby", "drain_all", "drain_early_notify",
+};
+
+struct bench_transition {
+    struct offload_latency latency;
+    uint32_t errors;
+};
+
+static uint8_t bench_buffer[BENCH_CHUNK];
+
+static void bench_add(struct bench_transition *t, uint64_t start_ns, int ret)
+{
+    offload_latency_add(&t->latency,
+                        (offload_harness_now_ns() - start_ns) / 1000);
+    if (ret < 0)
+        t->errors++;
+}
+
+static int bench_play(struct offload_harness *h)
+{
+    ssize_t ret = offload_harness_write_all(h, bench_buffer,
+                                            sizeof(bench_buffer),
+                                            BENCH_CALLBACK_TIMEOUT);
+    return ret < 0 ? (int)ret : 0;
+}
+
+static int bench_drain(struct offload_harness *h, audio_drain_type_t type)
+{
+    uint32_t drained = offload_harness_events(h, STREAM_CBK_EVENT_DRAIN_READY);
+    int ret = h->out->drain(h->out, type);
+    if (ret < 0)
+        return ret;
+    if (!offload_harness_wait_event(h, STREAM_CBK_EVENT_DRAIN_READY,
+                                    drained + 1, BENCH_CALLBACK_TIMEOUT))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+static int bench_set_delay(struct compress_sim_config *sim, const char *spec)
+{
+    char name[16];
+    unsigned int us;
+    int consumed;
+
+    while (sscanf(spec, "%15[a-z]=%u%n", name, &us, &consumed) == 2) {
+        if (!strcmp(name, "open"))
+            sim->open_delay_us = us;
+        else if (!strcmp(name, "close"))
+            sim->close_delay_us = us;
+        else if (!strcmp(name, "write"))
+            sim->write_delay_us = us;
+        else if (!strcmp(name, "start"))
+            sim->start_delay_us = us;
+        else if (!strcmp(name, "stop"))
+            sim->stop_delay_us = us;
+        else if (!strcmp(name, "pause"))
+            sim->pause_delay_us = us;
+        else if (!strcmp(name, "resume"))
+            sim->resume_delay_us = us;
+        else if (!strcmp(name, "drain"))
+            sim->drain_delay_us = us;
+        else
+            return -EINVAL;
+        spec += consumed;
+        if (*spec != ',')
+            return *spec ? -EINVAL : 0;
+        spec++;
+    }
+    return -EINVAL;
+}
+
+int main(int argc, char **argv)
+{
+    struct compress_sim_config sim;
+    struct offload_harness harness;
+    struct bench_transition transitions[BENCH_NUM_TRANSITIONS];
+    unsigned int iterations = 1000;
+    unsigned int i;
+    int opt, t;
+
+    compress_sim_get_default_config(&sim);
+    sim.time_scale = 100;
+    sim.tick_us = 1000;
+    while ((opt = getopt(argc, argv, "n:s:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            sim.time_scale = atoi(optarg);
+            break;
+        case 'd':
+            if (bench_set_delay(&sim, optarg) == 0)
+                break;
+            // fall through
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s time_scale] "
+                    "[-d call=us[,call=us...]]\n", argv[0]);
+            return 1;
+        }
+    }
+    compress_sim_configure(&sim);
+    for (t = 0; t < BENCH_NUM_TRANSITIONS; t++) {
+        memset(&transitions[t], 0, sizeof(transitions[t]));
+        offload_latency_init(&transitions[t].latency, iterations);
+    }
+    if (offload_harness_open(&harness, AUDIO_FORMAT_MP3, 44100,
+                             AUDIO_CHANNEL_OUT_STEREO, 128000))
+        return 1;
+
+    for (i = 0; i < iterations; i++) {
+        struct audio_stream_out *out;
+        uint64_t start;
+        int ret;
+
+        // Stream open and close, including the offload thread handoffs
+        offload_harness_close_stream(&harness);
+        start = offload_harness_now_ns();
+        ret = offload_harness_open_stream(&harness);
+        bench_add(&transitions[BENCH_OPEN], start, ret);
+        if (ret < 0)
+            break;
+        bench_play(&harness);
+        start = offload_harness_now_ns();
+        offload_harness_close_stream(&harness);
+        bench_add(&transitions[BENCH_CLOSE], start, 0);
+        if (offload_harness_open_stream(&harness) < 0)
+            break;
+        out = harness.out;
+
+        bench_play(&harness);
+        start = offload_harness_now_ns();
+        ret = out->pause(out);
+        bench_add(&transitions[BENCH_PAUSE], start, ret);
+        start = offload_harness_now_ns();
+        ret = out->resume(out);
+        bench_add(&transitions[BENCH_RESUME], start, ret);
+
+        // AudioFlinger flushes a paused stream
+        bench_play(&harness);
+        out->pause(out);
+        start = offload_harness_now_ns();
+        ret = out->flush(out);
+        bench_add(&transitions[BENCH_FLUSH], start, ret);
+
+        bench_play(&harness);
+        start = offload_harness_now_ns();
+        ret = out->common.standby(&out->common);
+        bench_add(&transitions[BENCH_STANDBY], start, ret);
+
+        bench_play(&harness);
+        start = offload_harness_now_ns();
+        ret = bench_drain(&harness, AUDIO_DRAIN_ALL);
+        bench_add(&transitions[BENCH_DRAIN_ALL], start, ret);
+
+        bench_play(&harness);
+        start = offload_harness_now_ns();
+        ret = bench_drain(&harness, AUDIO_DRAIN_EARLY_NOTIFY);
+        bench_add(&transitions[BENCH_DRAIN_EARLY], start, ret);
+        out->common.standby(&out->common);
+    }
+
+    printf("transition,count,errors,p50_us,p99_us,max_us\n");
+    for (t = 0; t < BENCH_NUM_TRANSITIONS; t++) {
+        struct bench_transition *b = &transitions[t];
+        printf("%s,%u,%u,%u,%u,%u\n", bench_names[t], b->latency.count,
+               b->errors, offload_latency_percentile(&b->latency, 50),
+               offload_latency_percentile(&b->latency, 99), b->latency.max);
+        offload_latency_free(&b->latency);
+    }
+    offload_harness_close(&harness);
+    return 0;
+}